@@ -38,6 +38,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "base64.h"
+#include "util.h"
+
+#if !defined(SDB_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SDB_HAVE_X86_SIMD
+	#include <immintrin.h>
+#endif
  
 
 /*
@@ -67,31 +77,409 @@ void encodeblock(const unsigned char* in, unsigned char* out, int len)
 
 
 /**
- * Encode a buffer using base64 
- *
- * @param input the input buffer
- * @param output the output buffer (must be large enough to receive the entire output)
- * @param length the length of the input buffer
- * @return the length of the output
+ * The reverse translation table (-1 for characters outside of the alphabet)
  */
-int encode64(const char* input, char* output, int length)
+static const signed char cd64[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+
+/**
+ * Encode a buffer using base64 (the reference implementation)
+ */
+static int encode64_scalar(const unsigned char* input, char* output, int length)
 {
-	unsigned char in[3];
-	int i, j, bytes = 0;
+	int j, bytes = 0;
+	
+	for (j = 0; j + 3 <= length; j += 3) {
+		encodeblock(input + j, (unsigned char*) output + bytes, 3);
+		bytes += 4;
+	}
 	
-	for (j = 0; j < length; j += 3) {
+	if (j < length) {
+		unsigned char in[3] = { 0, 0, 0 };
+		memcpy(in, input + j, length - j);
+		encodeblock(in, (unsigned char*) output + bytes, length - j);
+		bytes += 4;
+	}
 	
-		int len = length - j;
-		if (len >= 3) len = 3;
-		for (i = 0; i < len; i++) in[i] = input[j + i];
-		for (i = len; i < 3; i++) in[i] = 0; 
+	output[bytes] = '\0';
+	return bytes;
+}
+
+
+/**
+ * Decode a base64 buffer (the reference implementation)
+ */
+static int decode64_scalar(const unsigned char* input, char* output, int length)
+{
+	int j, bytes = 0;
+	
+	if (length % 4 != 0) return -1;
+	
+	for (j = 0; j < length; j += 4) {
+		
+		int a = cd64[input[j]];
+		int b = cd64[input[j + 1]];
+		int c = cd64[input[j + 2]];
+		int d = cd64[input[j + 3]];
+		
+		
+		// Handle the padding of the last block
 		
-		if (len > 0) {
-			encodeblock(in, (unsigned char*) output + bytes, len);
-			bytes += 4;
+		if (j + 4 == length && input[j + 3] == '=') {
+			if (a < 0 || b < 0) return -1;
+			output[bytes++] = (char) ((a << 2) | (b >> 4));
+			if (input[j + 2] == '=') {
+				if (b & 0x0f) return -1;
+				break;
+			}
+			if (c < 0 || (c & 0x03)) return -1;
+			output[bytes++] = (char) ((b << 4) | (c >> 2));
+			break;
 		}
+		
+		if ((a | b | c | d) < 0) return -1;
+		output[bytes++] = (char) ((a << 2) | (b >> 4));
+		output[bytes++] = (char) ((b << 4) | (c >> 2));
+		output[bytes++] = (char) ((c << 6) | d);
 	}
 	
-	output[bytes] = '\0';
 	return bytes;
 }
+
+
+#ifdef SDB_HAVE_X86_SIMD
+
+/*
+ * The vectorized codecs follow the approach of Wojciech Mula and Daniel Lemire
+ * (http://0x80.pl/articles/index.html#base64-algorithm-new): the bytes are
+ * reshuffled so that every 32-bit lane holds one 3-byte group, the 6-bit
+ * fields are moved into place using multiplications, and the translation
+ * between the 6-bit values and ASCII is done using small pshufb lookups.
+ * 
+ * The encoder reads up to 4 bytes past the 12 (SSSE3) or 24 (AVX2) bytes it
+ * consumes, and the decoder writes up to 4 (or 8) bytes past the 12 (or 24)
+ * bytes it produces, so the loops stop early enough for these to stay inside
+ * the buffers. The rest is handled by the narrower kernels and finally by the
+ * scalar code, which also does the validation of the padding. The AVX2 kernels
+ * clear the upper halves of the registers before handing over to the SSSE3
+ * code to avoid the AVX-SSE transition penalty.
+ */
+
+
+/**
+ * Translate 6-bit values to the base64 alphabet (SSSE3)
+ */
+__attribute__((target("ssse3")))
+static inline __m128i encode64_translate_ssse3(__m128i indices)
+{
+	const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+										'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+										'/' - 63, 'A', 0, 0);
+	
+	__m128i r = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+	
+	return _mm_add_epi8(_mm_shuffle_epi8(shift, r), indices);
+}
+
+
+/**
+ * Split 12 bytes into 16 6-bit values (SSSE3)
+ */
+__attribute__((target("ssse3")))
+static inline __m128i encode64_split_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	
+	__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	
+	return _mm_or_si128(t1, t3);
+}
+
+
+/**
+ * Encode a buffer using base64 (SSSE3)
+ */
+__attribute__((target("ssse3")))
+static int encode64_ssse3(const unsigned char* input, char* output, int length)
+{
+	int i = 0, bytes = 0;
+	
+	for ( ; i + 16 <= length; i += 12, bytes += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i*) (input + i));
+		_mm_storeu_si128((__m128i*) (output + bytes), encode64_translate_ssse3(encode64_split_ssse3(in)));
+	}
+	
+	return bytes + encode64_scalar(input + i, output + bytes, length - i);
+}
+
+
+/**
+ * Translate base64 characters to 6-bit values (SSSE3)
+ * 
+ * @param in the input vector
+ * @param values the output vector
+ * @return non-zero if all characters are valid
+ */
+__attribute__((target("ssse3")))
+static inline int decode64_translate_ssse3(__m128i in, __m128i* values)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+										 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+										 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	
+	__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+	__m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+	
+	__m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles), _mm_shuffle_epi8(lut_hi, hi_nibbles));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xffff) return 0;
+	
+	__m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2f));
+	*values = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles)));
+	return 1;
+}
+
+
+/**
+ * Pack 16 6-bit values into 12 bytes (SSSE3)
+ */
+__attribute__((target("ssse3")))
+static inline __m128i decode64_pack_ssse3(__m128i values)
+{
+	__m128i t = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	t = _mm_madd_epi16(t, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(t, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+
+/**
+ * Decode a base64 buffer (SSSE3)
+ */
+__attribute__((target("ssse3")))
+static int decode64_ssse3(const unsigned char* input, char* output, int length)
+{
+	int i = 0, bytes = 0;
+	
+	if (length % 4 != 0) return -1;
+	
+	for ( ; i + 24 <= length; i += 16, bytes += 12) {
+		__m128i values;
+		if (!decode64_translate_ssse3(_mm_loadu_si128((const __m128i*) (input + i)), &values)) break;
+		_mm_storeu_si128((__m128i*) (output + bytes), decode64_pack_ssse3(values));
+	}
+	
+	int r = decode64_scalar(input + i, output + bytes, length - i);
+	return r < 0 ? -1 : bytes + r;
+}
+
+
+/**
+ * Encode a buffer using base64 (AVX2)
+ */
+__attribute__((target("avx2")))
+static int encode64_avx2(const unsigned char* input, char* output, int length)
+{
+	const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+											 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+										   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+										   '/' - 63, 'A', 0, 0,
+										   'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+										   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+										   '/' - 63, 'A', 0, 0);
+	int i = 0, bytes = 0;
+	
+	for ( ; i + 28 <= length; i += 24, bytes += 32) {
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (input + i))),
+											 _mm_loadu_si128((const __m128i*) (input + i + 12)), 1);
+		in = _mm256_shuffle_epi8(in, shuffle);
+		
+		__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t1, t3);
+		
+		__m256i r = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		
+		_mm256_storeu_si256((__m256i*) (output + bytes), _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), indices));
+	}
+	
+	_mm256_zeroupper();
+	return bytes + encode64_ssse3(input + i, output + bytes, length - i);
+}
+
+
+/**
+ * Decode a base64 buffer (AVX2)
+ */
+__attribute__((target("avx2")))
+static int decode64_avx2(const unsigned char* input, char* output, int length)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+											0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+											0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+											0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+											0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+											0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+											0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+											  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+										  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	int i = 0, bytes = 0;
+	
+	if (length % 4 != 0) return -1;
+	
+	for ( ; i + 48 <= length; i += 32, bytes += 24) {
+		__m256i in = _mm256_loadu_si256((const __m256i*) (input + i));
+		
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+		__m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+		
+		__m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles), _mm256_shuffle_epi8(lut_hi, hi_nibbles));
+		if (!_mm256_testz_si256(invalid, invalid)) break;
+		
+		__m256i eq_2f = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x2f));
+		__m256i values = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+		
+		__m256i t = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		t = _mm256_madd_epi16(t, _mm256_set1_epi32(0x00011000));
+		t = _mm256_shuffle_epi8(t, pack);
+		t = _mm256_permutevar8x32_epi32(t, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		
+		_mm256_storeu_si256((__m256i*) (output + bytes), t);
+	}
+	
+	_mm256_zeroupper();
+	
+	int r = decode64_ssse3(input + i, output + bytes, length - i);
+	return r < 0 ? -1 : bytes + r;
+}
+
+#endif /* SDB_HAVE_X86_SIMD */
+
+
+/**
+ * The implementations selected for this CPU (by base64_init())
+ */
+static int (*encode64_impl)(const unsigned char*, char*, int) = encode64_scalar;
+static int (*decode64_impl)(const unsigned char*, char*, int) = decode64_scalar;
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Select the implementation. Other than for SIMD_BEST, this is meant only
+ * for testing the individual kernels. This is not thread-safe, so no other
+ * thread may encode or decode meanwhile.
+ *
+ * @param level the kernel level (SIMD_SCALAR, SIMD_128 or SIMD_256), or SIMD_BEST
+ * @return the selected level, or -1 if the CPU does not support it
+ */
+int base64_select(int level)
+{
+	int (*encode_impl)(const unsigned char*, char*, int) = encode64_scalar;
+	int (*decode_impl)(const unsigned char*, char*, int) = decode64_scalar;
+	int best = SIMD_SCALAR;
+	
+#ifdef SDB_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		best = SIMD_256;
+	}
+	else if (__builtin_cpu_supports("ssse3")) {
+		best = SIMD_128;
+	}
+#endif
+	
+	if (level == SIMD_BEST) level = best;
+	if (level < SIMD_SCALAR || level > best) return -1;
+	
+#ifdef SDB_HAVE_X86_SIMD
+	if (level == SIMD_256) {
+		encode_impl = encode64_avx2;
+		decode_impl = decode64_avx2;
+	}
+	else if (level == SIMD_128) {
+		encode_impl = encode64_ssse3;
+		decode_impl = decode64_ssse3;
+	}
+#endif
+	
+	decode64_impl = decode_impl;
+	encode64_impl = encode_impl;
+	
+	return level;
+}
+
+
+/**
+ * Select the best implementation for this CPU
+ */
+static void base64_init_once(void)
+{
+	base64_select(SIMD_BEST);
+}
+
+
+/**
+ * Select the best implementation for this CPU, unless it was already done
+ */
+void base64_init(void)
+{
+	pthread_once(&base64_once, base64_init_once);
+}
+
+
+/**
+ * Encode a buffer using base64 
+ *
+ * @param input the input buffer
+ * @param output the output buffer (must have room for BASE64_ENCODED_LENGTH(length) + 1 bytes)
+ * @param length the length of the input buffer
+ * @return the length of the output
+ */
+int encode64(const char* input, char* output, int length)
+{
+	return encode64_impl((const unsigned char*) input, output, length);
+}
+
+
+/**
+ * Decode a base64 buffer (the length of which must be a multiple of 4)
+ *
+ * @param input the input buffer
+ * @param output the output buffer (must have room for BASE64_DECODED_LENGTH(length) bytes)
+ * @param length the length of the input buffer
+ * @return the length of the output, or -1 if the input is not valid base64
+ */
+int decode64(const char* input, char* output, int length)
+{
+	return decode64_impl((const unsigned char*) input, output, length);
+}
@@ -37,15 +37,51 @@
 #define __BASE64_H
 
 
+/**
+ * The length of the base64 encoding of n bytes (without the terminating '\0')
+ */
+#define BASE64_ENCODED_LENGTH(n)	(((n) + 2) / 3 * 4)
+
+/**
+ * The maximum length of the data decoded from n base64 characters
+ */
+#define BASE64_DECODED_LENGTH(n)	((n) / 4 * 3)
+
+
+/**
+ * Select the implementation. Other than for SIMD_BEST, this is meant only
+ * for testing the individual kernels. This is not thread-safe, so no other
+ * thread may encode or decode meanwhile.
+ *
+ * @param level the kernel level (SIMD_SCALAR, SIMD_128 or SIMD_256), or SIMD_BEST
+ * @return the selected level, or -1 if the CPU does not support it
+ */
+int base64_select(int level);
+
+/**
+ * Select the best implementation for this CPU, unless it was already done
+ */
+void base64_init(void);
+
 /**
  * Encode a buffer using base64 
  *
  * @param input the input buffer
- * @param output the output buffer (must be large enough to receive the entire output)
+ * @param output the output buffer (must have room for BASE64_ENCODED_LENGTH(length) + 1 bytes)
  * @param length the length of the input buffer
  * @return the length of the output
  */
 int encode64(const char* input, char* output, int length);
 
+/**
+ * Decode a base64 buffer (the length of which must be a multiple of 4)
+ *
+ * @param input the input buffer
+ * @param output the output buffer (must have room for BASE64_DECODED_LENGTH(length) bytes)
+ * @param length the length of the input buffer
+ * @return the length of the output, or -1 if the input is not valid base64
+ */
+int decode64(const char* input, char* output, int length);
+
 
 #endif
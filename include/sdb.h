@@ -83,6 +83,15 @@ extern "C" {
 #define SDB_E_AWS_INTERNAL_ERROR_2	-13
 #define SDB_E_CURL_INTERNAL_ERROR	-14
 #define SDB_E_RETRY_FAILED			-15
+#define SDB_E_INVALID_BINARY_VALUE	-16
+#define SDB_E_INVALID_URL			-17
+#define SDB_E_NO_ENDPOINT			-18
+#define SDB_E_PENDING_MULTI_CALLS	-19
+#define SDB_E_DEADLINE_EXCEEDED		-20
+#define SDB_E_RESOLVE_FAILED		-21
+#define SDB_E_IO_THREAD_RUNNING		-22
+#define SDB_E_IO_THREAD_FAILED		-23
+#define SDB_E_PARTIAL_BATCH			-24
 
 #define SDB_CURL_ERROR(code)		(-1000 - (code))
 #define SDB_CURLM_ERROR(code)		(-1500 - (code))
@@ -167,6 +176,27 @@ extern const char* SDB_AWS_ERRORS[];
 #define SDB_R_ATTRIBUTE_LIST		3
 #define SDB_R_ITEM_LIST				4
 
+/*
+ * Socket events of the event loop hooks
+ */
+#define SDB_POLL_NONE				0
+#define SDB_POLL_IN					1
+#define SDB_POLL_OUT				2
+#define SDB_POLL_INOUT				3
+#define SDB_POLL_REMOVE				4
+#define SDB_POLL_ERR				8
+
+/*
+ * The pseudo-socket for timeouts in sdb_multi_socket_action()
+ */
+#define SDB_SOCKET_TIMEOUT			-1
+
+/*
+ * Transport profiles
+ */
+#define SDB_TRANSPORT_DEFAULT		0
+#define SDB_TRANSPORT_LOW_LATENCY	1
+
 
 
 
@@ -285,11 +315,16 @@ struct sdb_statistics
 {
 	long long bytes_sent;
 	long long bytes_received;
+	long long bytes_received_wire;
 	long long http_overhead_sent;
 	long long http_overhead_received;
 	long long num_commands;
 	long long num_puts;
 	long long num_retries;
+	long long num_connections;
+	long long num_reused_connections;
+	long long num_hedges;
+	long long num_hedges_won;
 	long double box_usage;
 };
 
@@ -300,6 +335,36 @@ struct sdb_statistics
 struct SDB;
 
 
+/**
+ * A prepared statement
+ */
+struct sdb_prepared;
+
+
+/**
+ * An event loop hook for the socket interest of the multi calls: watch the
+ * socket for SDB_POLL_IN, SDB_POLL_OUT or SDB_POLL_INOUT, or stop watching
+ * it (SDB_POLL_REMOVE)
+ */
+typedef void (*sdb_socket_hook)(struct SDB* sdb, int fd, int what, void* data);
+
+
+/**
+ * An event loop hook for the timer of the multi calls: call
+ * sdb_multi_socket_action() with SDB_SOCKET_TIMEOUT after timeout_ms
+ * milliseconds (-1 = cancel the timer)
+ */
+typedef void (*sdb_timer_hook)(struct SDB* sdb, long timeout_ms, void* data);
+
+
+/**
+ * A completion callback of a multi call: receives the parsed response of
+ * the call (with all pages if automatic NEXT handling is enabled) as soon
+ * as it is available, and then owns it (free it using sdb_free())
+ */
+typedef void (*sdb_multi_callback)(struct SDB* sdb, sdb_multi handle, struct sdb_response* response, void* data);
+
+
 /*****************************************************************************/
 /*                                                                           */
 /*                G L O B A L   I N I T   &   C L E A N - U P                */
@@ -394,6 +459,16 @@ void sdb_fprint(FILE* f, struct sdb_response* r);
  */
 int sdb_multi_count_errors(struct sdb_multi_response* response);
 
+/**
+ * Decode a binary attribute value (stored using sdb_put_binary or sdb_replace_binary)
+ *
+ * @param value the base64-encoded value from the response
+ * @param data a pointer to the place to store the decoded data (must be freed by the caller)
+ * @param length a pointer to the place to store the length of the data
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_decode_binary(const char* value, void** data, size_t* length);
+
 
 
 /*****************************************************************************/
@@ -411,7 +486,10 @@ int sdb_multi_count_errors(struct sdb_multi_response* response);
 void sdb_set_error_file(struct SDB* sdb, FILE* f);
 
 /**
- * Set the retry configuration
+ * Set the retry configuration. A multi call is retried on its own, while
+ * the other calls keep running, after a delay that starts at the given
+ * delay and doubles with every retry (with random jitter), up to the
+ * maximum set by sdb_set_retry_max_delay().
  *
  * @param sdb the SimpleDB handle
  * @param count the maximum number of retries
@@ -419,6 +497,86 @@ void sdb_set_error_file(struct SDB* sdb, FILE* f);
  */
 void sdb_set_retry(struct SDB* sdb, int count, int delay);
 
+/**
+ * Set the maximum delay of the exponential backoff between the retries of
+ * a multi call
+ *
+ * @param sdb the SimpleDB handle
+ * @param max_delay the maximum delay in milliseconds
+ */
+void sdb_set_retry_max_delay(struct SDB* sdb, long max_delay);
+
+/**
+ * Set the timeouts of every request: connecting, the whole transfer, and
+ * a stalled transfer (no data for the given time). A request that times
+ * out fails with SDB_CURL_ERROR(CURLE_OPERATION_TIMEDOUT).
+ *
+ * @param sdb the SimpleDB handle
+ * @param connect_timeout the connect timeout in milliseconds (0 = none)
+ * @param request_timeout the transfer timeout in milliseconds (0 = none)
+ * @param stall_timeout how long a transfer may receive less than a byte per second, in milliseconds (0 = none)
+ */
+void sdb_set_timeouts(struct SDB* sdb, long connect_timeout, long request_timeout, long stall_timeout);
+
+/**
+ * Set the deadline of each call, which covers all of its requests including
+ * the retries and the automatic NEXT requests. For the multi interface, the
+ * deadline starts in sdb_multi_run(), or when the call is made if the
+ * background I/O thread runs. A call that misses its deadline fails
+ * with SDB_E_DEADLINE_EXCEEDED.
+ *
+ * @param sdb the SimpleDB handle
+ * @param timeout the deadline in milliseconds after the start of a call (0 = none)
+ */
+void sdb_set_call_timeout(struct SDB* sdb, long timeout);
+
+/**
+ * Enable hedged reads: a GetAttributes or Select request (sync or multi)
+ * that has not completed within the hedging delay is sent once more, the
+ * first successful response wins and the other request is cancelled. The
+ * delay is either fixed, or the given percentile of the recently observed
+ * read latencies (the fixed delay is used until enough of them are known).
+ * Hedging does not apply to multi calls driven by the event loop hooks.
+ *
+ * @param sdb the SimpleDB handle
+ * @param delay the hedging delay in milliseconds (0 = none)
+ * @param percentile the latency percentile to use as the delay, such as 95 (0 = use the fixed delay only)
+ */
+void sdb_set_hedging(struct SDB* sdb, long delay, int percentile);
+
+/**
+ * Limit the number of multi calls in flight. The calls over the limit wait
+ * in a queue and start, in the order in which they were made, as soon as
+ * the calls in flight complete, so that a very large batch of multi calls
+ * keeps a steady number of transfers and does not allocate the receive
+ * buffers of all calls at once. With the event loop hooks, the number of
+ * the running calls reported by sdb_multi_socket_action() includes the
+ * queued calls.
+ *
+ * @param sdb the SimpleDB handle
+ * @param window the maximum number of the multi calls in flight (0 = no limit)
+ */
+void sdb_set_multi_window(struct SDB* sdb, int window);
+
+/**
+ * Set the completion callback of the multi calls made from now on, so that
+ * their responses can be processed while the other calls are still in
+ * flight. The callback runs inside sdb_multi_run(), or inside
+ * sdb_multi_socket_action() with the event loop hooks, or in the background
+ * I/O thread, once the call and all its retries and automatic NEXT requests
+ * are done. Such calls are not
+ * included in the response of sdb_multi_run(). A batch split into several
+ * requests reports each of them with the same handle (the requests of the
+ * batches split by synchronous calls are not reported). The callback may make
+ * new multi calls, but it must not call sdb_multi_run() or
+ * sdb_multi_socket_action().
+ *
+ * @param sdb the SimpleDB handle
+ * @param callback the completion callback (NULL = report the calls in the response of sdb_multi_run())
+ * @param data the user data passed to the callback
+ */
+void sdb_set_multi_callback(struct SDB* sdb, sdb_multi_callback callback, void* data);
+
 /**
  * Set automatic handling of the NEXT tokens
  *
@@ -428,13 +586,29 @@ void sdb_set_retry(struct SDB* sdb, int count, int delay);
 void sdb_set_auto_next(struct SDB* sdb, int value);
 
 /**
- * Enable gzip Content-Encoding for all service requests.
+ * Enable gzip Content-Encoding for all service requests, both synchronous
+ * and multi. The statistics then show the response bytes before
+ * (bytes_received_wire) and after (bytes_received) decompression.
  *
  * @param sdb the SimpleDB handle
- * @param value zero disabled gzip encoding, a non-zero value enables it
+ * @param value zero disables gzip encoding, a non-zero value enables it
  */
 void sdb_set_compression(struct SDB* sdb, int value);
 
+/**
+ * Set the transport profile of all service requests. The low-latency profile
+ * saves round trips: it sends the request bodies larger than what Curl sends
+ * without asking (1 KB or 1 MB, depending on the Curl version) right away
+ * instead of waiting for "100 Continue", disables Nagle's algorithm, keeps
+ * the idle connections alive with TCP keepalive probes, and uses TCP Fast
+ * Open where the platform supports it.
+ *
+ * @param sdb the SimpleDB handle
+ * @param profile SDB_TRANSPORT_DEFAULT or SDB_TRANSPORT_LOW_LATENCY
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_transport_profile(struct SDB* sdb, int profile);
+
 /**
  * Set the User-Agent header for service requests.
  *
@@ -443,6 +617,140 @@ void sdb_set_compression(struct SDB* sdb, int value);
  */
 void sdb_set_useragent(struct SDB* sdb, const char* ua);
 
+/**
+ * Set the service endpoint (this also discards the endpoint set, if any).
+ * The host and the path used in the request signatures are derived from the URL.
+ *
+ * @param sdb the SimpleDB handle
+ * @param url the service URL, such as "https://sdb.eu-west-1.amazonaws.com"
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_set_endpoint(struct SDB* sdb, const char* url);
+
+/**
+ * Set the endpoints to choose from. The round-trip time to each of them is
+ * measured right away and then every interval seconds, and the requests are
+ * sent to the closest one. The periodic measurements run in a background
+ * thread, so the requests keep going to the current endpoint until they
+ * complete. The endpoints must serve the same data (e.g. local proxies of
+ * a single region), since a handle can switch between them.
+ *
+ * @param sdb the SimpleDB handle
+ * @param num the number of endpoints
+ * @param urls the service URLs
+ * @param interval the number of seconds between re-evaluations (0 = never re-evaluate)
+ * @return SDB_OK if no errors occurred, SDB_E_NO_ENDPOINT if none of the endpoints can be reached
+ */
+int sdb_set_endpoints(struct SDB* sdb, size_t num, const char** urls, int interval);
+
+/**
+ * Resolve the service host once and pin its addresses for all requests
+ * (CURLOPT_RESOLVE), so that new connections do not wait for DNS lookups
+ * and a resolver outage does not fail requests. The requests rotate through
+ * the addresses, so the connections spread across them. The addresses are
+ * refreshed every interval seconds in a background thread, started by the
+ * first call after the interval passes; the requests keep using the old
+ * addresses until the lookup completes, and if it fails.
+ *
+ * @param sdb the SimpleDB handle
+ * @param enable zero disables pinning, a non-zero value enables it
+ * @param interval the number of seconds between refreshes (0 = never refresh)
+ * @return SDB_OK if no errors occurred, SDB_E_RESOLVE_FAILED if the host cannot be resolved
+ */
+int sdb_set_dns_pinning(struct SDB* sdb, int enable, int interval);
+
+/**
+ * Choose the scope of the connection, DNS and TLS session cache. By default,
+ * the synchronous and the multi calls of a handle share one cache; making
+ * it process-wide lets all handles (in any thread) reuse each other's
+ * connections and TLS sessions.
+ *
+ * @param sdb the SimpleDB handle
+ * @param process_wide zero for a per-handle cache, a non-zero value for the process-wide one
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_shared_cache(struct SDB* sdb, int process_wide);
+
+/**
+ * Enable HTTP/2 multiplexing of the multi calls, so that many concurrent
+ * requests share a few connections. Over TLS, HTTP/2 is negotiated for each
+ * connection; over cleartext (e.g. with a local proxy), the endpoint is probed
+ * for HTTP/2 right away. Either way, the requests fall back to HTTP/1.1 if
+ * the server does not speak HTTP/2.
+ *
+ * @param sdb the SimpleDB handle
+ * @param enable zero disables multiplexing, a non-zero value enables it
+ * @param max_connections the maximum number of HTTP/2 connections to the endpoint (0 = no limit)
+ * @param max_streams the maximum number of concurrent requests per connection (0 = the Curl default)
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_multiplexing(struct SDB* sdb, int enable, long max_connections, long max_streams);
+
+/**
+ * Open connections to the service endpoint ahead of the first requests, so
+ * that they do not pay for the DNS lookup and the TCP and TLS handshakes.
+ * The sync handle and n - 1 pooled multi handles each send a HEAD request in
+ * parallel; the connections are then kept alive in the connection cache.
+ *
+ * @param sdb the SimpleDB handle
+ * @param n the number of connections to open
+ * @param pelapsed the pointer to the warm-up time in seconds (can be NULL)
+ * @return SDB_OK if no errors occurred, or the first error otherwise
+ */
+int sdb_warmup(struct SDB* sdb, int n, double* pelapsed);
+
+/**
+ * Drive the multi calls from an existing event loop (such as libevent, libuv
+ * or epoll) instead of blocking in sdb_multi_run(). The hooks tell the loop
+ * which sockets to watch and when to fire the timer; the loop then reports
+ * the ready sockets and the expired timer to sdb_multi_socket_action().
+ * Both hooks must be set to enable this; NULL hooks restore the built-in
+ * event loop.
+ *
+ * @param sdb the SimpleDB handle
+ * @param socket_hook the socket interest hook
+ * @param timer_hook the timer hook
+ * @param data the user data passed to the hooks
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet,
+ *         or SDB_E_IO_THREAD_RUNNING if the background I/O thread runs
+ */
+int sdb_set_event_hooks(struct SDB* sdb, sdb_socket_hook socket_hook, sdb_timer_hook timer_hook, void* data);
+
+/**
+ * Start a background I/O thread that drives the multi calls of the handle.
+ * While it runs, any thread can make multi calls using the sdb_multi_*
+ * functions, which only pass the request to the I/O thread through a
+ * lock-free queue and return right away. The calls made while a completion
+ * callback is set are reported to the callback, which runs in the I/O
+ * thread, so set it before starting the thread; the other calls must be
+ * collected using sdb_multi_wait(). No other functions may be used with the
+ * handle until sdb_stop_io_thread(); the synchronous calls fail with
+ * SDB_E_IO_THREAD_RUNNING. The I/O thread does not hedge reads.
+ *
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet,
+ *         SDB_E_IO_THREAD_RUNNING if the thread runs already, or SDB_E_IO_THREAD_FAILED if it cannot be started
+ *         (such as with the event loop hooks)
+ */
+int sdb_start_io_thread(struct SDB* sdb);
+
+/**
+ * Stop the background I/O thread after it completes all multi calls made so
+ * far. No thread may make new multi calls while it stops.
+ *
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_stop_io_thread(struct SDB* sdb);
+
+/**
+ * Get the service endpoint the requests are currently sent to
+ *
+ * @param sdb the SimpleDB handle
+ * @return the service URL
+ */
+const char* sdb_get_endpoint(struct SDB* sdb);
+
 
 /*****************************************************************************/
 /*                                                                           */
@@ -481,6 +789,48 @@ void sdb_print_statistics(struct SDB* sdb);
 void sdb_clear_statistics(struct SDB* sdb);
 
 
+/*****************************************************************************/
+/*                                                                           */
+/*                   P R E P A R E D   S T A T E M E N T S                   */
+/*                                                                           */
+/*****************************************************************************/
+
+/**
+ * Prepare putting the same attributes to many items. The domain and the
+ * attribute names are encoded only once, and the statement can be executed
+ * using sdb_put_prepared() and sdb_multi_put_prepared() with the same handle.
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of attributes
+ * @param keys the attribute keys
+ * @param prepared a pointer to the place to store the prepared statement
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_prepare_put(struct SDB* sdb, const char* domain, size_t num, const char** keys, struct sdb_prepared** prepared);
+
+/**
+ * Prepare replacing the same attributes in many items. The domain and the
+ * attribute names are encoded only once, and the statement can be executed
+ * using sdb_put_prepared() and sdb_multi_put_prepared() with the same handle.
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of attributes
+ * @param keys the attribute keys
+ * @param prepared a pointer to the place to store the prepared statement
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_prepare_replace(struct SDB* sdb, const char* domain, size_t num, const char** keys, struct sdb_prepared** prepared);
+
+/**
+ * Free a prepared statement
+ *
+ * @param prepared the prepared statement
+ */
+void sdb_free_prepared(struct sdb_prepared** prepared);
+
+
 /*****************************************************************************/
 /*                                                                           */
 /*                              C O M M A N D S                              */
@@ -558,6 +908,32 @@ int sdb_put(struct SDB* sdb, const char* domain, const char* item, const char* k
  */
 int sdb_replace(struct SDB* sdb, const char* domain, const char* item, const char* key, const char* value);
 
+/**
+ * Put a binary attribute to the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_put_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length);
+
+/**
+ * Replace a binary attribute in the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_replace_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length);
+
 /**
  * Put several attributes to the database
  *
@@ -585,27 +961,54 @@ int sdb_put_many(struct SDB* sdb, const char* domain, const char* item, size_t n
 int sdb_replace_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values);
 
 /**
- * Put attributes of several items to the database
+ * Put attributes of several items to the database. A batch that does not fit
+ * the SimpleDB limits (25 items and 1 MB per request) is split into several
+ * requests, which are sent in parallel unless there are pending multi calls.
+ * An item with more than 256 attributes is sent in a request of its own. The
+ * requests are independent, so if some of them fail, the items of the others
+ * are still stored.
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
  * @param num the number of items
  * @param items the array of items and their attributes
- * @return SDB_OK if no errors occurred
+ * @return SDB_OK if no errors occurred, SDB_E_PARTIAL_BATCH if some of the
+ *         requests of a split batch failed and others succeeded (the errors are
+ *         written to the error file), or the error of the first failed request
+ *         if none of them succeeded
  */
 int sdb_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
 
 /**
- * Replace attributes of several items in the database
+ * Replace attributes of several items in the database. A batch that does not fit
+ * the SimpleDB limits (25 items and 1 MB per request) is split into several
+ * requests, which are sent in parallel unless there are pending multi calls.
+ * An item with more than 256 attributes is sent in a request of its own. The
+ * requests are independent, so if some of them fail, the items of the others
+ * are still stored.
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
  * @param num the number of items
  * @param items the array of items and their attributes
- * @return SDB_OK if no errors occurred
+ * @return SDB_OK if no errors occurred, SDB_E_PARTIAL_BATCH if some of the
+ *         requests of a split batch failed and others succeeded (the errors are
+ *         written to the error file), or the error of the first failed request
+ *         if none of them succeeded
  */
 int sdb_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
 
+/**
+ * Put (or replace) the attributes of an item using a prepared statement
+ *
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param item the item name
+ * @param values the attribute values (in the order of the prepared keys)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_put_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char* item, const char** values);
+
 /**
  * Delete an item
  *
@@ -676,6 +1079,19 @@ int sdb_delete_attr_ext_many(struct SDB* sdb, const char* domain, const char* it
  */
 int sdb_get(struct SDB* sdb, const char* domain, const char* item, const char* key, struct sdb_response** response);
 
+/**
+ * Get a binary attribute (stored using sdb_put_binary or sdb_replace_binary)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value a pointer to the place to store the decoded value (NULL if the attribute does not exist, otherwise must be freed by the caller)
+ * @param length a pointer to the place to store the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_get_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, void** value, size_t* length);
+
 /**
  * Get several attributes
  *
@@ -769,11 +1185,42 @@ int sdb_select(struct SDB* sdb, const char* expr, struct sdb_response** response
  * Perform all pending operations specified using sdb_multi_* functions
  *
  * @param sdb the SimpleDB handle
- * @param response a pointer to the place to store the response
- * @return SDB_OK if no errors occurred
+ * @param response a pointer to the place to store the response (NULL if all calls had completion callbacks)
+ * @return SDB_OK if no errors occurred, or SDB_E_IO_THREAD_RUNNING if the background I/O thread runs
  */
 int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response);
 
+/**
+ * Make progress on the pending multi calls after a socket became ready or
+ * the timer expired (only with the event loop hooks). Do not call this from
+ * inside a hook. The completion callbacks of the finished calls run from
+ * here. Once no calls are running, sdb_multi_run() collects the other
+ * responses without blocking, except for retries and automatic NEXT
+ * requests, which it performs itself.
+ *
+ * @param sdb the SimpleDB handle
+ * @param fd the ready socket, or SDB_SOCKET_TIMEOUT if the timer expired
+ * @param events the socket events (SDB_POLL_IN, SDB_POLL_OUT and SDB_POLL_ERR)
+ * @param running the pointer to the number of calls that are still running (can be NULL)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_multi_socket_action(struct SDB* sdb, int fd, int events, int* running);
+
+/**
+ * Wait for a multi call made while the background I/O thread runs, and get
+ * its response. Do this exactly once for each such call made without a
+ * completion callback, from any thread (even after the I/O thread stopped).
+ * A batch split into several requests completes when all of them do, with
+ * the response of the first failed request, or of the last one if none
+ * failed.
+ *
+ * @param sdb the SimpleDB handle
+ * @param handle the handle of the multi call
+ * @param response a pointer to the place to store the response (free it using sdb_free())
+ * @return the return code of the call
+ */
+int sdb_multi_wait(struct SDB* sdb, sdb_multi handle, struct sdb_response** response);
+
 /**
  * Create a domain
  *
@@ -833,6 +1280,32 @@ sdb_multi sdb_multi_put(struct SDB* sdb, const char* domain, const char* item, c
  */
 sdb_multi sdb_multi_replace(struct SDB* sdb, const char* domain, const char* item, const char* key, const char* value);
 
+/**
+ * Put a binary attribute to the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_put_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length);
+
+/**
+ * Replace a binary attribute in the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_replace_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length);
+
 /**
  * Put several attributes to the database
  *
@@ -860,7 +1333,10 @@ sdb_multi sdb_multi_put_many(struct SDB* sdb, const char* domain, const char* it
 sdb_multi sdb_multi_replace_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values);
 
 /**
- * Put attributes of several items to the database
+ * Put attributes of several items to the database. A batch that does not fit
+ * the SimpleDB limits (25 items and 1 MB per request) is split into several
+ * requests, the responses of which all carry the returned handle.
+ * An item with more than 256 attributes is sent in a request of its own.
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
@@ -871,7 +1347,10 @@ sdb_multi sdb_multi_replace_many(struct SDB* sdb, const char* domain, const char
 sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
 
 /**
- * Replace attributes of several items in the database
+ * Replace attributes of several items in the database. A batch that does not fit
+ * the SimpleDB limits (25 items and 1 MB per request) is split into several
+ * requests, the responses of which all carry the returned handle.
+ * An item with more than 256 attributes is sent in a request of its own.
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
@@ -881,6 +1360,17 @@ sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, c
  */
 sdb_multi sdb_multi_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
 
+/**
+ * Put (or replace) the attributes of an item using a prepared statement
+ *
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param item the item name
+ * @param values the attribute values (in the order of the prepared keys)
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_put_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char* item, const char** values);
+
 /**
  * Delete an item
  *
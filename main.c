@@ -34,6 +34,8 @@
 
 #include "stdafx.h"
 #include "sdb.h"
+#include "sdb_private.h"
+#include "base64.h"
 
 #include <ctype.h>
 
@@ -74,6 +76,50 @@ int readln(char* buf, size_t size)
 }
 
 
+/**
+ * URL-encode a buffer the straightforward way (the reference for testing the kernels)
+ * 
+ * @param out the output buffer (must have room for 3 * length + 1 bytes)
+ * @param in the input buffer
+ * @param length the length of the input
+ * @return the length of the output
+ */
+size_t escape_reference(char* out, const unsigned char* in, size_t length)
+{
+	char* o = out;
+	size_t i;
+	
+	for (i = 0; i < length; i++) {
+		unsigned char c = in[i];
+		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+				|| c == '-' || c == '.' || c == '_' || c == '~') {
+			*(o++) = c;
+		}
+		else {
+			o += sprintf(o, "%%%02X", c);
+		}
+	}
+	
+	*o = '\0';
+	return o - out;
+}
+
+
+/**
+ * A completion callback that counts the calls reported to it
+ * 
+ * @param sdb the SimpleDB handle
+ * @param handle the handle of the call
+ * @param response the response
+ * @param data the counter
+ */
+void count_callback(struct SDB* sdb, sdb_multi handle, struct sdb_response* response, void* data)
+{
+	(*(int*) data)++;
+	sdb_free(&response);
+}
+
+
 #define BUF_SIZE				256
 #define READ(prompt, var)		{ printf("%s: ", prompt); if (readln(var, BUF_SIZE)) { printf("\n"); break; } }
 #define READ2(prompt, var)		{ printf("%s: ", prompt); if (readln(var, BUF_SIZE)) { printf("\n"); return 1; } }
@@ -344,6 +390,343 @@ int main(int argc, char** argv)
 			continue;
 		}
 		
+		if (strcmp(cmd, "e") == 0) {
+			printf("Benchmark building the request body\n");
+			
+			struct sdb_buffer out = { NULL, 0, 0 };
+			char key[64], values[256 * 64];
+			int n, i, j, l, r = SDB_OK;
+			size_t k, counts[] = { 100, 1000, 6400, 19200 };
+			
+			for (i = 0; i < 256; i++) {
+				l = 1 + rand() % 62;
+				for (j = 0; j < l; j++) values[i * 64 + j] = ' ' + rand() % ('z' - ' ' + 1);
+				values[i * 64 + l] = '\0';
+			}
+			
+			printf("\n     Params    Export time\n");
+			for (k = 0; k < sizeof(counts) / sizeof(counts[0]) && SDB_SUCCESS(r); k++) {
+				struct sdb_params* params = sdb_params_alloc(counts[k]);
+				for (i = 0; i < (int) counts[k]; i++) {
+					sprintf(key, "Item.%d.Attribute.%d.%s", i / 768, (i / 3) % 256, i % 3 == 0 ? "Name" : "Value");
+					sdb_params_add(params, key, &values[(i % 256) * 64]);
+				}
+				
+				long long start = monotonic_ms();
+				for (n = 0; monotonic_ms() - start < 500 && SDB_SUCCESS(r); n++) {
+					r = sdb_params_export(sdb, "BatchPutAttributes", params, NULL, &out);
+				}
+				double mean = (monotonic_ms() - start) / (double) n;
+				
+				sdb_params_free(params);
+				if (SDB_SUCCESS(r)) printf("  %9lu  %10.0f us\n", (unsigned long) counts[k], mean * 1000);
+			}
+			
+			char* escaped = (char*) malloc(3 * 1024 + 1);
+			char* value = (char*) malloc(1024);
+			printf("\n  %-24s%13s%13s%13s\n", "URL-encoding 1 KB values", "Scalar", "SSE2", "AVX2");
+			for (k = 0; k < 2 && SDB_SUCCESS(r); k++) {
+				for (i = 0; i < 1024; i++) value[i] = k == 0 || i % 16 ? 'a' + i % 26 : ' ';
+				printf("  %-24s", k == 0 ? "alnum only" : "1/16 reserved");
+				
+				for (l = SIMD_SCALAR; l <= SIMD_256; l++) {
+					if (sdb_escape_select(l) < 0) {
+						printf("%13s", "n/a");
+						continue;
+					}
+					
+					long long start = monotonic_ms(), bytes = 0;
+					while (monotonic_ms() - start < 500) {
+						for (i = 0; i < 1000; i++) sdb_escape_to(escaped, value, 1024);
+						bytes += 1000 * 1024;
+					}
+					printf("%8.2f GB/s", bytes / (double) (monotonic_ms() - start) / 1e6);
+				}
+				printf("\n");
+			}
+			
+			sdb_escape_select(SIMD_BEST);
+			free(escaped);
+			free(value);
+			SAFE_FREE(out.buffer);
+			if (SDB_FAILED(r)) printf("Error %d: %s\n", r, SDB_AWS_ERROR_NAME(r));
+			continue;
+		}
+		
+		if (strcmp(cmd, "u") == 0) {
+			printf("Test the URL-encoding kernels\n");
+			
+			const char* names[] = { "Scalar", "SSE2", "AVX2" };
+			unsigned char* in = (unsigned char*) malloc(4200);
+			char* expected = (char*) malloc(3 * 4200 + 1);
+			int level, i, j, failed;
+			
+			for (level = SIMD_SCALAR; level <= SIMD_256; level++) {
+				if (sdb_escape_select(level) < 0) {
+					printf("  %-6s  not supported by the CPU\n", names[level]);
+					continue;
+				}
+				
+				srand(level + 1);
+				failed = 0;
+				for (i = 0; i < 100000 && !failed; i++) {
+					
+					// Favor the lengths around the 16- and 32-byte boundaries
+					
+					size_t length = i % 2 ? (size_t) (rand() % 100) : (size_t) (16 * (rand() % 260) + rand() % 3);
+					if (i % 2 == 0 && length > 0) length--;
+					
+					int density = rand() % 5;
+					for (j = 0; j < (int) length; j++) {
+						if (density == 0 || rand() % (1 << (2 * density)) != 0) {
+							in[j] = "abcXYZ019-._~"[rand() % 13];
+						}
+						else {
+							in[j] = (unsigned char) rand();
+						}
+					}
+					
+					size_t el = escape_reference(expected, in, length);
+					size_t l = sdb_escape_length((const char*) in, length);
+					char* out = (char*) malloc(el + 1);
+					size_t ol = l == el ? sdb_escape_to(out, (const char*) in, length) : 0;
+					
+					if (l != el || ol != el || memcmp(out, expected, el + 1) != 0) {
+						printf("  %-6s  FAILED for length %lu (expected %lu, got %lu and %lu)\n", names[level],
+							   (unsigned long) length, (unsigned long) el, (unsigned long) l, (unsigned long) ol);
+						failed = 1;
+					}
+					free(out);
+				}
+				
+				if (!failed) printf("  %-6s  %d inputs OK\n", names[level], i);
+			}
+			
+			sdb_escape_select(SIMD_BEST);
+			free(in);
+			free(expected);
+			continue;
+		}
+		
+		if (strcmp(cmd, "b") == 0) {
+			printf("Test the base64 kernels\n");
+			
+			const char* names[] = { "Scalar", "SSSE3", "AVX2" };
+			unsigned char* in = (unsigned char*) malloc(2100);
+			char* expected = (char*) malloc(BASE64_ENCODED_LENGTH(2100) + 1);
+			char* corrupted = (char*) malloc(BASE64_ENCODED_LENGTH(2100));
+			char* reference = (char*) malloc(2100);
+			int level, i, j, failed;
+			
+			for (level = SIMD_SCALAR; level <= SIMD_256; level++) {
+				if (base64_select(level) < 0) {
+					printf("  %-6s  not supported by the CPU\n", names[level]);
+					continue;
+				}
+				
+				srand(level + 1);
+				failed = 0;
+				for (i = 0; i < 100000 && !failed; i++) {
+					
+					// Favor the lengths around the 12- and 24-byte blocks of the kernels
+					
+					int length = i % 2 ? rand() % 100 : 12 * (rand() % 170) + rand() % 5;
+					if (i % 2 == 0 && length >= 2) length -= 2;
+					for (j = 0; j < length; j++) in[j] = (unsigned char) rand();
+					
+					
+					// Encode, comparing with OpenSSL
+					
+					int el = EVP_EncodeBlock((unsigned char*) expected, in, length);
+					char* encoded = (char*) malloc(el + 1);
+					int l = encode64((const char*) in, encoded, length);
+					
+					if (l != el || memcmp(encoded, expected, el + 1) != 0) {
+						printf("  %-6s  FAILED to encode %d bytes\n", names[level], length);
+						failed = 1;
+					}
+					
+					
+					// Decode the result back
+					
+					char* decoded = (char*) malloc(BASE64_DECODED_LENGTH(el) + 1);
+					l = failed ? 0 : decode64(encoded, decoded, el);
+					
+					if (!failed && (l != length || memcmp(decoded, in, length) != 0)) {
+						printf("  %-6s  FAILED to decode %d bytes\n", names[level], length);
+						failed = 1;
+					}
+					
+					
+					// Decode a corrupted copy, comparing with the reference implementation
+					
+					if (!failed && el > 0 && i % 4 == 0) {
+						memcpy(corrupted, encoded, el);
+						corrupted[rand() % el] = (char) rand();
+						
+						base64_select(SIMD_SCALAR);
+						int rl = decode64(corrupted, reference, el);
+						base64_select(level);
+						l = decode64(corrupted, decoded, el);
+						
+						if (l != rl || (rl > 0 && memcmp(decoded, reference, rl) != 0)) {
+							printf("  %-6s  FAILED to decode corrupted input (expected %d, got %d)\n", names[level], rl, l);
+							failed = 1;
+						}
+					}
+					
+					free(encoded);
+					free(decoded);
+				}
+				
+				if (!failed) printf("  %-6s  %d inputs OK\n", names[level], i);
+			}
+			
+			base64_select(SIMD_BEST);
+			free(in);
+			free(expected);
+			free(corrupted);
+			free(reference);
+			continue;
+		}
+		
+		if (strcmp(cmd, "c") == 0) {
+			printf("Benchmark the base64 kernels\n");
+			
+			int sizes[] = { 768, 76 * 1024 }, k, d, level, i;
+			char* data = (char*) malloc(76 * 1024);
+			char* encoded = (char*) malloc(BASE64_ENCODED_LENGTH(76 * 1024) + 1);
+			char* decoded = (char*) malloc(76 * 1024);
+			for (i = 0; i < 76 * 1024; i++) data[i] = (char) rand();
+			
+			for (k = 0; k < 2; k++) {
+				int el = encode64(data, encoded, sizes[k]);
+				printf("\n  %-24s%13s%13s%13s\n", k == 0 ? "768-byte values" : "76 KB values", "Scalar", "SSSE3", "AVX2");
+				
+				for (d = 0; d < 2; d++) {
+					printf("  %-24s", d == 0 ? "encode" : "decode");
+					
+					for (level = SIMD_SCALAR; level <= SIMD_256; level++) {
+						if (base64_select(level) < 0) {
+							printf("%13s", "n/a");
+							continue;
+						}
+						
+						long long start = monotonic_ms(), bytes = 0;
+						while (monotonic_ms() - start < 500) {
+							for (i = 0; i < 100; i++) {
+								if (d == 0) encode64(data, encoded, sizes[k]); else decode64(encoded, decoded, el);
+							}
+							bytes += 100 * sizes[k];
+						}
+						printf("%8.2f GB/s", bytes / (double) (monotonic_ms() - start) / 1e6);
+					}
+					printf("\n");
+				}
+			}
+			
+			base64_select(SIMD_BEST);
+			free(data);
+			free(encoded);
+			free(decoded);
+			continue;
+		}
+		
+		if (strcmp(cmd, "t") == 0) {
+			printf("Benchmark the transport profiles\n");
+			READ("Service URL", arg1);
+			READ("Number of requests", arg2);
+			
+			struct SDB* b;
+			int n = atoi(arg2), p, i, r = SDB_OK;
+			size_t k, sizes[] = { 256, 4096, 65536, 2 * 1024 * 1024 };
+			double mean[2];
+			if (n <= 0) n = 20;
+			
+			if (SDB_FAILED(r = sdb_init_ext(&b, aws_id, aws_secret, arg1))) {
+				printf("Error %d: %s\n", r, SDB_AWS_ERROR_NAME(r));
+				continue;
+			}
+			sdb_set_error_file(b, stderr);
+			
+			printf("\n  Body size    Default    Low latency    Saved\n");
+			for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+				char* value = (char*) malloc(sizes[k] + 1);
+				memset(value, 'x', sizes[k]);
+				value[sizes[k]] = '\0';
+				
+				for (p = 0; p < 2; p++) {
+					sdb_set_transport_profile(b, p == 0 ? SDB_TRANSPORT_DEFAULT : SDB_TRANSPORT_LOW_LATENCY);
+					sdb_put(b, "bench", "warmup", "value", "x");
+					
+					long long start = monotonic_ms();
+					for (i = 0; i < n && SDB_SUCCESS(r); i++) {
+						r = sdb_put(b, "bench", "item", "value", value);
+					}
+					mean[p] = (monotonic_ms() - start) / (double) n;
+				}
+				
+				free(value);
+				if (SDB_FAILED(r)) {
+					printf("Error %d: %s\n", r, SDB_AWS_ERROR_NAME(r));
+					break;
+				}
+				printf("  %9lu  %6.2f ms    %8.2f ms  %6.2f ms\n", (unsigned long) sizes[k], mean[0], mean[1], mean[0] - mean[1]);
+			}
+			
+			sdb_destroy(&b);
+			continue;
+		}
+		
+		if (strcmp(cmd, "k") == 0) {
+			printf("Split batches with a completion callback\n");
+			READ("Service URL", arg1);
+			
+			struct SDB* b;
+			struct sdb_attribute a[3];
+			struct sdb_item x[60];
+			char names[60][16];
+			int i, r, calls = 0;
+			
+			if (SDB_FAILED(r = sdb_init_ext(&b, aws_id, aws_secret, arg1))) {
+				printf("Error %d: %s\n", r, SDB_AWS_ERROR_NAME(r));
+				continue;
+			}
+			sdb_set_error_file(b, stderr);
+			sdb_set_multi_callback(b, count_callback, &calls);
+			
+			a[0].name = "name";
+			a[0].value = "val:name";
+			a[1].name = "key";
+			a[1].value = "val:key";
+			a[2].name = "ver";
+			a[2].value = "val:ver";
+			for (i = 0; i < 60; i++) {
+				sprintf(names[i], "item%03d", i);
+				x[i].name = names[i];
+				x[i].size = 3;
+				x[i].attributes = a;
+			}
+			
+			
+			// The requests of the split batches must not be reported to the callback
+			
+			r = sdb_put_batch(b, "test1", 60, x);
+			printf("  Put (3 requests): %d, %d callbacks\n", r, calls);
+			if (SDB_SUCCESS(r)) r = sdb_replace_batch(b, "test1", 60, x);
+			printf("  Replace (3 requests): %d, %d callbacks\n", r, calls);
+			
+			struct sdb_multi_response* mr = NULL;
+			sdb_multi_put(b, "test1", "item000", "key", "val:key");
+			if (SDB_SUCCESS(r)) r = sdb_multi_run(b, &mr);
+			sdb_multi_free(&mr);
+			printf("  Multi put: %d, %d callbacks\n", r, calls);
+			printf("%s\n", SDB_SUCCESS(r) && calls == 1 ? "OK" : "FAILED");
+			
+			sdb_destroy(&b);
+			continue;
+		}
+		
 		if (strcmp(cmd, "z") == 0) {
 			struct sdb_response* res;
 			int r, num = 10;
@@ -46,8 +46,30 @@
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	#include <openssl/params.h>
+#endif
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#if !defined(SDB_NO_EPOLL) && defined(__linux__)
+	#define SDB_HAVE_EPOLL
+	#include <errno.h>
+	#include <sys/epoll.h>
+#endif
+
+#if !defined(SDB_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SDB_HAVE_X86_SIMD
+	#include <immintrin.h>
+#endif
+
 const char* SDB_AWS_ERRORS[] = {
 	"AccessFailure",
 	"AuthFailure",
@@ -115,7 +137,13 @@ CURL* sdb_create_curl(struct SDB* sdb)
 	// Configure the Curl handle
 	
 	curl_easy_setopt(h, CURLOPT_URL, sdb->aws_url);
-	curl_easy_setopt(h, CURLOPT_HTTPHEADER, sdb->curl_headers);
+	curl_easy_setopt(h, CURLOPT_SHARE, sdb_share_get(sdb));
+	sdb_http_options_apply(sdb, h);
+	if (sdb->compression) curl_easy_setopt(h, CURLOPT_ENCODING, SDB_HTTP_ENCODING);
+	curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(h, CURLOPT_TIMEOUT_MS, sdb->request_timeout);
+	sdb_timeouts_apply(sdb, h);
+	sdb_transport_apply(sdb, h);
 	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, sdb_write_callback);
 	
 	// Define default User-Agent
@@ -130,945 +158,5053 @@ CURL* sdb_create_curl(struct SDB* sdb)
 
 
 /**
- * Allocate a multi data structure
+ * The process-wide Curl share object and its spin locks (one per data type)
+ */
+static CURLSH* sdb_global_share = NULL;
+static volatile int sdb_global_share_locks[CURL_LOCK_DATA_LAST];
+
+
+/**
+ * Lock the shared data of the given type
+ */
+static void sdb_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+	(void) handle; (void) access; (void) userptr;
+	while (__sync_lock_test_and_set(&sdb_global_share_locks[data], 1)) sched_yield();
+}
+
+
+/**
+ * Unlock the shared data of the given type
+ */
+static void sdb_share_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+	(void) handle; (void) userptr;
+	__sync_lock_release(&sdb_global_share_locks[data]);
+}
+
+
+/**
+ * Create a Curl share object for connections, DNS and TLS sessions
  * 
- * @param sdb the SimpleDB handle
- * @return the allocated data structure, or NULL on error
+ * @param locked whether to protect the object by locks, so that it can be used from several threads
+ * @return the share object, or NULL on error
  */
-struct sdb_multi_data* sdb_multi_alloc(struct SDB* sdb)
+CURLSH* sdb_share_create(int locked)
 {
-	struct sdb_multi_data* m = NULL;
+	CURLSH* share = curl_share_init();
+	if (share == NULL) return NULL;
 	
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
 	
-	// Reuse an existing handle, if there is one
-	
-	if (sdb->multi_free != NULL) {
-	
-		m = sdb->multi_free;
-		sdb->multi_free = sdb->multi_free->next;
-		sdb->multi_free_size--;
-		
-		assert(m->post == NULL && m->curl != NULL && m->rec.size == 0);
-	}
-	else {
-		
-		// Otherwise allocate one
-		
-		m = (struct sdb_multi_data*) malloc(sizeof(struct sdb_multi_data));
-		
-		m->rec.size = 0;
-		m->rec.capacity = 64 * 1024;
-		m->rec.buffer = (char*) malloc(m->rec.capacity);
-		
-		m->post = NULL;
-		m->curl = sdb_create_curl(sdb);
+	if (locked) {
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, sdb_share_lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, sdb_share_unlock);
 	}
 	
+	return share;
+}
+
+
+/**
+ * Create the process-wide Curl share object
+ * 
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_global_share_init(void)
+{
+	sdb_global_share = sdb_share_create(TRUE);
+	return sdb_global_share == NULL ? SDB_E_CURL_INIT_FAILED : SDB_OK;
+}
+
+
+/**
+ * Destroy the process-wide Curl share object
+ */
+void sdb_global_share_cleanup(void)
+{
+	if (sdb_global_share != NULL) curl_share_cleanup(sdb_global_share);
+	sdb_global_share = NULL;
+}
+
+
+/**
+ * Get the Curl share object used by the handle
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the share object
+ */
+CURLSH* sdb_share_get(struct SDB* sdb)
+{
+	return sdb->share_process_wide ? sdb_global_share : sdb->curl_share;
+}
+
+
+/**
+ * Choose the HTTP version for an endpoint when multiplexing: HTTP/2 is
+ * negotiated over TLS, while over cleartext the endpoint is probed for
+ * HTTP/2 with prior knowledge. This does not use the SimpleDB handle, so
+ * it can run in a background thread.
+ * 
+ * @param url the service URL
+ * @param share the share object to leave the connection in (NULL = none)
+ * @return the Curl HTTP version
+ */
+long sdb_http_version_probe(const char* url, CURLSH* share)
+{
+	if (strncasecmp(url, "https://", 8) == 0) return CURL_HTTP_VERSION_2TLS;
 	
-	// Additional initialization
 	
-	m->command[0] = '\0';
-	m->params = NULL;
+	// Send a HEAD request, leaving the connection in the shared cache if it succeeds
 	
+	CURL* h = curl_easy_init();
+	if (h == NULL) return CURL_HTTP_VERSION_1_1;
 	
-	// Add it to the chain
+	curl_easy_setopt(h, CURLOPT_URL, url);
+	if (share != NULL) curl_easy_setopt(h, CURLOPT_SHARE, share);
+	curl_easy_setopt(h, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+	curl_easy_setopt(h, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(h, CURLOPT_TIMEOUT_MS, (long) SDB_ENDPOINT_PROBE_TIMEOUT);
 	
-	m->next = sdb->multi;
-	sdb->multi = m;
+	long version = CURL_HTTP_VERSION_NONE;
+	if (curl_easy_perform(h) == CURLE_OK) curl_easy_getinfo(h, CURLINFO_HTTP_VERSION, &version);
+	curl_easy_cleanup(h);
 	
-	return m;
+	return version == CURL_HTTP_VERSION_2_0 ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_1_1;
 }
 
 
 /**
- * Free a multi data structure, reusing it if possible
+ * Apply the HTTP version of the current endpoint and the multiplexing options
+ * to a Curl handle. This goes together with the URL (see sdb_target_apply), so
+ * that a handle reused after an endpoint switch does not keep the version of
+ * the old endpoint.
  * 
  * @param sdb the SimpleDB handle
- * @param m the data structure to free
+ * @param curl the Curl handle
  */
-void sdb_multi_free_one(struct SDB* sdb, struct sdb_multi_data* m)
+void sdb_http_options_apply(struct SDB* sdb, CURL* curl)
 {
-	if (m == NULL) return;
+	// Wait for a connection to multiplex on only if it could be HTTP/2
 	
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, sdb->http_version);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, sdb->multiplexing && sdb->http_version != CURL_HTTP_VERSION_1_1 ? 1L : 0L);
+}
+
+
+/**
+ * Create the prefix of the string to sign for a service URL: the method,
+ * the host (as in the Host header) and the path
+ * 
+ * @param url the service URL
+ * @param plen the pointer to the place to store the length of the prefix
+ * @return the prefix (must be freed by the caller), or NULL if the URL is not valid
+ *         or the memory could not be allocated
+ */
+char* sdb_sign_prefix(const char* url, size_t* plen)
+{
+	// Find the host and the path
 	
-	// Cleanup non-reusable parts of the data structure 
-	
-	m->next = NULL;
-	m->rec.size = 0;
+	const char* host;
+	int default_port;
 	
-	if (m->post != NULL) {
-		free(m->post);
-		m->post = NULL;
+	if (strncasecmp(url, "https://", 8) == 0) {
+		host = url + 8;
+		default_port = 443;
+	}
+	else if (strncasecmp(url, "http://", 7) == 0) {
+		host = url + 7;
+		default_port = 80;
+	}
+	else {
+		return NULL;
 	}
 	
-	sdb_params_free(m->params);
-	m->params = NULL;
-	m->command[0] = '\0';
+	size_t hl = strcspn(host, "/?#");
+	if (hl == 0 || memchr(host, '@', hl) != NULL) return NULL;
 	
-	curl_multi_remove_handle(sdb->curl_multi, m->curl);
+	const char* path = host + hl;
+	size_t pl = *path == '/' ? strcspn(path, "?#") : 0;
 	
 	
-	// Destroy the handle if we have too many of them
+	// Leave out the default port, since Curl does not send it in the Host header either
 	
-	if (sdb->multi_free_size >= SDB_MAX_MULTI_FREE) {
-		if (m->curl != NULL) curl_easy_cleanup(m->curl);
-		if (m->rec.buffer != NULL) free(m->rec.buffer);
-		free(m);
-		return;
-	}
+	const char* p;
+	for (p = host + hl; p > host && p[-1] != ':' && p[-1] != ']'; p--) ;
+	if (p > host && p[-1] == ':' && atoi(p) == default_port) hl = p - 1 - host;
 	
 	
-	// Otherwise add it to the free list
+	// Create the prefix
 	
-	m->next = sdb->multi_free;
-	sdb->multi_free = m;
-	sdb->multi_free_size++;
-} 
+	char* prefix = (char*) malloc(hl + pl + 16);
+	if (prefix == NULL) return NULL;
+	
+	char* b = prefix;
+	size_t i;
+	
+	memcpy(b, "POST\n", 5);
+	b += 5;
+	for (i = 0; i < hl; i++) *(b++) = tolower((unsigned char) host[i]);
+	*(b++) = '\n';
+	if (pl == 0) {
+		*(b++) = '/';
+	}
+	else {
+		memcpy(b, path, pl);
+		b += pl;
+	}
+	*(b++) = '\n';
+	*b = '\0';
+	
+	*plen = b - prefix;
+	return prefix;
+}
 
 
 /**
- * Free a chain of multi data structure, reusing it if possible
+ * Point the handle to a service endpoint, deriving the signed host and path
+ * from the URL, without changing the pinned addresses
  * 
  * @param sdb the SimpleDB handle
- * @param m the first data structure of the chain
+ * @param url the service URL
+ * @return SDB_OK if no errors occurred
  */
-void sdb_multi_free_chain(struct SDB* sdb, struct sdb_multi_data* m)
+static int sdb_endpoint_use(struct SDB* sdb, const char* url)
 {
-	struct sdb_multi_data* next;
+	size_t l;
+	char* prefix = sdb_sign_prefix(url, &l);
+	if (prefix == NULL) return SDB_E_INVALID_URL;
 	
-	for ( ; m != NULL; m = next) {
-		next = m->next;
-		sdb_multi_free_one(sdb, m);
-	}
-} 
+	if (sdb->aws_url != NULL) free(sdb->aws_url);
+	if (sdb->sign_prefix != NULL) free(sdb->sign_prefix);
+	
+	sdb->aws_url = strdup(url);
+	sdb->sign_prefix = prefix;
+	sdb->sign_prefix_len = l;
+	
+	return SDB_OK;
+}
 
 
 /**
- * Destroy a chain of multi data structures
+ * Point the handle to a service endpoint, deriving the signed host and path
+ * from the URL, choose its HTTP version, and pin the addresses of the new host
  * 
  * @param sdb the SimpleDB handle
- * @param m the first data structure in the chain
+ * @param url the service URL
+ * @return SDB_OK if no errors occurred
  */
-void sdb_multi_destroy(struct SDB* sdb, struct sdb_multi_data* m)
+int sdb_endpoint_set(struct SDB* sdb, const char* url)
 {
-	struct sdb_multi_data* next;
+	SDB_SAFE(sdb_endpoint_use(sdb, url));
 	
-	for ( ; m != NULL; m = next) {
-		next = m->next;
+	if (sdb->multiplexing) sdb->http_version = sdb_http_version_probe(sdb->aws_url, sdb_share_get(sdb));
+	
+	
+	// Pin the addresses of the new host (keeping the old ones only would be wrong)
+	
+	if (sdb->dns_pinning && SDB_FAILED(sdb_dns_refresh(sdb))) sdb_dns_cleanup(sdb);
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Measure the round-trip time to each endpoint in parallel. This does not use
+ * the SimpleDB handle, so it can run in a background thread.
+ * 
+ * @param endpoints the endpoints
+ * @param num the number of endpoints
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_endpoint_measure(struct sdb_endpoint* endpoints, size_t num)
+{
+	size_t i;
+	
+	
+	// Open a connection to each endpoint, without sending a request
+	
+	CURLM* multi = curl_multi_init();
+	if (multi == NULL) return SDB_E_CURL_INIT_FAILED;
+	
+	struct sdb_event_loop loop;
+	sdb_event_loop_init(&loop);
+	sdb_event_loop_attach(&loop, multi);
+	
+	CURL** handles = (CURL**) malloc(sizeof(CURL*) * num);
+	
+	for (i = 0; i < num; i++) {
+		endpoints[i].rtt = -1;
 		
-		curl_multi_remove_handle(sdb->curl_multi, m->curl);
+		handles[i] = curl_easy_init();
+		if (handles[i] == NULL) continue;
 		
-		sdb_params_free(m->params);
+		curl_easy_setopt(handles[i], CURLOPT_URL, endpoints[i].url);
+		curl_easy_setopt(handles[i], CURLOPT_CONNECT_ONLY, 1L);
+		curl_easy_setopt(handles[i], CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(handles[i], CURLOPT_CONNECTTIMEOUT_MS, (long) SDB_ENDPOINT_PROBE_TIMEOUT);
+		curl_easy_setopt(handles[i], CURLOPT_PRIVATE, &endpoints[i]);
+		curl_multi_add_handle(multi, handles[i]);
+	}
+	
+	int r = sdb_event_loop_wait(&loop, multi);
+	
+	
+	// The round-trip time is the duration of the TCP handshake
+	
+	CURLMsg* msg;
+	int remaining;
+	
+	while ((msg = curl_multi_info_read(multi, &remaining)) != NULL) {
+		if (msg->msg != CURLMSG_DONE || msg->data.result != CURLE_OK) continue;
 		
-		if (m->curl != NULL) curl_easy_cleanup(m->curl);
-		if (m->post != NULL) free(m->post);
-		if (m->rec.buffer != NULL) free(m->rec.buffer);
+		struct sdb_endpoint* e;
+		double lookup, connect;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &e);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_NAMELOOKUP_TIME, &lookup);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_CONNECT_TIME, &connect);
 		
-		free(m);
+		e->rtt = connect - lookup;
 	}
-} 
+	
+	for (i = 0; i < num; i++) {
+		if (handles[i] == NULL) continue;
+		curl_multi_remove_handle(multi, handles[i]);
+		curl_easy_cleanup(handles[i]);
+	}
+	
+	free(handles);
+	curl_multi_cleanup(multi);
+	sdb_event_loop_cleanup(&loop);
+	
+	return r;
+}
 
 
 /**
- * Find the multi data structure based on the Curl handle
+ * Find the closest endpoint
  * 
- * @param chain the beginning of the chain
- * @param curl the Curl handle
- * @return the data structure, or NULL if not found
+ * @param endpoints the measured endpoints
+ * @param num the number of endpoints
+ * @return the index of the closest endpoint, or -1 if none can be reached
  */
-struct sdb_multi_data* sdb_multi_find(struct sdb_multi_data* chain, CURL* curl)
+static int sdb_endpoint_best(const struct sdb_endpoint* endpoints, size_t num)
 {
-	struct sdb_multi_data* m;
+	int best = -1;
+	size_t i;
 	
-	for (m = chain; m != NULL; m = m->next) {
-		if (m->curl == curl) return m;
+	for (i = 0; i < num; i++) {
+		if (endpoints[i].rtt < 0) continue;
+		if (best < 0 || endpoints[i].rtt < endpoints[best].rtt) best = (int) i;
 	}
 	
-	return NULL;
+	return best;
 }
 
 
 /**
- * Create a formatted UTC timestamp
+ * Switch to the closest endpoint of the set, as of the last measurement
  * 
- * @param buffer the buffer to which to write the timestamp (must be at least 32 bytes long)
+ * @param sdb the SimpleDB handle
+ * @param job the background measurement, which also looked up the closest endpoint
+ *            and chose its HTTP version (NULL = do both now)
  * @return SDB_OK if no errors occurred
  */
-int sdb_timestamp(char* buffer)
+static int sdb_endpoint_choose(struct SDB* sdb, struct sdb_probe_job* job)
 {
-	// Get the time
+	int best = sdb_endpoint_best(sdb->endpoints, sdb->num_endpoints);
+	if (best < 0) return SDB_E_NO_ENDPOINT;
 	
-	time_t rawtime;
-	struct tm* ptm;
-	time(&rawtime);
-	ptm = gmtime(&rawtime);
+	const char* url = sdb->endpoints[best].url;
+	if (strcmp(url, sdb->aws_url) == 0) return SDB_OK;
+	if (job == NULL) return sdb_endpoint_set(sdb, url);
 	
 	
-	// Format
-	 
-	sprintf(buffer, "%04d-%02d-%02dT%02d:%02d:%02d.000Z", ptm->tm_year + 1900, ptm->tm_mon + 1,
-					ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+	// Use the HTTP version chosen in the background (if multiplexing was turned
+	// on since the measurement started, let Curl use its default)
+	
+	struct sdb_dns_job* dns = &job->dns;
+	SDB_SAFE(sdb_endpoint_use(sdb, url));
+	
+	if (sdb->multiplexing) sdb->http_version = job->http_version;
+	
+	
+	// Pin the addresses found in the background; without them, drop the pins
+	// of the old host and look up the new one with the next request
+	
+	if (sdb->dns_pinning) {
+		if (SDB_SUCCESS(dns->result) && dns->url != NULL && strcmp(dns->url, url) == 0) {
+			sdb_dns_pin(sdb, dns);
+		}
+		else {
+			sdb_dns_cleanup(sdb);
+			sdb->dns_next_refresh = 0;
+		}
+	}
 	
 	return SDB_OK;
 }
 
 
 /**
- * Sign a string
+ * Measure the round-trip time to each endpoint of the set in parallel and
+ * switch to the closest one
  * 
  * @param sdb the SimpleDB handle
- * @param str the string to sign
- * @param buffer the buffer to write the signature to (must be at least EVP_MAX_MD_SIZE * 2 bytes)
- * @param plen the pointer to the place to store the length of the signature (can be NULL)
  * @return SDB_OK if no errors occurred
  */
-int sdb_sign(struct SDB* sdb, const char* str, char* buffer, size_t* plen)
+int sdb_endpoint_probe(struct SDB* sdb)
 {
-	unsigned char md[EVP_MAX_MD_SIZE];
-	unsigned mdl;
-	
-	HMAC(EVP_sha256(), sdb->sdb_secret, sdb->sdb_secret_len, (const unsigned char*) str, strlen(str), md, &mdl);
-	 
-	size_t l = base64(md, mdl, buffer, EVP_MAX_MD_SIZE * 2);
-	
-	if (l == 0) return SDB_E_OPEN_SSL_FAILED;
-	if (plen != NULL) *plen = l;
+	if (sdb->num_endpoints == 0) return SDB_OK;
+	if (sdb->endpoint_interval > 0) sdb->endpoint_next_probe = time(NULL) + sdb->endpoint_interval;
 	
-	return SDB_OK;
+	SDB_SAFE(sdb_endpoint_measure(sdb->endpoints, sdb->num_endpoints));
+	return sdb_endpoint_choose(sdb, NULL);
 }
 
 
 /**
- * Allocate an array for storing SimpleDB parameters
+ * Free a background measurement
  * 
- * @param capacity the estimated capacity
- * @return the array
- */ 
-struct sdb_params* sdb_params_alloc(size_t capacity)
+ * @param job the measurement
+ */
+static void sdb_probe_job_free(struct sdb_probe_job* job)
 {
-	struct sdb_params* p = (struct sdb_params*) malloc(sizeof(struct sdb_params));
-	p->size = 0;
-	p->capacity = capacity;
-	p->params = (struct sdb_pair*) malloc((capacity + 8) * sizeof(struct sdb_pair));
-	return p;
+	size_t i;
+	
+	for (i = 0; i < job->num_endpoints; i++) free(job->endpoints[i].url);
+	free(job->endpoints);
+	sdb_dns_job_clear(&job->dns);
+	free(job);
 }
 
 
 /**
- * Free a parameters array
+ * The entry point of the thread of a background measurement
  * 
- * @param params the arrays to free
+ * @param arg the measurement
+ * @return NULL
  */
-void sdb_params_free(struct sdb_params* params)
+static void* sdb_probe_job_main(void* arg)
 {
-	if (params == NULL) return;
+	struct sdb_probe_job* job = (struct sdb_probe_job*) arg;
 	
-	size_t i;
+	job->result = sdb_endpoint_measure(job->endpoints, job->num_endpoints);
 	
-	for (i = 0; i < params->size; i++)
-	{
-		if (params->params[i].parent == params) {
-			free(params->params[i].key);
-			free(params->params[i].value);
-		}
+	
+	// Resolve the closest endpoint, so that switching to it does not need
+	// a DNS lookup on the request path
+	
+	int best = sdb_endpoint_best(job->endpoints, job->num_endpoints);
+	if (SDB_SUCCESS(job->result) && job->pinning && best >= 0) {
+		job->dns.url = strdup(job->endpoints[best].url);
+		job->dns.result = sdb_dns_resolve(&job->dns);
 	}
-	free(params->params);
-	free(params);
+	
+	
+	// Choose its HTTP version, too (without the share object of the handle,
+	// which is not locked for the use from another thread)
+	
+	if (SDB_SUCCESS(job->result) && job->multiplexing && best >= 0) {
+		job->http_version = sdb_http_version_probe(job->endpoints[best].url, NULL);
+	}
+	
+	__atomic_store_n(&job->done, TRUE, __ATOMIC_RELEASE);
+	
+	return NULL;
 }
 
 
 /**
- * Add a parameter (this routine will make a copy of its inputs)
+ * Start measuring the endpoint set in a background thread, so that the
+ * requests keep going to the current endpoint in the meantime
  * 
- * @param params the parameter array
- * @param key the key
- * @param value the value
+ * @param sdb the SimpleDB handle
  * @return SDB_OK if no errors occurred
  */
-int sdb_params_add(struct sdb_params* params, const char* key, const char* value)
+static int sdb_probe_job_start(struct SDB* sdb)
 {
-	if (params->capacity <= params->size) return SDB_E_CAPACITY_TOO_SMALL;
+	size_t i;
 	
-	params->params[params->size].key = strdup(key);
-	params->params[params->size].value = strdup(value);
-	params->params[params->size].parent = params;
+	sdb->endpoint_next_probe = time(NULL) + sdb->endpoint_interval;
 	
-	params->size++;
+	struct sdb_probe_job* job = (struct sdb_probe_job*) malloc(sizeof(struct sdb_probe_job));
+	job->done = FALSE;
+	job->result = SDB_OK;
+	job->pinning = sdb->dns_pinning;
+	job->multiplexing = sdb->multiplexing;
+	job->http_version = CURL_HTTP_VERSION_NONE;
+	job->num_endpoints = sdb->num_endpoints;
+	job->endpoints = (struct sdb_endpoint*) malloc(sizeof(struct sdb_endpoint) * job->num_endpoints);
 	
-	return SDB_OK;
-}
-
-
+	for (i = 0; i < job->num_endpoints; i++) {
+		job->endpoints[i].url = strdup(sdb->endpoints[i].url);
+		job->endpoints[i].rtt = -1;
+	}
+	
+	memset(&job->dns, 0, sizeof(job->dns));
+	job->dns.result = SDB_E_RESOLVE_FAILED;
+	
+	if (pthread_create(&job->thread, NULL, sdb_probe_job_main, job) != 0) {
+		sdb_probe_job_free(job);
+		return SDB_E_INTERNAL_ERROR;
+	}
+	
+	sdb->probe_job = job;
+	return SDB_OK;
+}
+
+
 /**
- * Add elements from another parameter array without making a copy of the inputs
+ * Wait for the background measurement and take over the round-trip times
  * 
- * @param params the parameter array
- * @param other the other parameter array
- * @return SDB_OK if no errors occurred
+ * @param sdb the SimpleDB handle
+ * @return the measurement (free it using sdb_probe_job_free)
  */
-int sdb_params_add_all(struct sdb_params* params, struct sdb_params* other)
+static struct sdb_probe_job* sdb_probe_job_finish(struct SDB* sdb)
 {
-	if (params->capacity < params->size + other->size) return SDB_E_CAPACITY_TOO_SMALL;
+	struct sdb_probe_job* job = sdb->probe_job;
+	size_t i;
 	
-	int i;
-	for (i = 0; i < other->size; i++) {
-		params->params[params->size].key = other->params[i].key;
-		params->params[params->size].value = other->params[i].value;
-		params->params[params->size].parent = other;
+	pthread_join(job->thread, NULL);
+	sdb->probe_job = NULL;
+	
+	for (i = 0; i < job->num_endpoints; i++) sdb->endpoints[i].rtt = job->endpoints[i].rtt;
+	
+	return job;
+}
+
+
+/**
+ * Re-evaluate the endpoint set in the background if it is time to do so, and
+ * switch to the closest endpoint once a measurement completes
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_endpoint_update(struct SDB* sdb)
+{
+	int r;
+	
+	
+	// Refresh the pinned addresses
+	
+	sdb_dns_update(sdb);
+	
+	
+	// Switch to the closest endpoint once the background measurement completes
+	
+	if (sdb->probe_job != NULL) {
+		if (!__atomic_load_n(&sdb->probe_job->done, __ATOMIC_ACQUIRE)) return;
 		
-		params->size++;
+		struct sdb_probe_job* job = sdb_probe_job_finish(sdb);
+		r = job->result;
+		if (SDB_SUCCESS(r)) r = sdb_endpoint_choose(sdb, job);
+		sdb_probe_job_free(job);
+		
+		if (SDB_FAILED(r) && sdb->errout != NULL) {
+			fprintf(sdb->errout, "SimpleDB Error %d while probing the endpoints, staying with %s\n", r, sdb->aws_url);
+		}
 	}
 	
-	return SDB_OK;
+	
+	// Re-evaluate the endpoint set
+	
+	if (sdb->num_endpoints == 0 || sdb->endpoint_interval <= 0) return;
+	if (time(NULL) < sdb->endpoint_next_probe) return;
+	
+	r = sdb_probe_job_start(sdb);
+	if (SDB_FAILED(r) && sdb->errout != NULL) {
+		fprintf(sdb->errout, "SimpleDB Error %d while probing the endpoints, staying with %s\n", r, sdb->aws_url);
+	}
 }
 
 
 /**
- * String comparison wrapper
+ * Free the endpoint set, discarding the background measurement (if any)
  * 
- * @param a the first value
- * @param b the second value
- * @return the comparison return code
+ * @param sdb the SimpleDB handle
  */
-int str_compare(const void* a, const void* b)
-{	
-	struct sdb_pair *pa, *pb;
+void sdb_endpoint_cleanup(struct SDB* sdb)
+{
+	size_t i;
 	
-	pa = (struct sdb_pair*)a;
-	pb = (struct sdb_pair*)b;
+	if (sdb->probe_job != NULL) sdb_probe_job_free(sdb_probe_job_finish(sdb));
 	
-	return strcmp(pa->key, pb->key);
+	for (i = 0; i < sdb->num_endpoints; i++) free(sdb->endpoints[i].url);
+	if (sdb->endpoints != NULL) free(sdb->endpoints);
+	
+	sdb->endpoints = NULL;
+	sdb->num_endpoints = 0;
 }
 
 
 /**
- * Sort the parameters by the keys
+ * Find the host and the port of a service URL
  * 
- * @param params the parameter array
- * @return SDB_OK if no errors occurred
+ * @param url the service URL
+ * @param host the output buffer for the host name
+ * @param hlen the size of the host buffer
+ * @param port the output buffer for the port (must have room for 8 characters)
+ * @return SDB_OK if no errors occurred, or SDB_E_INVALID_URL
  */
-int sdb_params_sort(struct sdb_params* params)
+static int sdb_url_host(const char* url, char* host, size_t hlen, char* port)
 {
-	qsort(params->params, params->size, sizeof(struct sdb_pair), str_compare);
+	const char* h;
+	
+	if (strncasecmp(url, "https://", 8) == 0) {
+		h = url + 8;
+		strcpy(port, "443");
+	}
+	else if (strncasecmp(url, "http://", 7) == 0) {
+		h = url + 7;
+		strcpy(port, "80");
+	}
+	else {
+		return SDB_E_INVALID_URL;
+	}
+	
+	size_t l = strcspn(h, "/?#");
+	const char* colon = h[0] == '[' ? NULL : (const char*) memchr(h, ':', l);
+	
+	if (colon != NULL) {
+		size_t pl = l - (colon + 1 - h);
+		if (pl == 0 || pl > 5) return SDB_E_INVALID_URL;
+		memcpy(port, colon + 1, pl);
+		port[pl] = '\0';
+		l = colon - h;
+	}
+	
+	if (l == 0 || l >= hlen) return SDB_E_INVALID_URL;
+	memcpy(host, h, l);
+	host[l] = '\0';
+	
 	return SDB_OK;
 }
 
+
 /**
- * Slight modification to curl_easy_escape, since it escapes a few characters
- * that the SimpleDB API does not want escaped.
+ * Resolve the host of a service URL. This does not use the SimpleDB handle,
+ * so it can run in a background thread.
  * 
- * @param sdb the SimpleDB handle
- * @param string the string to escape
- * @param inlength the length of the inbound character string
- * @return the escaped string
+ * @param job the lookup, with the URL set (the addresses are added to it)
+ * @return SDB_OK if no errors occurred
  */
-char *sdb_escape(struct SDB* sdb, const char *string, int inlength)
+int sdb_dns_resolve(struct sdb_dns_job* job)
 {
-	size_t alloc = (inlength?(size_t)inlength:strlen(string))+1;
-	char *ns;
-	char *testing_ptr = NULL;
-	unsigned char in; /* we need to treat the characters unsigned */
-	size_t newlen = alloc;
-	int strindex=0;
-	size_t length;
+	int j, n = 0;
 	
-	ns = malloc(alloc);
-	if(!ns)
-		return NULL;
+	job->num_addrs = 0;
 	
-	length = alloc-1;
-	while(length--) {
-		in = *string;
-
-		/* Portable character check (remember EBCDIC). Do not use isalnum() because
-		its behavior is altered by the current locale. */
-
-    	switch (in) {
-			case '0': case '1': case '2': case '3': case '4':
-			case '5': case '6': case '7': case '8': case '9':
-			case 'a': case 'b': case 'c': case 'd': case 'e':
-			case 'f': case 'g': case 'h': case 'i': case 'j':
-			case 'k': case 'l': case 'm': case 'n': case 'o':
-			case 'p': case 'q': case 'r': case 's': case 't':
-			case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
-			case 'A': case 'B': case 'C': case 'D': case 'E':
-			case 'F': case 'G': case 'H': case 'I': case 'J':
-			case 'K': case 'L': case 'M': case 'N': case 'O':
-			case 'P': case 'Q': case 'R': case 'S': case 'T':
-			case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
-			case '~': case '_': case '-': case '.':
-				/* just copy this */
-				ns[strindex++]=in;
-				break;
-			default:
-				/* encode it */
-				newlen += 2; /* the size grows with two, since this'll become a %XX */
-				if(newlen > alloc) {
-					alloc *= 2;
-					testing_ptr = realloc(ns, alloc);
-					if(!testing_ptr) {
-						free( ns );
-						return NULL;
-					}
-					else {
-						ns = testing_ptr;
-					}
-				}
-
-#ifdef CURL_DOES_CONVERSIONS
-/* escape sequences are always in ASCII so convert them on non-ASCII hosts */
-				if(!sdb->curl_handle ||
-				(Curl_convert_to_network(sdb->curl_handle, &in, 1) != CURLE_OK)) {
-				/* Curl_convert_to_network calls failf if unsuccessful */
-					free(ns);
-					return NULL;
-				}
-#endif /* CURL_DOES_CONVERSIONS */
-		
-				snprintf(&ns[strindex], 4, "%%%02X", in);
+	SDB_SAFE(sdb_url_host(job->url, job->host, sizeof(job->host), job->port));
+	if (job->host[0] == '[') return SDB_OK;
+	
+	struct addrinfo hints, *res, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	if (getaddrinfo(job->host, job->port, &hints, &res) != 0) return SDB_E_RESOLVE_FAILED;
+	
+	for (ai = res; ai != NULL && n < SDB_DNS_MAX_ADDRESSES; ai = ai->ai_next) {
+		char a[INET6_ADDRSTRLEN + 2];
 		
-				strindex+=3;
-				break;
+		if (ai->ai_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in*) ai->ai_addr)->sin_addr, a, sizeof(a));
+		}
+		else if (ai->ai_family == AF_INET6) {
+			a[0] = '[';
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*) ai->ai_addr)->sin6_addr, a + 1, sizeof(a) - 2);
+			strcat(a, "]");
 		}
-		string++;
+		else {
+			continue;
+		}
+		
+		for (j = 0; j < n; j++) if (strcmp(job->addrs[j], a) == 0) break;
+		if (j == n) job->addrs[n++] = strdup(a);
 	}
-	ns[strindex]=0; /* terminate it */
-	return ns;
+	
+	freeaddrinfo(res);
+	
+	job->num_addrs = n;
+	return n == 0 ? SDB_E_RESOLVE_FAILED : SDB_OK;
 }
 
+
 /**
- * Create the URL-encoded parameters string with SignatureVersion 2 sig.
+ * Pin the addresses found by a lookup, replacing the pinned ones. There is
+ * a CURLOPT_RESOLVE list for each rotation of the addresses, so that the
+ * requests spread across them.
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @param pbuffer the variable for the output buffer (will be allocated by the routine, but has to be freed by caller)
- * @return SDB_OK if no errors occurred
+ * @param job the completed lookup
  */
-int sdb_params_export(struct SDB* sdb, struct sdb_params* params, char** pbuffer)
+void sdb_dns_pin(struct SDB* sdb, struct sdb_dns_job* job)
 {
-	assert(params->size >= 2);
+	int i, j, n = job->num_addrs;
 	
-	// Sign the parameters
+	sdb_dns_cleanup(sdb);
+	if (n == 0) return;
 	
-	char signature[EVP_MAX_MD_SIZE * 2];
 	
-	// Determine the appropriate size
+	// Create the "host:port:address,address,..." lists, each starting with a different address
 	
-	size_t i, l = 0;
-	for (i = 0; i < params->size; i++) {
-		l += strlen(params->params[i].key) + 1;
-		l += strlen(params->params[i].value) * 3 + 1;
-	}
+	size_t length = strlen(job->host) + strlen(job->port) + 4;
+	for (i = 0; i < n; i++) length += strlen(job->addrs[i]) + 1;
 	
-	// Allocate buffer
+	char* entry = (char*) malloc(length);
+	struct curl_slist** pins = (struct curl_slist**) malloc(sizeof(struct curl_slist*) * n);
 	
-	*pbuffer = (char*) malloc(l + 4);
-	char* b = *pbuffer;
-	*b = '\0';
+	for (i = 0; i < n; i++) {
+		sprintf(entry, "%s:%s:", job->host, job->port);
+		for (j = 0; j < n; j++) {
+			if (j > 0) strcat(entry, ",");
+			strcat(entry, job->addrs[(i + j) % n]);
+		}
+		pins[i] = curl_slist_append(NULL, entry);
+	}
 	
-	// Build the string
+	free(entry);
 	
-	SDB_SAFE(sdb_params_sort(params));
-	for (i = 0; i < params->size; i++) {
+	sdb->dns_pins = pins;
+	sdb->num_dns_pins = n;
+}
+
+
+/**
+ * Free the URL and the addresses of a lookup
+ * 
+ * @param job the lookup
+ */
+void sdb_dns_job_clear(struct sdb_dns_job* job)
+{
+	int i;
 	
-		if (i > 0) strcat(b, "&");
-		
-		strcat(b, params->params[i].key);
-		strcat(b, "=");
-		
-		char* e = sdb_escape(sdb, params->params[i].value, strlen(params->params[i].value));
-		if (e == NULL) {
-			free(b);
-			*pbuffer = NULL;
-			return SDB_E_URL_ENCODE_FAILED;
-		} 
-		
-		strcat(b, e);
-		curl_free(e);
-	}
+	for (i = 0; i < job->num_addrs; i++) free(job->addrs[i]);
+	job->num_addrs = 0;
+	
+	if (job->url != NULL) free(job->url);
+	job->url = NULL;
+}
+
+
+/**
+ * Resolve the host of the current endpoint and pin its addresses, so that
+ * new connections do not need DNS lookups. If the lookup fails, the
+ * previously pinned addresses are kept.
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_dns_refresh(struct SDB* sdb)
+{
+	struct sdb_dns_job job;
 	
-	// string is built, now build complete string to sign
+	if (sdb->dns_interval > 0) sdb->dns_next_refresh = time(NULL) + sdb->dns_interval;
 	
-	l = strlen(b) + 25;
-	char* s = (char*) alloca(l);
-	*s = '\0';
+	memset(&job, 0, sizeof(job));
+	job.url = strdup(sdb->aws_url);
 	
-	strcat(s, "POST\n");
-	strcat(s, "sdb.amazonaws.com\n");
-	strcat(s, "/\n");
-	strcat(s, b);
+	int r = sdb_dns_resolve(&job);
+	if (SDB_SUCCESS(r)) sdb_dns_pin(sdb, &job);
 	
-	// Create the signature and add it to the URL-encoded param string
+	sdb_dns_job_clear(&job);
+	return r;
+}
+
+
+/**
+ * The entry point of the thread of a background lookup
+ * 
+ * @param arg the lookup
+ * @return NULL
+ */
+static void* sdb_dns_job_main(void* arg)
+{
+	struct sdb_dns_job* job = (struct sdb_dns_job*) arg;
 	
-	SDB_SAFE(sdb_sign(sdb, s, signature, NULL));
+	job->result = sdb_dns_resolve(job);
+	__atomic_store_n(&job->done, TRUE, __ATOMIC_RELEASE);
 	
-	strcat(b, "&Signature=");
-	char* e = sdb_escape(sdb->curl_handle, signature, strlen(signature));
-	if (e == NULL) {
-		free(b);
-		*pbuffer = NULL;
-		return SDB_E_URL_ENCODE_FAILED;
+	return NULL;
+}
+
+
+/**
+ * Start resolving the host of the current endpoint in a background thread,
+ * so that the requests keep using the pinned addresses in the meantime
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_dns_job_start(struct SDB* sdb)
+{
+	sdb->dns_next_refresh = time(NULL) + sdb->dns_interval;
+	
+	struct sdb_dns_job* job = (struct sdb_dns_job*) malloc(sizeof(struct sdb_dns_job));
+	memset(job, 0, sizeof(struct sdb_dns_job));
+	job->done = FALSE;
+	job->result = SDB_E_RESOLVE_FAILED;
+	job->url = strdup(sdb->aws_url);
+	
+	if (pthread_create(&job->thread, NULL, sdb_dns_job_main, job) != 0) {
+		sdb_dns_job_clear(job);
+		free(job);
+		return SDB_E_INTERNAL_ERROR;
 	}
-	strcat(b, e);
-	free(e);
 	
+	sdb->dns_job = job;
 	return SDB_OK;
 }
 
 
 /**
- * Add required SimpleDB parameters to the array
+ * Wait for the background lookup
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
+ * @return the lookup (release it using sdb_dns_job_clear and free)
  */
-int sdb_params_add_required(struct SDB* sdb, struct sdb_params* params)
+static struct sdb_dns_job* sdb_dns_job_finish(struct SDB* sdb)
 {
-	SDB_SAFE(sdb_params_add(params, "SignatureVersion", sdb->sdb_signature_ver_str));
-	SDB_SAFE(sdb_params_add(params, "SignatureMethod", "HmacSHA256"));
-	SDB_SAFE(sdb_params_add(params, "AWSAccessKeyId", sdb->sdb_key));
+	struct sdb_dns_job* job = sdb->dns_job;
 	
-	// Version 2007-11-07 deprecated Aug 24, 2010 
-	size_t i = 0;
-	for (i = 0; i < params->size; i++) {
-		if (strcmp(params->params[i].key, "Action") == 0) {
-			if (strcmp(params->params[i].value, "Query") == 0 ||
-			strcmp(params->params[i].value, "QueryWithAttributes") == 0) {
-				SDB_SAFE(sdb_params_add(params, "Version", "2007-11-07"));
-			} else {
-				SDB_SAFE(sdb_params_add(params, "Version", "2009-04-15"));
-			}
-			break;
-		}
-	}
+	pthread_join(job->thread, NULL);
+	sdb->dns_job = NULL;
 	
-	return SDB_OK;
+	return job;
 }
 
 
 /**
- * Deep copy the parameters
+ * Refresh the pinned addresses in the background if it is time to do so, and
+ * pin the new addresses once a lookup completes
  * 
- * @param params the parameter array
- * @return the deep copy
+ * @param sdb the SimpleDB handle
  */
-struct sdb_params* sdb_params_deep_copy(struct sdb_params* params)
+void sdb_dns_update(struct SDB* sdb)
 {
-	if (params == NULL) return NULL;
+	int r;
 	
-	int i;
-	struct sdb_params* p = sdb_params_alloc(params->capacity);
 	
-	for (i = 0; i < params->size; i++) sdb_params_add(p, params->params[i].key, params->params[i].value);
+	// Pin the addresses found in the background, unless the endpoint changed in the meantime
 	
-	return p;
+	if (sdb->dns_job != NULL && __atomic_load_n(&sdb->dns_job->done, __ATOMIC_ACQUIRE)) {
+		struct sdb_dns_job* job = sdb_dns_job_finish(sdb);
+		
+		r = job->result;
+		if (SDB_SUCCESS(r) && sdb->dns_pinning && strcmp(job->url, sdb->aws_url) == 0) sdb_dns_pin(sdb, job);
+		if (SDB_FAILED(r) && sdb->errout != NULL) {
+			fprintf(sdb->errout, "SimpleDB Error %d while resolving %s, keeping the pinned addresses\n", r, job->url);
+		}
+		
+		sdb_dns_job_clear(job);
+		free(job);
+	}
+	
+	
+	// Start the next lookup
+	
+	if (!sdb->dns_pinning || sdb->dns_interval <= 0 || sdb->dns_job != NULL) return;
+	if (time(NULL) < sdb->dns_next_refresh) return;
+	
+	r = sdb_dns_job_start(sdb);
+	if (SDB_FAILED(r) && sdb->errout != NULL) {
+		fprintf(sdb->errout, "SimpleDB Error %d while resolving %s, keeping the pinned addresses\n", r, sdb->aws_url);
+	}
 }
 
 
 /**
- * Create the command POST data
+ * Wait for the background lookup (if any) and discard its result
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @return the URL, or NULL on error
  */
-char* sdb_post(struct SDB* sdb, struct sdb_params* params)
+void sdb_dns_wait(struct SDB* sdb)
 {
-	char* urlencoded;
-	if (SDB_FAILED(sdb_params_export(sdb, params, &urlencoded))) return NULL;
+	if (sdb->dns_job == NULL) return;
 	
-	return urlencoded;
+	struct sdb_dns_job* job = sdb_dns_job_finish(sdb);
+	sdb_dns_job_clear(job);
+	free(job);
 }
 
 
 /**
- * The Curl write callback function
+ * Release the pinned addresses. The deferred multi calls may still refer to
+ * the lists, so these are freed only once there are no such calls.
  * 
- * @param buffer the received buffer
- * @param size the size of an item
- * @param num the number of items
- * @param data the user data
- * @return the number of processed bytes
+ * @param sdb the SimpleDB handle
  */
-size_t sdb_write_callback(void* buffer, size_t size, size_t num, void* data)
+void sdb_dns_cleanup(struct SDB* sdb)
 {
-	// Initialize
-	
-	struct sdb_buffer* rec = (struct sdb_buffer*) data;
-	size_t bytes = size * num;
+	int i;
 	
+	if (sdb->num_dns_pins > 0) {
+		sdb->dns_retired = (struct curl_slist**) realloc(sdb->dns_retired,
+				sizeof(struct curl_slist*) * (sdb->num_dns_retired + sdb->num_dns_pins));
+		for (i = 0; i < sdb->num_dns_pins; i++) sdb->dns_retired[sdb->num_dns_retired++] = sdb->dns_pins[i];
+	}
 	
-	// Check the buffer size
+	if (sdb->dns_pins != NULL) free(sdb->dns_pins);
+	sdb->dns_pins = NULL;
+	sdb->num_dns_pins = 0;
 	
-	if (rec->size + bytes > rec->capacity) {
+	if (sdb->multi == NULL) {
+		for (i = 0; i < sdb->num_dns_retired; i++) curl_slist_free_all(sdb->dns_retired[i]);
+		sdb->num_dns_retired = 0;
+	}
+}
+
+
+/**
+ * Stop pinning the addresses, and remove the pinned entry from the shared
+ * DNS cache with the next request
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_dns_unpin(struct SDB* sdb)
+{
+	if (sdb->num_dns_pins > 0) {
+		const char* pin = sdb->dns_pins[0]->data;
+		const char* colon = strchr(strchr(pin, ':') + 1, ':');
 		
-		// Reallocate the buffer
+		char* entry = (char*) malloc(colon - pin + 2);
+		entry[0] = '-';
+		memcpy(entry + 1, pin, colon - pin);
+		entry[colon - pin + 1] = '\0';
 		
-		rec->capacity = 2 * (rec->size + bytes) + 4096;
-		char* buf = (char*) malloc(rec->capacity);
-		assert(buf);
 		
-		memcpy(buf, rec->buffer, rec->size);
+		// A replaced list may still be used by a deferred call
 		
-		free(rec->buffer);
-		rec->buffer = buf;
+		if (sdb->dns_unpin != NULL) {
+			sdb->dns_pins = (struct curl_slist**) realloc(sdb->dns_pins, sizeof(struct curl_slist*) * (sdb->num_dns_pins + 1));
+			sdb->dns_pins[sdb->num_dns_pins++] = sdb->dns_unpin;
+		}
+		
+		sdb->dns_unpin = curl_slist_append(NULL, entry);
+		sdb->dns_unpin_pending = sdb->dns_unpin != NULL;
+		free(entry);
 	}
 	
+	sdb_dns_cleanup(sdb);
+}
+
+
+/**
+ * Point a Curl handle to the current endpoint before a request, together
+ * with its HTTP version and the next rotation of the pinned addresses (if
+ * any). Curl loads the list into the shared DNS cache when the transfer
+ * starts.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle
+ */
+void sdb_target_apply(struct SDB* sdb, CURL* curl)
+{
+	curl_easy_setopt(curl, CURLOPT_URL, sdb->aws_url);
+	sdb_http_options_apply(sdb, curl);
 	
-	// Copy the buffer contents
+	if (sdb->num_dns_pins > 0) {
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, sdb->dns_pins[sdb->dns_next++ % sdb->num_dns_pins]);
+	}
+	else {
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, sdb->dns_unpin_pending ? sdb->dns_unpin : NULL);
+		sdb->dns_unpin_pending = FALSE;
+	}
+}
+
+
+/**
+ * Set the connect and stall timeouts of a Curl handle
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle
+ */
+void sdb_timeouts_apply(struct SDB* sdb, CURL* curl)
+{
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, sdb->connect_timeout);
 	
-	memcpy(rec->buffer + rec->size, buffer, bytes);
-	rec->size += bytes;
 	
-	return bytes;
+	// A stalled transfer is one that receives less than a byte per second
+	
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, sdb->stall_timeout > 0 ? 1L : 0L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, sdb->stall_timeout > 0 ? (sdb->stall_timeout + 999) / 1000 : 0L);
 }
 
 
 /**
- * Execute a command and ignore the result-set
+ * Create the list of the HTTP headers for a transport profile
  * 
- * @param sdb the SimpleDB handle
- * @param cmd the command name
- * @param _params the parameters
- * @return the result
+ * @param profile the transport profile
+ * @return the list of headers
  */
-int sdb_execute(struct SDB* sdb, const char* cmd, struct sdb_params* _params)
+struct curl_slist* sdb_headers_create(int profile)
 {
-	// Prepare the command execution
+	struct curl_slist* headers = curl_slist_append(NULL, SDB_HTTP_HEADER_CONTENT_TYPE);
 	
-	struct sdb_params* params = sdb_params_alloc(_params->size + 8);
-	SDB_SAFE(sdb_params_add(params, "Action", cmd));
-	char timestamp[32]; sdb_timestamp(timestamp);
-	SDB_SAFE(sdb_params_add(params, "Timestamp", timestamp));
 	
+	// Send the larger bodies right away instead of waiting for "100 Continue"
 	
-	// Add the command parameters
+	if (profile == SDB_TRANSPORT_LOW_LATENCY) headers = curl_slist_append(headers, SDB_HTTP_HEADER_NO_EXPECT);
 	
-	SDB_SAFE(sdb_params_add_all(params, _params));
+	return headers;
+}
+
+
+/**
+ * Set the HTTP headers and the TCP options of the transport profile on a Curl handle
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle
+ */
+void sdb_transport_apply(struct SDB* sdb, CURL* curl)
+{
+	int low = sdb->transport_profile == SDB_TRANSPORT_LOW_LATENCY;
 	
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, sdb->curl_headers);
 	
-	// Add the required parameters
 	
-	SDB_SAFE(sdb_params_add_required(sdb, params));
-	char* post = sdb_post(sdb, params);
-	long postsize = strlen(post);
-	sdb_params_free(params);
+	// Disable Nagle's algorithm (the default starting with Curl 7.50.2)
 	
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, low || LIBCURL_VERSION_NUM >= 0x073202 ? 1L : 0L);
 	
-	// Configure Curl and execute the command
 	
-	CURL* curl = sdb->curl_handle;
+	// Detect dead idle connections before a request is sent on them
 	
-	sdb->rec.size = 0;
-	curl_easy_setopt(curl, CURLOPT_URL, AWS_URL);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sdb->rec);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
-#ifdef _DEBUG_PRINT_RESPONSE
-	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, low ? 1L : 0L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, low ? (long) SDB_TCP_KEEPIDLE : 60L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, low ? (long) SDB_TCP_KEEPINTVL : 60L);
+	
+	
+	// Send the first request with the SYN when reconnecting (Linux and macOS only)
+	
+#if LIBCURL_VERSION_NUM >= 0x073100
+	curl_easy_setopt(curl, CURLOPT_TCP_FASTOPEN, low ? 1L : 0L);
+#endif
+}
+
+
+/**
+ * Start a call, which sets its deadline unless it is nested in another call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_deadline_begin(struct SDB* sdb)
+{
+	if (sdb->deadline_depth++ > 0) return;
+	sdb->deadline = sdb->call_timeout > 0 ? monotonic_ms() + sdb->call_timeout : 0;
+}
+
+
+/**
+ * Finish a call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_deadline_end(struct SDB* sdb)
+{
+	if (--sdb->deadline_depth > 0) return;
+	sdb->deadline = 0;
+}
+
+
+/**
+ * Check whether the deadline of the current call has passed
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if there is still time, or SDB_E_DEADLINE_EXCEEDED
+ */
+int sdb_deadline_check(struct SDB* sdb)
+{
+	if (sdb->deadline > 0 && monotonic_ms() >= sdb->deadline) return SDB_E_DEADLINE_EXCEEDED;
+	return SDB_OK;
+}
+
+
+/**
+ * Set the transfer timeout of a request, so that it ends by the given deadline
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle of the request
+ * @param deadline the monotonic time by which the request must finish, or 0
+ * @return SDB_OK if there is still time, or SDB_E_DEADLINE_EXCEEDED
+ */
+static int sdb_deadline_apply_to(struct SDB* sdb, CURL* curl, long long deadline)
+{
+	long timeout = sdb->request_timeout;
+	
+	if (deadline > 0) {
+		long long remaining = deadline - monotonic_ms();
+		if (remaining <= 0) return SDB_E_DEADLINE_EXCEEDED;
+		if (timeout == 0 || remaining < timeout) timeout = (long) remaining;
+	}
+	
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+	return SDB_OK;
+}
+
+
+/**
+ * Set the transfer timeout of a request, so that it ends by the deadline of the current call
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle of the request
+ * @return SDB_OK if there is still time, or SDB_E_DEADLINE_EXCEEDED
+ */
+int sdb_deadline_apply(struct SDB* sdb, CURL* curl)
+{
+	return sdb_deadline_apply_to(sdb, curl, sdb->deadline);
+}
+
+
+/**
+ * Get the deadline of a multi call: its own one if it was started by the
+ * background I/O thread, or otherwise the one of sdb_multi_run()
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure of the call
+ * @return the monotonic time by which the call must finish, or 0
+ */
+static long long sdb_multi_deadline(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	return m->deadline > 0 ? m->deadline : sdb->deadline;
+}
+
+
+/**
+ * Wait before retrying a request, but not past the deadline of the current call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_retry_wait(struct SDB* sdb)
+{
+	long delay = sdb->retry_delay;
+	
+	if (sdb->deadline > 0) {
+		long long remaining = (sdb->deadline - monotonic_ms()) * 1000;
+		if (remaining < delay) delay = remaining < 0 ? 0 : (long) remaining;
+	}
+	
+	usleep(delay);
+}
+
+
+/**
+ * Translate a Curl error, distinguishing a missed deadline from other timeouts
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cr the Curl error
+ * @return the corresponding error code
+ */
+int sdb_transfer_error(struct SDB* sdb, CURLcode cr)
+{
+	if (cr == CURLE_OPERATION_TIMEDOUT && SDB_FAILED(sdb_deadline_check(sdb))) return SDB_E_DEADLINE_EXCEEDED;
+	return SDB_CURL_ERROR(cr);
+}
+
+
+/**
+ * Make sure that a buffer has at least the given capacity, growing it geometrically
+ * 
+ * @param buffer the buffer
+ * @param capacity the required capacity
+ * @return the buffer contents, or NULL if the memory could not be allocated
+ */
+char* sdb_buffer_reserve(struct sdb_buffer* buffer, size_t capacity)
+{
+	if (capacity <= buffer->capacity) return buffer->buffer;
+	
+	size_t c = buffer->capacity < SDB_POST_BUFFER_SIZE ? SDB_POST_BUFFER_SIZE : buffer->capacity;
+	while (c < capacity) c *= 2;
+	
+	char* b = (char*) malloc(c);
+	if (b == NULL) return NULL;
+	
+	if (buffer->buffer != NULL) {
+		memcpy(b, buffer->buffer, buffer->size);
+		free(buffer->buffer);
+	}
+	
+	buffer->buffer = b;
+	buffer->capacity = c;
+	
+	return b;
+}
+
+
+/**
+ * Empty a post buffer for reuse, releasing its memory if it grew past the high-water mark
+ * 
+ * @param buffer the buffer
+ */
+void sdb_buffer_trim(struct sdb_buffer* buffer)
+{
+	buffer->size = 0;
+	
+	if (buffer->capacity > SDB_POST_BUFFER_HIGH_WATER) {
+		free(buffer->buffer);
+		buffer->buffer = NULL;
+		buffer->capacity = 0;
+	}
+}
+
+
+/**
+ * Release the unused capacity of a buffer, keeping its contents
+ * 
+ * @param buffer the buffer
+ */
+void sdb_buffer_fit(struct sdb_buffer* buffer)
+{
+	if (buffer->buffer == NULL || buffer->capacity <= buffer->size + 1) return;
+	
+	
+	// Copy the contents instead of shrinking in place, so that the whole old block can be reused
+	
+	char* b = (char*) malloc(buffer->size + 1);
+	if (b == NULL) return;
+	
+	memcpy(b, buffer->buffer, buffer->size);
+	free(buffer->buffer);
+	
+	buffer->buffer = b;
+	buffer->capacity = buffer->size + 1;
+}
+
+
+/**
+ * Insert a deferred call into a list of the waiting calls (the window queue or the retry list)
+ * 
+ * @param head the pointer to the head of the list
+ * @param tail the pointer to the tail of the list
+ * @param after the call to insert it after, or NULL to insert it at the head
+ * @param m the multi data structure
+ */
+static void sdb_multi_list_insert(struct sdb_multi_data** head, struct sdb_multi_data** tail,
+								  struct sdb_multi_data* after, struct sdb_multi_data* m)
+{
+	m->queue_prev = after;
+	m->queue_next = after != NULL ? after->queue_next : *head;
+	
+	if (m->queue_prev != NULL) m->queue_prev->queue_next = m; else *head = m;
+	if (m->queue_next != NULL) m->queue_next->queue_prev = m; else *tail = m;
+}
+
+
+/**
+ * Remove a deferred call from a list of the waiting calls
+ * 
+ * @param head the pointer to the head of the list
+ * @param tail the pointer to the tail of the list
+ * @param m the multi data structure
+ */
+static void sdb_multi_list_remove(struct sdb_multi_data** head, struct sdb_multi_data** tail, struct sdb_multi_data* m)
+{
+	if (m->queue_prev != NULL) m->queue_prev->queue_next = m->queue_next; else *head = m->queue_next;
+	if (m->queue_next != NULL) m->queue_next->queue_prev = m->queue_prev; else *tail = m->queue_prev;
+	
+	m->queue_next = NULL;
+	m->queue_prev = NULL;
+}
+
+
+/**
+ * Add a deferred call to the queue of the calls waiting for room in the in-flight window
+ * 
+ * @param sdb the SimpleDB handle
+ * @param after the queued call to insert it after, or NULL to insert it at the front
+ * @param m the multi data structure
+ */
+static void sdb_multi_enqueue(struct SDB* sdb, struct sdb_multi_data* after, struct sdb_multi_data* m)
+{
+	sdb_multi_list_insert(&sdb->queue_head, &sdb->queue_tail, after, m);
+	
+	m->queued = TRUE;
+	sdb->num_queued++;
+}
+
+
+/**
+ * Remove a deferred call from the queue of the calls waiting for room in the in-flight window
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure
+ */
+static void sdb_multi_dequeue(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	sdb_multi_list_remove(&sdb->queue_head, &sdb->queue_tail, m);
+	
+	m->queued = FALSE;
+	sdb->num_queued--;
+}
+
+
+/**
+ * Compute the delay before a retry: exponential backoff starting at the
+ * retry delay, capped at the maximum retry delay, with random jitter over
+ * the upper half of the interval, so that the throttled calls do not come
+ * back all at once. The delay is at least 1 ms, since the retry timers
+ * have a millisecond resolution.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param retries the number of the previous retries of the call
+ * @return the delay in milliseconds
+ */
+static long sdb_retry_backoff(struct SDB* sdb, int retries)
+{
+	long long delay = sdb->retry_delay < 1000 ? 1000 : sdb->retry_delay;		/* in microseconds */
+	long long max_delay = sdb->retry_max_delay * 1000LL;
+	int i;
+	
+	for (i = 0; i < retries && delay < max_delay; i++) delay *= 2;
+	if (delay > max_delay) delay = max_delay;
+	
+	delay = delay / 2 + rand_r(&sdb->retry_seed) % (unsigned long long) (delay / 2 + 1);
+	return delay < 1000 ? 1 : (long) ((delay + 999) / 1000);
+}
+
+
+/**
+ * Schedule the retry of a deferred call that was throttled (HTTP 503) on its
+ * own timer, unless it ran out of retries or the retry would miss the deadline
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure of the completed transfer
+ * @return TRUE if the retry was scheduled
+ */
+static int sdb_multi_retry(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	long code = 0;
+	
+	if (m->retries >= sdb->retry_count) return FALSE;
+	
+	curl_easy_getinfo(m->curl, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 503) return FALSE;
+	
+	long long due = monotonic_ms() + sdb_retry_backoff(sdb, m->retries);
+	long long deadline = sdb_multi_deadline(sdb, m);
+	if (deadline > 0 && due >= deadline) return FALSE;
+	
+	
+	// Statistics (the response of the failed attempt is dropped)
+	
+	sdb_update_size_stats(sdb, m->curl, m->post_size, m->rec.size);
+	sdb_update_connection_stats(sdb, m->curl);
+	
+	sdb->stat.num_retries++;
+	sdb->stat.num_commands++;
+	if (strncmp(m->command, "Put", 3) == 0) sdb->stat.num_puts++;
+	
+	
+	// Insert the call into the retry list, which is sorted by the time of the retry
+	
+	curl_multi_remove_handle(sdb->curl_multi, m->curl);
+	m->rec.size = 0;
+	m->retries++;
+	m->retry_due = due;
+	
+	struct sdb_multi_data* after = sdb->retry_tail;
+	while (after != NULL && after->retry_due > due) after = after->queue_prev;
+	
+	sdb_multi_list_insert(&sdb->retry_head, &sdb->retry_tail, after, m);
+	m->waiting = TRUE;
+	
+	return TRUE;
+}
+
+
+/**
+ * Move the deferred calls whose retry is due to the front of the window queue
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the time until the next retry in milliseconds, or -1 if there is none
+ */
+static long sdb_multi_retry_due(struct SDB* sdb)
+{
+	long long now = monotonic_ms();
+	struct sdb_multi_data* after = NULL;
+	
+	while (sdb->retry_head != NULL && sdb->retry_head->retry_due <= now) {
+		struct sdb_multi_data* m = sdb->retry_head;
+		
+		sdb_multi_list_remove(&sdb->retry_head, &sdb->retry_tail, m);
+		m->waiting = FALSE;
+		
+		sdb_multi_enqueue(sdb, after, m);
+		after = m;
+	}
+	
+	return sdb->retry_head == NULL ? -1 : (long) (sdb->retry_head->retry_due - now);
+}
+
+
+/**
+ * Start a deferred call: allocate its receive buffer and add it to the multi handle
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_multi_start(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	CURLMcode r;
+	
+	if (sdb_buffer_reserve(&m->rec, SDB_REC_BUFFER_SIZE) == NULL) return SDB_E_INTERNAL_ERROR;
+	if ((r = curl_multi_add_handle(sdb->curl_multi, m->curl)) != CURLM_OK) return SDB_CURLM_ERROR(r);
+	
+	m->started = monotonic_ms();
+	m->hedged = FALSE;
+	sdb->multi_running++;
+	return SDB_OK;
+}
+
+
+/**
+ * Start the queued calls while there is room in the in-flight window
+ * 
+ * @param sdb the SimpleDB handle
+ * @param running the pointer to the number of the calls in flight, which is updated
+ * @return the number of the started calls
+ */
+int sdb_multi_admit(struct SDB* sdb, int* running)
+{
+	int n = 0;
+	
+	sdb->multi_running = *running;
+	
+	while (sdb->queue_head != NULL && (sdb->multi_window == 0 || sdb->multi_running < sdb->multi_window)) {
+		struct sdb_multi_data* m = sdb->queue_head;
+		sdb_multi_dequeue(sdb, m);
+		
+		
+		// The deadline counts from the start of the call, not of this request (a passed one fails it right away)
+		
+		if (SDB_FAILED(sdb_deadline_apply_to(sdb, m->curl, sdb_multi_deadline(sdb, m)))) {
+			curl_easy_setopt(m->curl, CURLOPT_TIMEOUT_MS, 1L);
+		}
+		
+		int r = sdb_multi_start(sdb, m);
+		if (SDB_FAILED(r)) {
+			if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Error: Cannot start the deferred call %p (error %d)\n", m->curl, r);
+			sdb_multi_abort(sdb, m, r == SDB_E_INTERNAL_ERROR ? CURLE_OUT_OF_MEMORY : CURLE_FAILED_INIT);
+			continue;
+		}
+		
+		n++;
+	}
+	
+	*running = sdb->multi_running;
+	return n;
+}
+
+
+/**
+ * Allocate a multi data structure
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the allocated data structure, or NULL on error
+ */
+struct sdb_multi_data* sdb_multi_alloc(struct SDB* sdb)
+{
+	struct sdb_multi_data* m = NULL;
+	
+	
+	// Reuse an existing handle, if there is one
+	
+	if (sdb->multi_free != NULL) {
+	
+		m = sdb->multi_free;
+		sdb->multi_free = sdb->multi_free->next;
+		sdb->multi_free_size--;
+		
+		assert(m->post.size == 0 && m->curl != NULL && m->rec.size == 0);
+	}
+	else {
+		
+		// Otherwise allocate one
+		
+		m = (struct sdb_multi_data*) malloc(sizeof(struct sdb_multi_data));
+		
+		m->rec.size = 0;
+		m->rec.capacity = 0;
+		m->rec.buffer = NULL;		/* allocated when the call starts */
+		
+		m->post.size = 0;
+		m->post.capacity = 0;
+		m->post.buffer = NULL;
+		
+		m->curl = sdb_create_curl(sdb);
+		
+		
+		// Curl keeps the upload buffer of a handle until it is destroyed, so keep it small for the many multi handles
+		
+#if LIBCURL_VERSION_NUM >= 0x073e00
+		if (m->curl != NULL) curl_easy_setopt(m->curl, CURLOPT_UPLOAD_BUFFERSIZE, (long) SDB_MULTI_UPLOAD_BUFFER_SIZE);
+#endif
+	}
+	
+	if (m->curl != NULL) curl_easy_setopt(m->curl, CURLOPT_PRIVATE, m);
+	
+	
+	// Additional initialization
+	
+	m->command[0] = '\0';
+	m->params = NULL;
+	m->group = NULL;
+	
+	m->callback = NULL;
+	m->callback_data = NULL;
+	m->response = NULL;
+	
+	m->queue_next = NULL;
+	m->queue_prev = NULL;
+	m->queued = FALSE;
+	m->waiting = FALSE;
+	m->retries = 0;
+	
+	m->twin = NULL;
+	m->hedge = FALSE;
+	m->hedged = FALSE;
+	m->done = FALSE;
+	m->started = 0;
+	m->deadline = 0;
+	
+	
+	// Add it to the chain
+	
+	m->next = sdb->multi;
+	m->prev = NULL;
+	if (sdb->multi != NULL) sdb->multi->prev = m;
+	sdb->multi = m;
+	
+	return m;
+}
+
+
+/**
+ * Free a multi data structure, reusing it if possible
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the data structure to free
+ */
+void sdb_multi_free_one(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	if (m == NULL) return;
+	
+	
+	// Cleanup non-reusable parts of the data structure 
+	
+	if (m->queued) sdb_multi_dequeue(sdb, m);
+	
+	if (m->waiting) {
+		sdb_multi_list_remove(&sdb->retry_head, &sdb->retry_tail, m);
+		m->waiting = FALSE;
+	}
+	
+	m->next = NULL;
+	m->prev = NULL;
+	m->rec.size = 0;
+	
+	sdb_buffer_trim(&m->post);
+	
+	sdb_params_free(m->params);
+	m->params = NULL;
+	m->command[0] = '\0';
+	
+	if (m->response != NULL) sdb_free(&m->response);
+	
+	curl_multi_remove_handle(sdb->curl_multi, m->curl);
+	if (m->curl != NULL) curl_easy_setopt(m->curl, CURLOPT_PRIVATE, NULL);
+	
+	
+	// Destroy the handle if we have too many of them
+	
+	if (sdb->multi_free_size >= SDB_MAX_MULTI_FREE) {
+		if (m->curl != NULL) curl_easy_cleanup(m->curl);
+		if (m->post.buffer != NULL) free(m->post.buffer);
+		if (m->rec.buffer != NULL) free(m->rec.buffer);
+		free(m);
+		return;
+	}
+	
+	
+	// Otherwise add it to the free list
+	
+	m->next = sdb->multi_free;
+	sdb->multi_free = m;
+	sdb->multi_free_size++;
+} 
+
+
+/**
+ * Free a chain of multi data structure, reusing it if possible
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the first data structure of the chain
+ */
+void sdb_multi_free_chain(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	struct sdb_multi_data* next;
+	
+	for ( ; m != NULL; m = next) {
+		next = m->next;
+		sdb_multi_free_one(sdb, m);
+	}
+} 
+
+
+/**
+ * Destroy a chain of multi data structures
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the first data structure in the chain
+ */
+void sdb_multi_destroy(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	struct sdb_multi_data* next;
+	
+	for ( ; m != NULL; m = next) {
+		next = m->next;
+		
+		curl_multi_remove_handle(sdb->curl_multi, m->curl);
+		
+		sdb_params_free(m->params);
+		
+		if (m->curl != NULL) curl_easy_cleanup(m->curl);
+		if (m->post.buffer != NULL) free(m->post.buffer);
+		if (m->rec.buffer != NULL) free(m->rec.buffer);
+		
+		free(m);
+	}
+} 
+
+
+/**
+ * Remove a multi data structure from the chain of deferred calls
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the data structure to remove
+ */
+void sdb_multi_unlink(struct SDB* sdb, struct sdb_multi_data* m)
+{
+	if (m->prev != NULL) m->prev->next = m->next; else sdb->multi = m->next;
+	if (m->next != NULL) m->next->prev = m->prev;
+	
+	m->next = NULL;
+	m->prev = NULL;
+}
+
+
+/**
+ * Find the multi data structure based on the Curl handle
+ * 
+ * @param curl the Curl handle
+ * @return the data structure, or NULL if the handle does not belong to a deferred call
+ */
+struct sdb_multi_data* sdb_multi_find(CURL* curl)
+{
+	struct sdb_multi_data* m = NULL;
+	
+	
+	// The structure is attached to its handle in sdb_multi_alloc() and detached in sdb_multi_free_one()
+	
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &m);
+	
+	return m;
+}
+
+
+/**
+ * Create the response of a deferred call that failed before it got a response
+ * 
+ * @param handle the handle of the deferred call
+ * @param r the error code
+ * @return the response
+ */
+struct sdb_response* sdb_multi_error_response(sdb_multi handle, int r)
+{
+	struct sdb_response* response = (struct sdb_response*) malloc(sizeof(struct sdb_response));
+	memset(response, 0, sizeof(struct sdb_response));
+	
+	response->error = r;
+	response->return_code = r;
+	response->multi_handle = handle;
+	
+	return response;
+}
+
+
+/**
+ * Estimate the size of an item in the URL-encoded batch request
+ * 
+ * @param item the item
+ * @param replace whether the attributes would be replaced
+ * @return the size in bytes
+ */
+static size_t sdb_batch_item_size(const struct sdb_item* item, int replace)
+{
+	size_t size = SDB_BATCH_KEY_SIZE + sdb_escape_length(item->name, strlen(item->name));
+	int i;
+	
+	for (i = 0; i < item->size; i++) {
+		size += (replace ? 3 : 2) * SDB_BATCH_KEY_SIZE;
+		size += sdb_escape_length(item->attributes[i].name, strlen(item->attributes[i].name));
+		size += sdb_escape_length(item->attributes[i].value, strlen(item->attributes[i].value));
+	}
+	
+	return size;
+}
+
+
+/**
+ * Split a batch into chunks that comply with the SimpleDB limits (at most
+ * SDB_MAX_BATCH_ITEMS items and SDB_MAX_BATCH_SIZE bytes per request). An item
+ * with more than SDB_MAX_BATCH_ATTRIBUTES attributes gets a chunk of its own.
+ * 
+ * @param num the number of items
+ * @param items the items
+ * @param replace whether the attributes would be replaced
+ * @param starts the output array of the indices of the first items of the chunks (must have room for num + 1 elements)
+ * @return the number of chunks (starts[number of chunks] will be set to num)
+ */
+size_t sdb_batch_split(size_t num, const struct sdb_item* items, int replace, size_t* starts)
+{
+	size_t i, n = 0, count = 0, size = 0;
+	int isolated = FALSE;
+	
+	for (i = 0; i < num; i++) {
+		size_t s = sdb_batch_item_size(&items[i], replace);
+		int oversized = items[i].size > SDB_MAX_BATCH_ATTRIBUTES;
+		
+		if (count == 0 || count >= SDB_MAX_BATCH_ITEMS || size + s > SDB_MAX_BATCH_SIZE || oversized || isolated) {
+			starts[n++] = i;
+			count = 0;
+			size = 0;
+		}
+		
+		count++;
+		size += s;
+		isolated = oversized;
+	}
+	
+	starts[n] = num;
+	return n;
+}
+
+
+/**
+ * Remove the deferred calls that were added after the given one
+ * 
+ * @param sdb the SimpleDB handle
+ * @param head the deferred call at the head of the chain before the calls to remove were added
+ */
+static void sdb_multi_unwind(struct SDB* sdb, struct sdb_multi_data* head)
+{
+	while (sdb->multi != NULL && sdb->multi != head) {
+		struct sdb_multi_data* m = sdb->multi;
+		sdb_multi_unlink(sdb, m);
+		sdb->stat.num_commands--;
+		sdb_multi_free_one(sdb, m);
+	}
+}
+
+
+/**
+ * Put or replace the attributes of a batch of items, splitting it into several
+ * requests if it does not fit the SimpleDB limits
+ * 
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @param replace whether the attributes are replaced
+ * @param f the function that executes a single request
+ * @param mf the function that defers a single request
+ * @return SDB_OK if no errors occurred, SDB_E_PARTIAL_BATCH if only some
+ *         of the requests failed, or the error of the first failed request
+ */
+int sdb_batch_execute(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items, int replace,
+					  sdb_batch_function f, sdb_multi_batch_function mf)
+{
+	size_t c, n, applied = 0;
+	int r = SDB_OK;
+	
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	
+	
+	// Split the batch, and send it as is if it fits in a single request
+	
+	size_t* starts = (size_t*) malloc(sizeof(size_t) * (num + 1));
+	n = sdb_batch_split(num, items, replace, starts);
+	if (n <= 1) {
+		free(starts);
+		return f(sdb, domain, num, items);
+	}
+	
+	
+	// Send the requests in parallel, unless there are other deferred calls,
+	// which sdb_multi_run() would complete as well
+	
+	if (sdb->multi == NULL) {
+		
+		// The requests are internal, so they do not go to the completion callback
+		// (which would also leave sdb_multi_run() without their responses)
+		
+		sdb_multi_callback callback = sdb->multi_callback;
+		void* callback_data = sdb->multi_callback_data;
+		sdb->multi_callback = NULL;
+		sdb->multi_callback_data = NULL;
+		
+		for (c = 0; c < n; c++) {
+			if (mf(sdb, domain, starts[c + 1] - starts[c], items + starts[c]) == SDB_MULTI_ERROR) break;
+		}
+		
+		sdb->multi_callback = callback;
+		sdb->multi_callback_data = callback_data;
+		
+		if (c == n) {
+			free(starts);
+			
+			struct sdb_multi_response* response;
+			if (SDB_FAILED(r = sdb_multi_run(sdb, &response))) {
+				sdb_multi_free(&response);
+				return r;
+			}
+			
+			if (response == NULL) return SDB_E_INTERNAL_ERROR;
+			
+			int i;
+			for (i = 0; i < response->size; i++) {
+				
+				// A missing response means that the service remained unavailable
+				
+				struct sdb_response* x = response->responses[i];
+				int e = x == NULL ? SDB_E_RETRY_FAILED : x->return_code;
+				if (SDB_FAILED(e)) {
+					if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Error %d in one of the %u requests of a batch\n", e, (unsigned) n);
+					if (r == SDB_OK) r = e;
+				}
+				else {
+					applied++;
+				}
+			}
+			
+			sdb_multi_free(&response);
+			return SDB_FAILED(r) && applied > 0 ? SDB_E_PARTIAL_BATCH : r;
+		}
+		
+		
+		// If a request could not be deferred, fall back to sending them one by one
+		
+		sdb_multi_unwind(sdb, NULL);
+	}
+	
+	for (c = 0; c < n; c++) {
+		int e = f(sdb, domain, starts[c + 1] - starts[c], items + starts[c]);
+		if (SDB_FAILED(e)) {
+			if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Error %d in request %u of %u of a batch (items %u - %u)\n",
+											 e, (unsigned) c + 1, (unsigned) n, (unsigned) starts[c], (unsigned) starts[c + 1] - 1);
+			if (r == SDB_OK) r = e;
+		}
+		else {
+			applied++;
+		}
+	}
+	
+	free(starts);
+	return SDB_FAILED(r) && applied > 0 ? SDB_E_PARTIAL_BATCH : r;
+}
+
+
+/**
+ * The parts of the split batch that this thread is submitting to the
+ * background I/O thread (newest first), which are submitted together
+ */
+static __thread int sdb_io_staging = FALSE;
+static __thread struct sdb_io_request* sdb_io_staged = NULL;
+static __thread struct sdb_io_request* sdb_io_leader = NULL;
+
+
+/**
+ * Push a chain of requests to the lock-free submission stack of the
+ * background I/O thread, and wake it up if the stack was empty
+ * 
+ * @param sdb the SimpleDB handle
+ * @param first the newest request of the chain
+ * @param last the oldest request of the chain
+ */
+static void sdb_io_push(struct SDB* sdb, struct sdb_io_request* first, struct sdb_io_request* last)
+{
+	struct sdb_io_request* head;
+	
+	do {
+		head = __atomic_load_n(&sdb->io_queue, __ATOMIC_RELAXED);
+		last->next = head;
+	}
+	while (!__sync_bool_compare_and_swap(&sdb->io_queue, head, first));
+	
+	
+	// Otherwise the thread has not taken the previous requests yet, and it was woken up for them
+	
+	if (head == NULL) {
+		char c = 0;
+		ssize_t w = write(sdb->io_wake[1], &c, 1);
+		(void) w;
+	}
+}
+
+
+/**
+ * Pass a multi call to the background I/O thread. The parts of a split
+ * batch are held back until sdb_io_batch_end().
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters (a copy of which is made)
+ * @param next_token the next token (optional, a copy of which is made)
+ * @param prepared the prepared statement that the parameters bind (optional, it is kept until the call starts)
+ * @return the handle of the call, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_io_submit(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_prepared* prepared)
+{
+	struct sdb_io_request* q = (struct sdb_io_request*) malloc(sizeof(struct sdb_io_request));
+	if (q == NULL) return SDB_MULTI_ERROR;
+	
+	q->params = sdb_params_retain(params);
+	if (q->params == NULL) {
+		free(q);
+		return SDB_MULTI_ERROR;
+	}
+	
+	strncpy(q->command, cmd, SDB_LEN_COMMAND - 1);
+	q->command[SDB_LEN_COMMAND - 1] = '\0';
+	q->next_token = next_token == NULL ? NULL : strdup(next_token);
+	q->prepared = prepared;
+	q->m = NULL;
+	
+	if (prepared != NULL) __atomic_add_fetch(&prepared->ref_count, 1, __ATOMIC_RELAXED);
+	
+	
+	// The deadline starts with the submission, as there is no sdb_multi_run()
+	
+	q->deadline = sdb->call_timeout > 0 ? monotonic_ms() + sdb->call_timeout : 0;
+	
+	q->callback = sdb->multi_callback;
+	q->callback_data = sdb->multi_callback_data;
+	
+	q->group = NULL;
+	q->pending = 1;
+	q->done = FALSE;
+	q->response = NULL;
+	
+	
+	// Hold back a part of a split batch, which completes together with the first part
+	
+	if (sdb_io_staging) {
+		if (sdb_io_leader == NULL) {
+			sdb_io_leader = q;
+		}
+		else {
+			q->group = sdb_io_leader;
+			sdb_io_leader->pending++;
+		}
+		
+		q->next = sdb_io_staged;
+		sdb_io_staged = q;
+		return q;
+	}
+	
+	sdb_io_push(sdb, q, q);
+	return q;
+}
+
+
+/**
+ * Start holding back the requests that this thread submits to the
+ * background I/O thread, because they are the parts of a split batch
+ */
+static void sdb_io_batch_begin(void)
+{
+	sdb_io_staging = TRUE;
+	sdb_io_staged = NULL;
+	sdb_io_leader = NULL;
+}
+
+
+/**
+ * Submit the held back parts of a split batch to the background I/O
+ * thread all at once, or discard them
+ * 
+ * @param sdb the SimpleDB handle
+ * @param submit whether to submit the requests (FALSE = discard them)
+ */
+static void sdb_io_batch_end(struct SDB* sdb, int submit)
+{
+	struct sdb_io_request* q;
+	struct sdb_io_request* next;
+	
+	sdb_io_staging = FALSE;
+	
+	if (sdb_io_staged != NULL) {
+		if (submit) {
+			sdb_io_push(sdb, sdb_io_staged, sdb_io_leader);
+		}
+		else {
+			for (q = sdb_io_staged; q != NULL; q = next) {
+				next = q->next;
+				sdb_params_free(q->params);
+				if (q->next_token != NULL) free(q->next_token);
+				sdb_prepared_destroy(q->prepared);
+				free(q);
+			}
+		}
+	}
+	
+	sdb_io_staged = NULL;
+	sdb_io_leader = NULL;
+}
+
+
+/**
+ * Defer putting or replacing the attributes of a batch of items, splitting it into
+ * several requests if it does not fit the SimpleDB limits
+ * 
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @param replace whether the attributes are replaced
+ * @param mf the function that defers a single request
+ * @return the handle shared by the responses of all requests, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_batch_execute(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items, int replace,
+								  sdb_multi_batch_function mf)
+{
+	size_t c, n;
+	
+	
+	// Split the batch, and defer it as is if it fits in a single request
+	
+	size_t* starts = (size_t*) malloc(sizeof(size_t) * (num + 1));
+	n = sdb_batch_split(num, items, replace, starts);
+	if (n <= 1) {
+		free(starts);
+		return mf(sdb, domain, num, items);
+	}
+	
+	
+	// With the background I/O thread, submit all requests together, so that they are reported under the handle of the first one
+	
+	if (sdb->io_running) {
+		sdb_multi first = SDB_MULTI_ERROR;
+		sdb_io_batch_begin();
+		
+		for (c = 0; c < n; c++) {
+			sdb_multi h = mf(sdb, domain, starts[c + 1] - starts[c], items + starts[c]);
+			if (h == SDB_MULTI_ERROR) break;
+			if (c == 0) first = h;
+		}
+		
+		sdb_io_batch_end(sdb, c == n);
+		free(starts);
+		return c == n ? first : SDB_MULTI_ERROR;
+	}
+	
+	
+	// Defer all requests, reporting their responses under the handle of the first one
+	
+	struct sdb_multi_data* head = sdb->multi;
+	sdb_multi group = SDB_MULTI_ERROR;
+	
+	for (c = 0; c < n; c++) {
+		sdb_multi h = mf(sdb, domain, starts[c + 1] - starts[c], items + starts[c]);
+		if (h == SDB_MULTI_ERROR) {
+			sdb_multi_unwind(sdb, head);
+			group = SDB_MULTI_ERROR;
+			break;
+		}
+		
+		if (c == 0) group = h;
+		sdb->multi->group = group;
+	}
+	
+	free(starts);
+	return group;
+}
+
+
+/**
+ * Create a formatted UTC timestamp
+ * 
+ * @param buffer the buffer to which to write the timestamp (must be at least 32 bytes long)
+ * @param t the time
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_timestamp(char* buffer, time_t t)
+{
+	// Convert the time
+	
+	struct tm* ptm = gmtime(&t);
+	
+	
+	// Format
+	 
+	sprintf(buffer, "%04d-%02d-%02dT%02d:%02d:%02d.000Z", ptm->tm_year + 1900, ptm->tm_mon + 1,
+					ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Get the pre-encoded Timestamp parameter (formatted at most once per second)
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the fragment
+ */
+const struct sdb_fragment* sdb_timestamp_fragment(struct SDB* sdb)
+{
+	time_t now = time(NULL);
+	if (now == sdb->timestamp_time) return &sdb->timestamp_fragment;
+	
+	char timestamp[32];
+	sdb_timestamp(timestamp, now);
+	
+	memcpy(sdb->timestamp_text, "Timestamp=", 10);
+	size_t l = 10 + sdb_escape_to(sdb->timestamp_text + 10, timestamp, strlen(timestamp));
+	
+	sdb->timestamp_fragment.key = "Timestamp";
+	sdb->timestamp_fragment.text = sdb->timestamp_text;
+	sdb->timestamp_fragment.length = l;
+	sdb->timestamp_time = now;
+	
+	return &sdb->timestamp_fragment;
+}
+
+
+/**
+ * Pre-encode the constant parameters of the handle
+ * 
+ * @param sdb the SimpleDB handle (with the key and the signature version already set)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_template_init(struct SDB* sdb)
+{
+	// AWSAccessKeyId
+	
+	size_t l = 15 + sdb_escape_length(sdb->sdb_key, sdb->sdb_key_len);
+	char* text = (char*) malloc(l + 1);
+	if (text == NULL) return SDB_E_URL_ENCODE_FAILED;
+	
+	memcpy(text, "AWSAccessKeyId=", 15);
+	sdb_escape_to(text + 15, sdb->sdb_key, sdb->sdb_key_len);
+	
+	sdb->key_fragment.key = "AWSAccessKeyId";
+	sdb->key_fragment.text = text;
+	sdb->key_fragment.length = l;
+	
+	
+	// SignatureMethod and SignatureVersion
+	
+	sdb->signature_method_fragment.key = "SignatureMethod";
+	sdb->signature_method_fragment.text = "SignatureMethod=HmacSHA256";
+	sdb->signature_method_fragment.length = strlen(sdb->signature_method_fragment.text);
+	
+	snprintf(sdb->signature_version_text, sizeof(sdb->signature_version_text), "SignatureVersion=%s", sdb->sdb_signature_ver_str);
+	sdb->signature_version_fragment.key = "SignatureVersion";
+	sdb->signature_version_fragment.text = sdb->signature_version_text;
+	sdb->signature_version_fragment.length = strlen(sdb->signature_version_text);
+	
+	
+	// The per-action and the time-dependent parameters are encoded on demand
+	
+	sdb->num_actions = 0;
+	sdb->timestamp_time = (time_t) -1;
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Free the pre-encoded parameters of the handle
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_template_cleanup(struct SDB* sdb)
+{
+	free((char*) sdb->key_fragment.text);
+	sdb->key_fragment.text = NULL;
+	sdb->num_actions = 0;
+}
+
+
+/**
+ * Get the pre-encoded parameters of an action, encoding them on the first use
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @return the action
+ */
+const struct sdb_action* sdb_action_get(struct SDB* sdb, const char* cmd)
+{
+	int i;
+	for (i = 0; i < sdb->num_actions; i++) {
+		if (strcmp(sdb->actions[i].name, cmd) == 0) return &sdb->actions[i];
+	}
+	
+	
+	// Add a new action (or replace the last one if the cache is full)
+	
+	if (sdb->num_actions < SDB_MAX_ACTIONS) sdb->num_actions++;
+	struct sdb_action* a = &sdb->actions[sdb->num_actions - 1];
+	
+	strncpy(a->name, cmd, SDB_LEN_COMMAND - 1);
+	a->name[SDB_LEN_COMMAND - 1] = '\0';
+	
+	size_t l = strlen(a->name);
+	memcpy(a->text, "Action=", 7);
+	memcpy(a->text + 7, a->name, l + 1);
+	
+	a->action.key = "Action";
+	a->action.text = a->text;
+	a->action.length = 7 + l;
+	
+	
+	// Version 2007-11-07 deprecated Aug 24, 2010 
+	
+	a->version.key = "Version";
+	if (strcmp(a->name, "Query") == 0 || strcmp(a->name, "QueryWithAttributes") == 0) {
+		a->version.text = "Version=2007-11-07";
+	}
+	else {
+		a->version.text = "Version=2009-04-15";
+	}
+	a->version.length = strlen(a->version.text);
+	
+	return a;
+}
+
+
+/**
+ * Create the keyed HMAC context for signing requests
+ * 
+ * @param sdb the SimpleDB handle (with the secret key already set)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_sign_init(struct SDB* sdb)
+{
+	// The ipad/opad key blocks are derived here once, and every call to
+	// sdb_sign() then just resets the context back to this keyed state
+	
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	
+	EVP_MAC* mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (mac == NULL) return SDB_E_OPEN_SSL_FAILED;
+	
+	sdb->sdb_hmac = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac);
+	if (sdb->sdb_hmac == NULL) return SDB_E_OPEN_SSL_FAILED;
+	
+	OSSL_PARAM params[2];
+	params[0] = OSSL_PARAM_construct_utf8_string("digest", "SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	
+	if (!EVP_MAC_init(sdb->sdb_hmac, (const unsigned char*) sdb->sdb_secret, sdb->sdb_secret_len, params)) {
+		return SDB_E_OPEN_SSL_FAILED;
+	}
+	
+#else
+	
+	sdb->sdb_hmac = HMAC_CTX_new();
+	if (sdb->sdb_hmac == NULL) return SDB_E_OPEN_SSL_FAILED;
+	
+	if (!HMAC_Init_ex(sdb->sdb_hmac, sdb->sdb_secret, sdb->sdb_secret_len, EVP_sha256(), NULL)) {
+		return SDB_E_OPEN_SSL_FAILED;
+	}
+	
+#endif
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Destroy the keyed HMAC context
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_sign_cleanup(struct SDB* sdb)
+{
+	if (sdb->sdb_hmac == NULL) return;
+	
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX_free(sdb->sdb_hmac);
+#else
+	HMAC_CTX_free(sdb->sdb_hmac);
+#endif
+	
+	sdb->sdb_hmac = NULL;
+}
+
+
+/**
+ * Sign the URL-encoded parameters string (prefixed by the method, host and path)
+ * 
+ * @param sdb the SimpleDB handle
+ * @param str the string to sign
+ * @param length the length of the string
+ * @param buffer the buffer to write the signature to (must be at least EVP_MAX_MD_SIZE * 2 bytes)
+ * @param plen the pointer to the place to store the length of the signature (can be NULL)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_sign(struct SDB* sdb, const char* str, size_t length, char* buffer, size_t* plen)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	
+	size_t mdl;
+	
+	if (!EVP_MAC_init(sdb->sdb_hmac, NULL, 0, NULL)) return SDB_E_OPEN_SSL_FAILED;
+	if (!EVP_MAC_update(sdb->sdb_hmac, (const unsigned char*) sdb->sign_prefix, sdb->sign_prefix_len)) return SDB_E_OPEN_SSL_FAILED;
+	if (!EVP_MAC_update(sdb->sdb_hmac, (const unsigned char*) str, length)) return SDB_E_OPEN_SSL_FAILED;
+	if (!EVP_MAC_final(sdb->sdb_hmac, md, &mdl, sizeof(md))) return SDB_E_OPEN_SSL_FAILED;
+	
+#else
+	
+	unsigned mdl;
+	
+	if (!HMAC_Init_ex(sdb->sdb_hmac, NULL, 0, NULL, NULL)) return SDB_E_OPEN_SSL_FAILED;
+	if (!HMAC_Update(sdb->sdb_hmac, (const unsigned char*) sdb->sign_prefix, sdb->sign_prefix_len)) return SDB_E_OPEN_SSL_FAILED;
+	if (!HMAC_Update(sdb->sdb_hmac, (const unsigned char*) str, length)) return SDB_E_OPEN_SSL_FAILED;
+	if (!HMAC_Final(sdb->sdb_hmac, md, &mdl)) return SDB_E_OPEN_SSL_FAILED;
+	
+#endif
+	 
+	size_t l = base64(md, mdl, buffer, EVP_MAX_MD_SIZE * 2);
+	
+	if (l == 0) return SDB_E_OPEN_SSL_FAILED;
+	if (plen != NULL) *plen = l;
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Allocate an array for storing SimpleDB parameters
+ * 
+ * @param capacity the estimated capacity
+ * @return the array
+ */ 
+struct sdb_params* sdb_params_alloc(size_t capacity)
+{
+	// Allocate the array, the pairs and the first chunk of the key arena
+	// all at once, so that a typical request needs just one malloc
+	
+	size_t pairs = (capacity + 8) * sizeof(struct sdb_pair);
+	size_t arena = (capacity + 8) * SDB_PARAMS_KEY_SPACE;
+	
+	struct sdb_params* p = (struct sdb_params*) malloc(sizeof(struct sdb_params) + pairs
+													   + sizeof(struct sdb_params_chunk) + arena);
+	if (p == NULL) return NULL;
+	
+	p->size = 0;
+	p->capacity = capacity;
+	p->params = (struct sdb_pair*) (p + 1);
+	p->ref_count = 0;
+	p->base = NULL;
+	
+	p->strings = (struct sdb_params_chunk*) (((char*) p->params) + pairs);
+	p->strings->next = NULL;
+	p->strings->size = 0;
+	p->strings->capacity = arena;
+	
+	return p;
+}
+
+
+/**
+ * Free a parameters array (or release a reference to a shared array, which
+ * the background I/O thread may release, too)
+ * 
+ * @param params the arrays to free
+ */
+void sdb_params_free(struct sdb_params* params)
+{
+	if (params == NULL) return;
+	
+	if (__atomic_load_n(&params->ref_count, __ATOMIC_RELAXED) > 0) {
+		if (__atomic_sub_fetch(&params->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+			sdb_params_free(params->base);
+			free(params);
+		}
+		return;
+	}
+	
+	
+	// Free the arena chunks except for the first one, which is a part of
+	// the same memory block as the array
+	
+	struct sdb_params_chunk* c;
+	struct sdb_params_chunk* next;
+	
+	for (c = params->strings; c != NULL; c = next) {
+		next = c->next;
+		if (next != NULL) free(c);
+	}
+	
+	free(params);
+}
+
+
+/**
+ * Copy a string to the arena of a parameter array
+ * 
+ * @param params the parameter array
+ * @param str the string
+ * @return the copy, or NULL on error
+ */
+static char* sdb_params_strdup(struct sdb_params* params, const char* str)
+{
+	size_t l = strlen(str) + 1;
+	struct sdb_params_chunk* c = params->strings;
+	
+	if (c->size + l > c->capacity) {
+		size_t capacity = 2 * c->capacity;
+		if (capacity < l) capacity = l;
+		
+		c = (struct sdb_params_chunk*) malloc(sizeof(struct sdb_params_chunk) + capacity);
+		if (c == NULL) return NULL;
+		
+		c->next = params->strings;
+		c->size = 0;
+		c->capacity = capacity;
+		params->strings = c;
+	}
+	
+	char* s = c->data + c->size;
+	memcpy(s, str, l);
+	c->size += l;
+	
+	return s;
+}
+
+
+/**
+ * Add a parameter. The key is copied to the arena of the array, but the value
+ * is borrowed, so it must stay valid for as long as the array is used.
+ * 
+ * @param params the parameter array
+ * @param key the key
+ * @param value the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_add(struct sdb_params* params, const char* key, const char* value)
+{
+	if (params->capacity <= params->size) return SDB_E_CAPACITY_TOO_SMALL;
+	
+	const char* k = sdb_params_strdup(params, key);
+	if (k == NULL) return SDB_E_CAPACITY_TOO_SMALL;
+	
+	params->params[params->size].key = k;
+	params->params[params->size].value = value;
+	
+	params->size++;
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Add elements from another parameter array without making a copy of the inputs
+ * 
+ * @param params the parameter array
+ * @param other the other parameter array
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_add_all(struct sdb_params* params, struct sdb_params* other)
+{
+	if (params->capacity < params->size + other->size) return SDB_E_CAPACITY_TOO_SMALL;
+	
+	memcpy(params->params + params->size, other->params, other->size * sizeof(struct sdb_pair));
+	params->size += other->size;
+	
+	return SDB_OK;
+}
+
+
+/**
+ * String comparison wrapper
+ * 
+ * @param a the first value
+ * @param b the second value
+ * @return the comparison return code
+ */
+int str_compare(const void* a, const void* b)
+{	
+	struct sdb_pair *pa, *pb;
+	
+	pa = (struct sdb_pair*)a;
+	pb = (struct sdb_pair*)b;
+	
+	return strcmp(pa->key, pb->key);
+}
+
+
+/**
+ * Sort the parameters by the keys. If all but a few parameters (at most
+ * SDB_MAX_PARAMS_MERGE) already form a sorted run, such as the keys generated
+ * by the batch commands, the remaining ones are merged in linear time.
+ * 
+ * @param params the parameter array
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_sort(struct sdb_params* params)
+{
+	struct sdb_pair* p = params->params;
+	size_t i, n = params->size;
+	
+	if (n < 2) return SDB_OK;
+	
+	
+	// Find the longest sorted run
+	
+	size_t run_start = 0, run_length = 1, start = 0;
+	for (i = 1; i <= n; i++) {
+		if (i == n || strcmp(p[i - 1].key, p[i].key) > 0) {
+			if (i - start > run_length) {
+				run_start = start;
+				run_length = i - start;
+			}
+			start = i;
+		}
+	}
+	
+	if (run_length == n) return SDB_OK;
+	
+	if (n - run_length > SDB_MAX_PARAMS_MERGE) {
+		qsort(p, n, sizeof(struct sdb_pair), str_compare);
+		return SDB_OK;
+	}
+	
+	
+	// Set aside and sort the few remaining parameters
+	
+	struct sdb_pair rest[SDB_MAX_PARAMS_MERGE];
+	size_t k = 0;
+	
+	for (i = 0; i < run_start; i++) rest[k++] = p[i];
+	for (i = run_start + run_length; i < n; i++) rest[k++] = p[i];
+	
+	for (i = 1; i < k; i++) {
+		struct sdb_pair x = rest[i];
+		size_t j = i;
+		for ( ; j > 0 && strcmp(rest[j - 1].key, x.key) > 0; j--) rest[j] = rest[j - 1];
+		rest[j] = x;
+	}
+	
+	
+	// Merge them with the run from the back
+	
+	if (run_start > 0) memmove(p, p + run_start, run_length * sizeof(struct sdb_pair));
+	
+	size_t a = run_length, b = k, w = n;
+	while (b > 0) {
+		if (a > 0 && strcmp(p[a - 1].key, rest[b - 1].key) > 0) {
+			p[--w] = p[--a];
+		}
+		else {
+			p[--w] = rest[--b];
+		}
+	}
+	
+	return SDB_OK;
+}
+
+/**
+ * Characters that SimpleDB does not want URL-encoded (RFC 3986 unreserved)
+ */
+static const unsigned char sdb_unreserved[256] = {
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+	['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1,
+	['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1,
+	['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1,
+	['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1,
+	['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1,
+	['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1,
+	['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1,
+	['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1,
+	['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+	['~'] = 1, ['_'] = 1, ['-'] = 1, ['.'] = 1
+};
+
+static const char sdb_hex[] = "0123456789ABCDEF";
+
+
+/**
+ * Compute the length of a string after URL-encoding (the reference implementation)
+ * 
+ * @param s the string to escape
+ * @param length the length of the string
+ * @return the length of the escaped string (without the terminating '\0')
+ */
+static size_t sdb_escape_length_scalar(const unsigned char* s, size_t length)
+{
+	size_t i, l = length;
+	
+	for (i = 0; i < length; i++) {
+		if (!sdb_unreserved[s[i]]) l += 2;
+	}
+	
+	return l;
+}
+
+
+/**
+ * URL-encode a string into a buffer (the reference implementation)
+ * 
+ * @param buffer the output buffer (must have room for sdb_escape_length() + 1 bytes)
+ * @param s the string to escape
+ * @param length the length of the string
+ * @return the number of bytes written (without the terminating '\0')
+ */
+static size_t sdb_escape_to_scalar(char* buffer, const unsigned char* s, size_t length)
+{
+	char* b = buffer;
+	size_t i;
+	
+	for (i = 0; i < length; i++) {
+		unsigned char in = s[i];
+		
+		if (sdb_unreserved[in]) {
+			*(b++) = in;
+		}
+		else {
+			*(b++) = '%';
+			*(b++) = sdb_hex[in >> 4];
+			*(b++) = sdb_hex[in & 0x0f];
+		}
+	}
+	
+	*b = '\0';
+	return b - buffer;
+}
+
+
+#ifdef SDB_HAVE_X86_SIMD
+
+/*
+ * The vectorized kernels classify 16 (SSE2) or 32 (AVX2) bytes at a time and
+ * copy runs of unreserved characters in bulk. A byte c is in the range
+ * [lo, hi] iff min(c - lo, hi - lo) == c - lo, using unsigned 8-bit arithmetic.
+ * 
+ * The kernels may store a whole vector even if only a part of it is valid.
+ * This is safe, because the remaining output space is always at least as
+ * large as the remaining input.
+ */
+
+#define SDB_IN_RANGE_SSE2(c, lo, hi) \
+	_mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8((c), _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+				   _mm_sub_epi8((c), _mm_set1_epi8(lo)))
+
+#define SDB_IN_RANGE_AVX2(c, lo, hi) \
+	_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8((c), _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), \
+					  _mm256_sub_epi8((c), _mm256_set1_epi8(lo)))
+
+
+/**
+ * Classify 16 bytes (SSE2)
+ * 
+ * @param c the input vector
+ * @return the bit mask of unreserved characters
+ */
+__attribute__((target("sse2")))
+static inline unsigned sdb_unreserved_mask_sse2(__m128i c)
+{
+	__m128i m = SDB_IN_RANGE_SSE2(c, '0', '9');
+	m = _mm_or_si128(m, SDB_IN_RANGE_SSE2(c, 'A', 'Z'));
+	m = _mm_or_si128(m, SDB_IN_RANGE_SSE2(c, 'a', 'z'));
+	m = _mm_or_si128(m, SDB_IN_RANGE_SSE2(c, '-', '.'));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('~')));
+	return (unsigned) _mm_movemask_epi8(m);
+}
+
+
+/**
+ * Classify 32 bytes (AVX2)
+ * 
+ * @param c the input vector
+ * @return the bit mask of unreserved characters
+ */
+__attribute__((target("avx2")))
+static inline unsigned sdb_unreserved_mask_avx2(__m256i c)
+{
+	__m256i m = SDB_IN_RANGE_AVX2(c, '0', '9');
+	m = _mm256_or_si256(m, SDB_IN_RANGE_AVX2(c, 'A', 'Z'));
+	m = _mm256_or_si256(m, SDB_IN_RANGE_AVX2(c, 'a', 'z'));
+	m = _mm256_or_si256(m, SDB_IN_RANGE_AVX2(c, '-', '.'));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(c, _mm256_set1_epi8('~')));
+	return (unsigned) _mm256_movemask_epi8(m);
+}
+
+
+/**
+ * Compute the length of a string after URL-encoding (SSE2)
+ */
+__attribute__((target("sse2")))
+static size_t sdb_escape_length_sse2(const unsigned char* s, size_t length)
+{
+	size_t i, l = length;
+	
+	for (i = 0; i + 16 <= length; i += 16) {
+		unsigned m = sdb_unreserved_mask_sse2(_mm_loadu_si128((const __m128i*) (s + i)));
+		l += 2 * __builtin_popcount(~m & 0xffff);
+	}
+	
+	return l + sdb_escape_length_scalar(s + i, length - i) - (length - i);
+}
+
+
+/**
+ * URL-encode a string into a buffer (SSE2)
+ */
+__attribute__((target("sse2")))
+static size_t sdb_escape_to_sse2(char* buffer, const unsigned char* s, size_t length)
+{
+	char* b = buffer;
+	size_t i = 0;
+	
+	while (i + 16 <= length) {
+		__m128i c = _mm_loadu_si128((const __m128i*) (s + i));
+		unsigned m = sdb_unreserved_mask_sse2(c);
+		_mm_storeu_si128((__m128i*) b, c);
+		
+		if (m == 0xffff) {
+			b += 16; i += 16;
+			continue;
+		}
+		
+		unsigned run = __builtin_ctz(~m);
+		b += run; i += run;
+		
+		unsigned char in = s[i++];
+		*(b++) = '%';
+		*(b++) = sdb_hex[in >> 4];
+		*(b++) = sdb_hex[in & 0x0f];
+	}
+	
+	b += sdb_escape_to_scalar(b, s + i, length - i);
+	return b - buffer;
+}
+
+
+/**
+ * Compute the length of a string after URL-encoding (AVX2)
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t sdb_escape_length_avx2(const unsigned char* s, size_t length)
+{
+	size_t i, l = length;
+	
+	for (i = 0; i + 32 <= length; i += 32) {
+		unsigned m = sdb_unreserved_mask_avx2(_mm256_loadu_si256((const __m256i*) (s + i)));
+		l += 2 * __builtin_popcount(~m);
+	}
+	
+	return l + sdb_escape_length_sse2(s + i, length - i) - (length - i);
+}
+
+
+/**
+ * URL-encode a string into a buffer (AVX2)
+ */
+__attribute__((target("avx2")))
+static size_t sdb_escape_to_avx2(char* buffer, const unsigned char* s, size_t length)
+{
+	char* b = buffer;
+	size_t i = 0;
+	
+	while (i + 32 <= length) {
+		__m256i c = _mm256_loadu_si256((const __m256i*) (s + i));
+		unsigned m = sdb_unreserved_mask_avx2(c);
+		_mm256_storeu_si256((__m256i*) b, c);
+		
+		if (m == 0xffffffffu) {
+			b += 32; i += 32;
+			continue;
+		}
+		
+		unsigned run = __builtin_ctz(~m);
+		b += run; i += run;
+		
+		unsigned char in = s[i++];
+		*(b++) = '%';
+		*(b++) = sdb_hex[in >> 4];
+		*(b++) = sdb_hex[in & 0x0f];
+	}
+	
+	b += sdb_escape_to_sse2(b, s + i, length - i);
+	return b - buffer;
+}
+
+#endif /* SDB_HAVE_X86_SIMD */
+
+
+/*
+ * The URL-encoding kernels selected at run time (by sdb_global_init())
+ */
+static size_t (*sdb_escape_length_impl)(const unsigned char*, size_t) = sdb_escape_length_scalar;
+static size_t (*sdb_escape_to_impl)(char*, const unsigned char*, size_t) = sdb_escape_to_scalar;
+static pthread_once_t sdb_escape_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Select the URL-encoding kernels. Other than for SIMD_BEST, this is meant
+ * only for testing the individual kernels. This is not thread-safe, so no
+ * other thread may use the library meanwhile.
+ * 
+ * @param level the kernel level (SIMD_SCALAR, SIMD_128 or SIMD_256), or SIMD_BEST
+ * @return the selected level, or -1 if the CPU does not support it
+ */
+int sdb_escape_select(int level)
+{
+	size_t (*length_impl)(const unsigned char*, size_t) = sdb_escape_length_scalar;
+	size_t (*to_impl)(char*, const unsigned char*, size_t) = sdb_escape_to_scalar;
+	int best = SIMD_SCALAR;
+	
+#ifdef SDB_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+		best = SIMD_256;
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		best = SIMD_128;
+	}
+#endif
+	
+	if (level == SIMD_BEST) level = best;
+	if (level < SIMD_SCALAR || level > best) return -1;
+	
+#ifdef SDB_HAVE_X86_SIMD
+	if (level == SIMD_256) {
+		length_impl = sdb_escape_length_avx2;
+		to_impl = sdb_escape_to_avx2;
+	}
+	else if (level == SIMD_128) {
+		length_impl = sdb_escape_length_sse2;
+		to_impl = sdb_escape_to_sse2;
+	}
+#endif
+	
+	sdb_escape_to_impl = to_impl;
+	sdb_escape_length_impl = length_impl;
+	
+	return level;
+}
+
+
+/**
+ * Select the best URL-encoding kernels for this CPU
+ */
+static void sdb_escape_init_once(void)
+{
+	sdb_escape_select(SIMD_BEST);
+}
+
+
+/**
+ * Select the best URL-encoding kernels for this CPU, unless it was already done
+ */
+void sdb_escape_init(void)
+{
+	pthread_once(&sdb_escape_once, sdb_escape_init_once);
+}
+
+
+/**
+ * Compute the length of a string after URL-encoding
+ * 
+ * @param string the string to escape
+ * @param length the length of the string
+ * @return the length of the escaped string (without the terminating '\0')
+ */
+size_t sdb_escape_length(const char* string, size_t length)
+{
+	return sdb_escape_length_impl((const unsigned char*) string, length);
+}
+
+
+/**
+ * URL-encode a string into a buffer
+ * 
+ * @param buffer the output buffer (must have room for sdb_escape_length() + 1 bytes)
+ * @param string the string to escape
+ * @param length the length of the string
+ * @return the number of bytes written (without the terminating '\0')
+ */
+size_t sdb_escape_to(char* buffer, const char* string, size_t length)
+{
+	return sdb_escape_to_impl(buffer, (const unsigned char*) string, length);
+}
+
+
+/**
+ * Slight modification to curl_easy_escape, since it escapes a few characters
+ * that the SimpleDB API does not want escaped.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param string the string to escape
+ * @param inlength the length of the inbound character string
+ * @return the escaped string
+ */
+char *sdb_escape(struct SDB* sdb, const char *string, int inlength)
+{
+	size_t length = inlength ? (size_t) inlength : strlen(string);
+	
+	char* ns = (char*) malloc(sdb_escape_length(string, length) + 1);
+	if (ns == NULL) return NULL;
+	
+	sdb_escape_to(ns, string, length);
+	return ns;
+}
+
+/**
+ * Sign the URL-encoded parameters string and append the signature to it
+ * 
+ * @param sdb the SimpleDB handle
+ * @param out the buffer with the parameters string (with room for the escaped signature)
+ * @param end the end of the string
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_post_sign(struct SDB* sdb, struct sdb_buffer* out, char* end)
+{
+	char signature[EVP_MAX_MD_SIZE * 2];
+	size_t sl;
+	
+	SDB_SAFE(sdb_sign(sdb, out->buffer, end - out->buffer, signature, &sl));
+	
+	memcpy(end, "&Signature=", 11);
+	out->size = (end - out->buffer) + 11 + sdb_escape_to(end + 11, signature, sl);
+	
+	return SDB_OK;
+}
+
+/**
+ * Create the signed URL-encoded parameters string. The pre-encoded required
+ * parameters (Action, Timestamp, Version, etc.) are merged with the sorted
+ * command parameters.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters (will be sorted)
+ * @param next_token the next token (optional)
+ * @param out the output buffer (will be grown as needed)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_export(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_buffer* out)
+{
+	SDB_SAFE(sdb_params_sort(params));
+	
+	
+	// Collect the required parameters (in the sorted order), leaving the text
+	// of NextToken empty, so that it is escaped directly into the output
+	
+	const struct sdb_action* action = sdb_action_get(sdb, cmd);
+	
+	struct sdb_fragment required[8];
+	size_t j, n = 0, tl = 0;
+	
+	required[n++] = sdb->key_fragment;
+	required[n++] = action->action;
+	
+	if (next_token != NULL) {
+		tl = strlen(next_token);
+		required[n].key = "NextToken";
+		required[n].text = NULL;
+		required[n].length = 10 + sdb_escape_length(next_token, tl);
+		n++;
+	}
+	
+	required[n++] = sdb->signature_method_fragment;
+	required[n++] = sdb->signature_version_fragment;
+	required[n++] = *sdb_timestamp_fragment(sdb);
+	required[n++] = action->version;
+	
+	
+	// Determine the exact size
+	
+	size_t i, l = 0;
+	for (i = 0; i < params->size; i++) {
+		l += strlen(params->params[i].key) + 2;
+		l += sdb_escape_length(params->params[i].value, strlen(params->params[i].value));
+	}
+	for (j = 0; j < n; j++) l += required[j].length + 1;
+	
+	// Reserve the buffer (with room for the escaped signature)
+	
+	char* start = sdb_buffer_reserve(out, l + SDB_SIGNATURE_SPACE);
+	if (start == NULL) return SDB_E_URL_ENCODE_FAILED;
+	char* b = start;
+	
+	// Build the string, merging the command parameters with the required ones
+	
+	for (i = 0, j = 0; i < params->size || j < n; ) {
+	
+		if (b != start) *(b++) = '&';
+		
+		if (j < n && (i >= params->size || strcmp(required[j].key, params->params[i].key) < 0)) {
+			if (required[j].text == NULL) {
+				memcpy(b, "NextToken=", 10);
+				sdb_escape_to(b + 10, next_token, tl);
+			}
+			else {
+				memcpy(b, required[j].text, required[j].length);
+			}
+			b += required[j].length;
+			j++;
+			continue;
+		}
+		
+		size_t kl = strlen(params->params[i].key);
+		memcpy(b, params->params[i].key, kl);
+		b += kl;
+		*(b++) = '=';
+		
+		b += sdb_escape_to(b, params->params[i].value, strlen(params->params[i].value));
+		i++;
+	}
+	
+	// Create the signature and add it to the URL-encoded param string
+	
+	return sdb_post_sign(sdb, out, b);
+}
+
+
+/**
+ * Get an immutable copy of the parameters that can be kept after the call
+ * returns (e.g. for retries or NEXT handling). The copy is stored in a single
+ * memory block, and retaining an already immutable array just increments its
+ * reference count.
+ * 
+ * @param params the parameter array
+ * @return the immutable copy (release it using sdb_params_free)
+ */
+struct sdb_params* sdb_params_retain(struct sdb_params* params)
+{
+	if (params == NULL) return NULL;
+	
+	if (__atomic_load_n(&params->ref_count, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&params->ref_count, 1, __ATOMIC_RELAXED);
+		return params;
+	}
+	
+	
+	// Compute the size of the block
+	
+	size_t i, l = 0;
+	for (i = 0; i < params->size; i++) {
+		l += strlen(params->params[i].key) + strlen(params->params[i].value) + 2;
+	}
+	
+	struct sdb_params* p = (struct sdb_params*) malloc(sizeof(struct sdb_params) + params->size * sizeof(struct sdb_pair) + l);
+	if (p == NULL) return NULL;
+	
+	p->size = params->size;
+	p->capacity = params->size;
+	p->params = (struct sdb_pair*) (p + 1);
+	p->strings = NULL;
+	p->ref_count = 1;
+	p->base = NULL;
+	
+	
+	// Copy the strings
+	
+	char* s = (char*) (p->params + p->size);
+	for (i = 0; i < params->size; i++) {
+		
+		l = strlen(params->params[i].key) + 1;
+		memcpy(s, params->params[i].key, l);
+		p->params[i].key = s;
+		s += l;
+		
+		l = strlen(params->params[i].value) + 1;
+		memcpy(s, params->params[i].value, l);
+		p->params[i].value = s;
+		s += l;
+	}
+	
+	return p;
+}
+
+
+/**
+ * Get an immutable copy of a parameter array with some of its values replaced,
+ * which shares the keys and the other values with the array instead of copying
+ * them (only the pairs and the bound values are stored)
+ * 
+ * @param base the immutable parameter array (e.g. of a prepared statement)
+ * @param positions the index of each bound value in the array
+ * @param values the bound values
+ * @param num the number of the bound values
+ * @return the immutable copy (release it using sdb_params_free), or NULL on error
+ */
+struct sdb_params* sdb_params_bind(struct sdb_params* base, const size_t* positions, const char** values, size_t num)
+{
+	assert(base->strings == NULL);
+	
+	
+	// Compute the size of the block
+	
+	size_t i, l = 0;
+	for (i = 0; i < num; i++) l += strlen(values[i]) + 1;
+	
+	struct sdb_params* p = (struct sdb_params*) malloc(sizeof(struct sdb_params) + base->size * sizeof(struct sdb_pair) + l);
+	if (p == NULL) return NULL;
+	
+	p->size = base->size;
+	p->capacity = base->size;
+	p->params = (struct sdb_pair*) (p + 1);
+	p->strings = NULL;
+	p->ref_count = 1;
+	p->base = sdb_params_retain(base);
+	
+	
+	// Point to the strings of the base, and copy only the bound values
+	
+	memcpy(p->params, base->params, sizeof(struct sdb_pair) * p->size);
+	
+	char* s = (char*) (p->params + p->size);
+	for (i = 0; i < num; i++) {
+		l = strlen(values[i]) + 1;
+		memcpy(s, values[i], l);
+		p->params[positions[i]].value = s;
+		s += l;
+	}
+	
+	return p;
+}
+
+
+/**
+ * Create the command POST data
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters
+ * @param next_token the next token (optional)
+ * @param out the output buffer (will be grown as needed)
+ * @return the POST data (owned by the buffer), or NULL on error
+ */
+char* sdb_post(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_buffer* out)
+{
+	if (SDB_FAILED(sdb_params_export(sdb, cmd, params, next_token, out))) return NULL;
+	
+	return out->buffer;
+}
+
+
+/**
+ * A parameter of a prepared statement during its creation
+ */
+struct sdb_prepared_entry
+{
+	const char* key;
+	const char* value;
+	const struct sdb_fragment* fragment;
+	int source;
+};
+
+
+/**
+ * Compare two prepared statement parameters by their keys
+ */
+static int sdb_prepared_entry_compare(const void* a, const void* b)
+{
+	return strcmp(((const struct sdb_prepared_entry*) a)->key, ((const struct sdb_prepared_entry*) b)->key);
+}
+
+
+/**
+ * Create a prepared statement, pre-encoding all but the varying values
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters (the values of the varying ones are ignored)
+ * @param sources for each parameter, the index of its value, or SDB_PREPARED_CONST
+ * @param num_values the number of the varying values
+ * @param pprepared the variable for the prepared statement
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_prepared_create(struct SDB* sdb, const char* cmd, struct sdb_params* params, const int* sources, size_t num_values, struct sdb_prepared** pprepared)
+{
+	*pprepared = NULL;
+	
+	
+	// Collect the command and the required parameters, and sort them
+	
+	const struct sdb_action* action = sdb_action_get(sdb, cmd);
+	const struct sdb_fragment* required[] = {
+		&sdb->key_fragment, &action->action, &sdb->signature_method_fragment,
+		&sdb->signature_version_fragment, &action->version
+	};
+	size_t num_required = sizeof(required) / sizeof(required[0]);
+	
+	size_t i, k, n = params->size + num_required + 1;
+	struct sdb_prepared_entry* e = (struct sdb_prepared_entry*) malloc(sizeof(struct sdb_prepared_entry) * n);
+	if (e == NULL) return SDB_E_URL_ENCODE_FAILED;
+	
+	for (i = 0; i < params->size; i++) {
+		e[i].key = params->params[i].key;
+		e[i].value = params->params[i].value;
+		e[i].fragment = NULL;
+		e[i].source = sources[i];
+	}
+	
+	for (k = 0; k < num_required; k++, i++) {
+		e[i].key = required[k]->key;
+		e[i].value = NULL;
+		e[i].fragment = required[k];
+		e[i].source = SDB_PREPARED_CONST;
+	}
+	
+	e[i].key = "Timestamp";
+	e[i].value = NULL;
+	e[i].fragment = NULL;
+	e[i].source = SDB_PREPARED_TIMESTAMP;
+	
+	qsort(e, n, sizeof(struct sdb_prepared_entry), sdb_prepared_entry_compare);
+	
+	
+	// Determine the size of the pre-encoded text and the number of slots
+	
+	size_t l = 0, num_slots = 0;
+	for (i = 0; i < n; i++) {
+		if (i > 0) l++;
+		if (e[i].fragment != NULL) {
+			l += e[i].fragment->length;
+		}
+		else if (e[i].source == SDB_PREPARED_TIMESTAMP) {
+			num_slots++;
+		}
+		else {
+			l += strlen(e[i].key) + 1;
+			if (e[i].source == SDB_PREPARED_CONST) {
+				l += sdb_escape_length(e[i].value, strlen(e[i].value));
+			}
+			else {
+				num_slots++;
+			}
+		}
+	}
+	
+	
+	// Allocate the prepared statement
+	
+	struct sdb_prepared* p = (struct sdb_prepared*) malloc(sizeof(struct sdb_prepared));
+	if (p == NULL) {
+		free(e);
+		return SDB_E_URL_ENCODE_FAILED;
+	}
+	
+	p->ref_count = 1;
+	
+	strncpy(p->command, cmd, SDB_LEN_COMMAND - 1);
+	p->command[SDB_LEN_COMMAND - 1] = '\0';
+	
+	p->text = (char*) malloc(l + 1);
+	p->length = l;
+	p->slots = (struct sdb_prepared_slot*) malloc(sizeof(struct sdb_prepared_slot) * (num_slots + 1));
+	p->num_slots = num_slots;
+	p->positions = (size_t*) malloc(sizeof(size_t) * (num_values + 1));
+	p->num_values = num_values;
+	p->params = sdb_params_retain(params);
+	
+	if (p->text == NULL || p->slots == NULL || p->positions == NULL || p->params == NULL) {
+		sdb_prepared_destroy(p);
+		free(e);
+		return SDB_E_URL_ENCODE_FAILED;
+	}
+	
+	
+	// Pre-encode the text, leaving out the varying values
+	
+	char* b = p->text;
+	struct sdb_prepared_slot* slot = p->slots;
+	
+	for (i = 0; i < n; i++) {
+		
+		if (i > 0) *(b++) = '&';
+		
+		if (e[i].fragment != NULL) {
+			memcpy(b, e[i].fragment->text, e[i].fragment->length);
+			b += e[i].fragment->length;
+			continue;
+		}
+		
+		if (e[i].source != SDB_PREPARED_TIMESTAMP) {
+			size_t kl = strlen(e[i].key);
+			memcpy(b, e[i].key, kl);
+			b += kl;
+			*(b++) = '=';
+			
+			if (e[i].source == SDB_PREPARED_CONST) {
+				b += sdb_escape_to(b, e[i].value, strlen(e[i].value));
+				continue;
+			}
+		}
+		
+		slot->offset = b - p->text;
+		slot->source = e[i].source;
+		slot++;
+	}
+	*b = '\0';
+	
+	
+	// Remember where the values are in the parameter array
+	
+	for (i = 0; i < params->size; i++) {
+		if (sources[i] >= 0) p->positions[sources[i]] = i;
+	}
+	
+	free(e);
+	*pprepared = p;
+	return SDB_OK;
+}
+
+
+/**
+ * Destroy a prepared statement (or release a reference of a call that still
+ * uses it, which the background I/O thread may release, too)
+ * 
+ * @param prepared the prepared statement
+ */
+void sdb_prepared_destroy(struct sdb_prepared* prepared)
+{
+	if (prepared == NULL) return;
+	if (__atomic_sub_fetch(&prepared->ref_count, 1, __ATOMIC_ACQ_REL) > 0) return;
+	
+	SAFE_FREE(prepared->text);
+	SAFE_FREE(prepared->slots);
+	SAFE_FREE(prepared->positions);
+	sdb_params_free(prepared->params);
+	
+	free(prepared);
+}
+
+
+/**
+ * Create the POST data of a prepared statement
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @param out the output buffer (will be grown as needed)
+ * @return the POST data (owned by the buffer), or NULL on error
+ */
+char* sdb_prepared_post(struct SDB* sdb, struct sdb_prepared* prepared, const char** values, struct sdb_buffer* out)
+{
+	const struct sdb_fragment* timestamp = sdb_timestamp_fragment(sdb);
+	
+	
+	// Determine the exact size
+	
+	size_t i, l = prepared->length;
+	for (i = 0; i < prepared->num_slots; i++) {
+		int s = prepared->slots[i].source;
+		l += s == SDB_PREPARED_TIMESTAMP ? timestamp->length : sdb_escape_length(values[s], strlen(values[s]));
+	}
+	
+	char* post = sdb_buffer_reserve(out, l + SDB_SIGNATURE_SPACE);
+	if (post == NULL) return NULL;
+	
+	
+	// Splice the values into the pre-encoded text
+	
+	char* b = post;
+	size_t last = 0;
+	
+	for (i = 0; i < prepared->num_slots; i++) {
+		size_t offset = prepared->slots[i].offset;
+		memcpy(b, prepared->text + last, offset - last);
+		b += offset - last;
+		last = offset;
+		
+		int s = prepared->slots[i].source;
+		if (s == SDB_PREPARED_TIMESTAMP) {
+			memcpy(b, timestamp->text, timestamp->length);
+			b += timestamp->length;
+		}
+		else {
+			b += sdb_escape_to(b, values[s], strlen(values[s]));
+		}
+	}
+	
+	memcpy(b, prepared->text + last, prepared->length - last);
+	b += prepared->length - last;
+	
+	
+	// Sign
+	
+	if (SDB_FAILED(sdb_post_sign(sdb, out, b))) return NULL;
+	
+	return post;
+}
+
+
+/**
+ * The Curl write callback function
+ * 
+ * @param buffer the received buffer
+ * @param size the size of an item
+ * @param num the number of items
+ * @param data the user data
+ * @return the number of processed bytes
+ */
+size_t sdb_write_callback(void* buffer, size_t size, size_t num, void* data)
+{
+	// Initialize
+	
+	struct sdb_buffer* rec = (struct sdb_buffer*) data;
+	size_t bytes = size * num;
+	
+	
+	// Check the buffer size
+	
+	if (rec->size + bytes > rec->capacity) {
+		
+		// Reallocate the buffer
+		
+		rec->capacity = 2 * (rec->size + bytes) + 4096;
+		char* buf = (char*) malloc(rec->capacity);
+		assert(buf);
+		
+		memcpy(buf, rec->buffer, rec->size);
+		
+		free(rec->buffer);
+		rec->buffer = buf;
+	}
+	
+	
+	// Copy the buffer contents
+	
+	memcpy(rec->buffer + rec->size, buffer, bytes);
+	rec->size += bytes;
+	
+	return bytes;
+}
+
+
+/**
+ * Execute a command and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters
+ * @return the result
+ */
+int sdb_execute(struct SDB* sdb, const char* cmd, struct sdb_params* params)
+{
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	
+	sdb_endpoint_update(sdb);
+	SDB_SAFE(sdb_deadline_apply(sdb, sdb->curl_handle));
+	
+	if (sdb_post(sdb, cmd, params, NULL, &sdb->post) == NULL) return SDB_E_URL_ENCODE_FAILED;
+	
+	return sdb_execute_post(sdb, cmd);
+}
+
+
+/**
+ * Execute a command with the POST data already created in the post buffer
+ * of the handle and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @return the result
+ */
+int sdb_execute_post(struct SDB* sdb, const char* cmd)
+{
+	long postsize = sdb->post.size;
+	
+	
+	// Configure Curl and execute the command
+	
+	CURL* curl = sdb->curl_handle;
+	
+	sdb->rec.size = 0;
+	sdb_target_apply(sdb, curl);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sdb->rec);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sdb->post.buffer);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postsize);
+#ifdef _DEBUG_PRINT_RESPONSE
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+#endif
+	CURLcode cr = curl_easy_perform(curl);
+	sdb_buffer_trim(&sdb->post);
+	
+	
+	// Statistics
+	
+	if (cr == CURLE_OK) {
+		sdb->stat.num_commands++;
+		if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
+		sdb_update_size_stats(sdb, curl, postsize, sdb->rec.size);
+		sdb_update_connection_stats(sdb, curl);
+	}
+	
+	
+	// Handle Curl errors and internal AWS errors
+	
+	if (cr != CURLE_OK) return sdb_transfer_error(sdb, cr);
+	if (strncmp(sdb->rec.buffer, "<html", 5) == 0) return SDB_E_AWS_INTERNAL_ERROR_2;
+	
+#ifdef _DEBUG_PRINT_RESPONSE
+	sdb->rec.buffer[sdb->rec.size] = '\0';
+	printf("\n%s\n\n", sdb->rec.buffer);
+#endif
+	
+	
+	// Parse the response and check for errors
+	
+	struct sdb_response response; sdb_response_init(&response);
+	response.internal->errout = sdb->errout;
+	int __ret = sdb_response_parse(&response, sdb->rec.buffer, sdb->rec.size);
+	
+	if (SDB_FAILED(__ret)) {
+		sdb_response_cleanup(&response);
+		return __ret;
+	}
+	
+	sdb->stat.box_usage += response.box_usage;
+	
+	if (response.error != 0) {
+		__ret = response.error;
+		sdb_response_cleanup(&response);
+		return SDB_AWS_ERROR(__ret);
+	}
+	
+	
+	// Cleanup
+	
+	sdb_response_cleanup(&response);
+	return SDB_OK;
+}
+
+
+/**
+ * Execute a prepared statement and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @return the result
+ */
+int sdb_execute_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char** values)
+{
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	
+	sdb_endpoint_update(sdb);
+	SDB_SAFE(sdb_deadline_apply(sdb, sdb->curl_handle));
+	
+	if (sdb_prepared_post(sdb, prepared, values, &sdb->post) == NULL) return SDB_E_URL_ENCODE_FAILED;
+	
+	return sdb_execute_post(sdb, prepared->command);
+}
+
+
+/**
+ * Execute a command
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters
+ * @param response the pointer to the result-set
+ * @return the result
+ */
+int sdb_execute_rs(struct SDB* sdb, const char* cmd, struct sdb_params* params, struct sdb_response** response)
+{
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	
+	
+	// Get the next token
+	
+	const char* next_token = NULL;
+	if (*response != NULL) {
+		if ((*response)->has_more) {
+			assert((*response)->internal->next_token);
+			next_token = (const char*) (*response)->internal->next_token;
+		}
+	}
+	
+	
+	// Prepare the command execution
+	
+	sdb_endpoint_update(sdb);
+	SDB_SAFE(sdb_deadline_apply(sdb, sdb->curl_handle));
+	
+	if (sdb_post(sdb, cmd, params, next_token, &sdb->post) == NULL) return SDB_E_URL_ENCODE_FAILED;
+	long postsize = sdb->post.size;
+	
+	
+	// Configure Curl and execute the command
+	
+	CURL* curl = sdb->curl_handle;
+	
+	sdb->rec.size = 0;
+	sdb_target_apply(sdb, curl);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sdb->rec);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sdb->post.buffer);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postsize);
+#ifdef _DEBUG_PRINT_RESPONSE
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+#endif
+	
+	struct sdb_multi_data* hedge = NULL;
+	long delay = sdb_hedge_delay(sdb, cmd);
+	
+	CURLcode cr = delay > 0 ? sdb_perform_hedged(sdb, delay, &hedge) : curl_easy_perform(curl);
+	if (hedge != NULL) curl = hedge->curl;
+	sdb_buffer_trim(&sdb->post);
+	
+	
+	// Statistics
+	
+	if (cr == CURLE_OK) {
+		sdb->stat.num_commands++;
+		if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
+		sdb_update_size_stats(sdb, curl, postsize, sdb->rec.size);
+		sdb_update_connection_stats(sdb, curl);
+		sdb_hedge_sample(sdb, cmd, curl);
+	}
+	
+	sdb_multi_free_one(sdb, hedge);
+	
+	
+	// Handle Curl errors and internal AWS errors
+	
+	if (cr != CURLE_OK) return sdb_transfer_error(sdb, cr);
+	if (strncmp(sdb->rec.buffer, "<html", 5) == 0) return SDB_E_AWS_INTERNAL_ERROR_2;
+	
+#ifdef _DEBUG_PRINT_RESPONSE
+	sdb->rec.buffer[sdb->rec.size] = '\0';
+	printf("\n%s\n\n", sdb->rec.buffer);
+#endif
+	
+	
+	// Parse the response and check for errors
+	
+	if (*response == NULL) {
+		*response = sdb_response_allocate();
+	}
+	else {
+		sdb_response_prepare_append(*response);
+	}
+	(*response)->internal->errout = sdb->errout;
+	int __ret = sdb_response_parse(*response, sdb->rec.buffer, sdb->rec.size);
+	
+	if (SDB_FAILED(__ret)) {
+		sdb_free(response);
+		return __ret;
+	}
+	
+	sdb->stat.box_usage += (*response)->box_usage;
+	
+	if ((*response)->error != 0) {
+		__ret = (*response)->error;
+		if (SDB_AWS_ERROR(__ret) != SDB_E_AWS_SERVICE_UNAVAILABLE) sdb_free(response);
+		return SDB_AWS_ERROR(__ret);
+	}
+	
+	
+	// Save the parameters in the case manual NEXT handling is allowed
+	
+	if (!sdb->auto_next && (*response)->has_more) {
+		if ((*response)->internal->next == NULL) {
+			(*response)->internal->params = sdb_params_retain(params);
+			(*response)->internal->command = (char*) malloc(strlen(cmd) + 4);
+			strcpy((*response)->internal->command, cmd);
+		}
+		else if ((*response)->internal->params == NULL) {
+			(*response)->internal->params = (*response)->internal->next->params;
+			(*response)->internal->command = (*response)->internal->next->command;
+			(*response)->internal->next->params = NULL;
+			(*response)->internal->next->command = NULL;
+			assert((*response)->internal->params);
+			assert((*response)->internal->command);
+		}
+	}
+	
+	
+	return SDB_OK;
+}
+
+
+/**
+ * Execute a command using Curl's multi interface
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters
+ * @param next_token the next token (optional)
+ * @param user_data the user data (optional)
+ * @param user_data_2 the user data (optional)
+ * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
+ */
+sdb_multi sdb_execute_multi(struct SDB* sdb, const char* cmd, struct sdb_params* params, char* next_token, void* user_data, void* user_data_2)
+{
+	// The user data belongs to sdb_multi_run(), which cannot run alongside the background I/O thread
+	
+	if (sdb->io_running) {
+		if (user_data != NULL || user_data_2 != NULL) return SDB_MULTI_ERROR;
+		return sdb_io_submit(sdb, cmd, params, next_token, NULL);
+	}
+	
+	sdb_endpoint_update(sdb);
+	
+	struct sdb_multi_data* m = sdb_multi_alloc(sdb);
+	assert(m);
+	
+	if (sdb_post(sdb, cmd, params, next_token, &m->post) == NULL) {
+		sdb_multi_unlink(sdb, m);
+		sdb_multi_free_one(sdb, m);
+		return SDB_MULTI_ERROR;
+	}
+	
+	return sdb_execute_multi_post(sdb, m, cmd, params, user_data, user_data_2);
+}
+
+
+/**
+ * Execute a command using Curl's multi interface, with the POST data already
+ * created in the post buffer of the given multi data structure
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure (at the head of the chain of deferred calls)
+ * @param cmd the command name
+ * @param params the parameters (a copy of which is kept for retries)
+ * @param user_data the user data (optional)
+ * @param user_data_2 the user data (optional)
+ * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
+ */
+sdb_multi sdb_execute_multi_post(struct SDB* sdb, struct sdb_multi_data* m, const char* cmd, struct sdb_params* params, void* user_data, void* user_data_2)
+{
+	long postsize = m->post.size;
+	
+	
+	// Fill in the multi-data structure
+	
+	strncpy(m->command, cmd, SDB_LEN_COMMAND - 1);
+	m->command[SDB_LEN_COMMAND - 1] = '\0';
+	m->params = sdb_params_retain(params);
+	m->user_data = user_data;
+	m->user_data_2 = user_data_2;
+	m->post_size = postsize;
+	
+	
+	// Report the call to the completion callback, if there is one (the NEXT requests of sdb_multi_run() go to their responses)
+	
+	if (user_data == NULL) {
+		m->callback = sdb->multi_callback;
+		m->callback_data = sdb->multi_callback_data;
+	}
+	
+	
+	// Create a Curl handle and defer it
+	
+	sdb->rec.size = 0;
+	sdb_target_apply(sdb, m->curl);
+	curl_easy_setopt(m->curl, CURLOPT_WRITEDATA, &m->rec);
+	curl_easy_setopt(m->curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(m->curl, CURLOPT_POSTFIELDS, m->post.buffer);
+	curl_easy_setopt(m->curl, CURLOPT_POSTFIELDSIZE, postsize);
+	
+	
+	// Handle Curl errors and a passed deadline (the call waits in the queue if the in-flight window is full)
+	
+	int r = sdb_deadline_apply_to(sdb, m->curl, sdb_multi_deadline(sdb, m));
+	if (SDB_SUCCESS(r)) {
+		if (sdb->multi_window > 0 && sdb->multi_running >= sdb->multi_window) {
+			sdb_multi_enqueue(sdb, sdb->queue_tail, m);
+		}
+		else {
+			r = sdb_multi_start(sdb, m);
+		}
+	}
+	
+	if (SDB_FAILED(r)) {
+		sdb_multi_unlink(sdb, m);
+		sdb_multi_free_one(sdb, m);
+		return SDB_MULTI_ERROR;
+	}
+	
+	
+	// Statistics (the size statistics would be updated when the response is received)
+	
+	sdb->stat.num_commands++;
+	if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
+	
+	
+	return m->curl;
+}
+
+
+/**
+ * Execute a prepared statement using Curl's multi interface
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
+ */
+sdb_multi sdb_execute_multi_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char** values)
+{
+	sdb_multi h = SDB_MULTI_ERROR;
+	
+	
+	// Bind the values to the equivalent parameters, which are kept for retries (sharing
+	// the rest with the template, so that only the values are copied)
+	
+	struct sdb_params* params = sdb_params_bind(prepared->params, prepared->positions, values, prepared->num_values);
+	if (params == NULL) return SDB_MULTI_ERROR;
+	
+	if (sdb->io_running) {
+		h = sdb_io_submit(sdb, prepared->command, params, NULL, prepared);
+		sdb_params_free(params);
+		return h;
+	}
+	
+	
+	// Create the POST data from the template
+	
+	sdb_endpoint_update(sdb);
+	
+	struct sdb_multi_data* m = sdb_multi_alloc(sdb);
+	assert(m);
+	
+	if (sdb_prepared_post(sdb, prepared, values, &m->post) == NULL) {
+		sdb_multi_unlink(sdb, m);
+		sdb_multi_free_one(sdb, m);
+	}
+	else {
+		h = sdb_execute_multi_post(sdb, m, prepared->command, params, NULL, NULL);
+	}
+	
+	sdb_params_free(params);
+	return h;
+}
+
+
+/**
+ * Initialize an event loop. Without epoll, the loop falls back to polling
+ * the sockets with curl_multi_wait()
+ * 
+ * @param loop the event loop
+ */
+void sdb_event_loop_init(struct sdb_event_loop* loop)
+{
+	loop->timeout = -1;
+	loop->wakefd = -1;
+	
+#ifdef SDB_HAVE_EPOLL
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	loop->epfd = -1;
+#endif
+}
+
+
+/**
+ * Destroy an event loop
+ * 
+ * @param loop the event loop
+ */
+void sdb_event_loop_cleanup(struct sdb_event_loop* loop)
+{
+	if (loop->epfd >= 0) close(loop->epfd);
+	loop->epfd = -1;
+}
+
+
+/**
+ * Update the interest of the event loop in a socket
+ * 
+ * @param loop the event loop
+ * @param s the socket
+ * @param what the Curl socket interest (CURL_POLL_*)
+ */
+void sdb_event_loop_socket(struct sdb_event_loop* loop, curl_socket_t s, int what)
+{
+#ifdef SDB_HAVE_EPOLL
+	if (loop->epfd < 0) return;
+	
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+		return;
+	}
+	
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+	if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+	
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+	}
+#else
+	(void) loop; (void) s; (void) what;
+#endif
+}
+
+
+/**
+ * Set the descriptor that interrupts the wait of an event loop when it
+ * becomes readable (the loop drains it)
+ * 
+ * @param loop the event loop
+ * @param fd the non-blocking read end of a pipe, or -1 to remove it
+ */
+void sdb_event_loop_wakeup(struct sdb_event_loop* loop, int fd)
+{
+#ifdef SDB_HAVE_EPOLL
+	if (loop->epfd >= 0) {
+		if (loop->wakefd >= 0) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->wakefd, NULL);
+		
+		if (fd >= 0) {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.data.fd = fd;
+			ev.events = EPOLLIN;
+			epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	}
+#endif
+	
+	loop->wakefd = fd;
+}
+
+
+/**
+ * Drain the wake-up descriptor of an event loop
+ * 
+ * @param loop the event loop
+ */
+static void sdb_event_loop_drain(struct sdb_event_loop* loop)
+{
+	char buf[64];
+	while (read(loop->wakefd, buf, sizeof(buf)) > 0);
+}
+
+
+/**
+ * The Curl socket callback of a stand-alone event loop
+ */
+static int sdb_event_loop_socket_callback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+	(void) easy; (void) socketp;
+	sdb_event_loop_socket((struct sdb_event_loop*) userp, s, what);
+	return 0;
+}
+
+
+/**
+ * The Curl timer callback of a stand-alone event loop
+ */
+static int sdb_event_loop_timer_callback(CURLM* multi, long timeout_ms, void* userp)
+{
+	(void) multi;
+	((struct sdb_event_loop*) userp)->timeout = timeout_ms;
+	return 0;
+}
+
+
+/**
+ * Let an event loop drive the transfers of a Curl multi handle
+ * 
+ * @param loop the event loop
+ * @param multi the Curl multi handle
+ */
+void sdb_event_loop_attach(struct sdb_event_loop* loop, CURLM* multi)
+{
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, sdb_event_loop_socket_callback);
+	curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, loop);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, sdb_event_loop_timer_callback);
+	curl_multi_setopt(multi, CURLMOPT_TIMERDATA, loop);
+}
+
+
+/**
+ * The Curl socket callback of the multi handle of a SimpleDB handle, which
+ * forwards the socket interest to the event loop hooks if there are any
+ */
+static int sdb_multi_socket_callback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+	struct SDB* sdb = (struct SDB*) userp;
+	(void) easy; (void) socketp;
+	
+	if (sdb->socket_hook == NULL) {
+		sdb_event_loop_socket(&sdb->loop, s, what);
+		return 0;
+	}
+	
+	int events = SDB_POLL_NONE;
+	if (what == CURL_POLL_REMOVE) events = SDB_POLL_REMOVE;
+	if (what & CURL_POLL_IN) events |= SDB_POLL_IN;
+	if (what & CURL_POLL_OUT) events |= SDB_POLL_OUT;
+	
+	sdb->socket_hook(sdb, (int) s, events, sdb->hook_data);
+	return 0;
+}
+
+
+/**
+ * The Curl timer callback of the multi handle of a SimpleDB handle
+ */
+static int sdb_multi_timer_callback(CURLM* multi, long timeout_ms, void* userp)
+{
+	struct SDB* sdb = (struct SDB*) userp;
+	(void) multi;
+	
+	sdb->loop.timeout = timeout_ms;
+	if (sdb->timer_hook != NULL) sdb->timer_hook(sdb, timeout_ms, sdb->hook_data);
+	return 0;
+}
+
+
+/**
+ * Let the event loop of a SimpleDB handle (or its hooks) drive its multi handle
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_multi_attach(struct SDB* sdb)
+{
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_SOCKETFUNCTION, sdb_multi_socket_callback);
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_SOCKETDATA, sdb);
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_TIMERFUNCTION, sdb_multi_timer_callback);
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_TIMERDATA, sdb);
+}
+
+
+/**
+ * Start the transfers added to a Curl multi handle
+ * 
+ * @param loop the event loop attached to the multi handle, or NULL
+ * @param multi the Curl multi handle
+ * @param running the pointer to the number of the running transfers
+ * @return the result
+ */
+static int sdb_event_loop_start(struct sdb_event_loop* loop, CURLM* multi, int* running)
+{
+	int r;
+	
+	if (loop != NULL && loop->epfd >= 0) {
+		r = curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, running);
+	}
+	else {
+		r = curl_multi_perform(multi, running);
+	}
+	
+	return r == CURLM_OK ? SDB_OK : SDB_CURLM_ERROR(r);
+}
+
+
+/**
+ * Run one iteration of an event loop: wait for the sockets or for the Curl
+ * timer, but at most max_wait ms, and let Curl process what happened
+ * 
+ * @param loop the event loop attached to the multi handle, or NULL
+ * @param multi the Curl multi handle
+ * @param max_wait the maximum time to wait (ms)
+ * @param running the pointer to the number of the running transfers
+ * @return the result
+ */
+static int sdb_event_loop_step(struct sdb_event_loop* loop, CURLM* multi, long max_wait, int* running)
+{
+	int r;
+	
+	if (max_wait > SDB_EVENT_LOOP_MAX_WAIT) max_wait = SDB_EVENT_LOOP_MAX_WAIT;
+	
+#ifdef SDB_HAVE_EPOLL
+	if (loop != NULL && loop->epfd >= 0) {
+		struct epoll_event events[SDB_EVENT_LOOP_MAX_EVENTS];
+		int i, n;
+		
+		int timeout = loop->timeout < 0 || loop->timeout > max_wait ? (int) max_wait : (int) loop->timeout;
+		
+		n = epoll_wait(loop->epfd, events, SDB_EVENT_LOOP_MAX_EVENTS, timeout);
+		if (n < 0) return errno == EINTR ? SDB_OK : SDB_E_FD_ERROR;
+		
+		if (n == 0) {
+			if ((r = curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, running)) != CURLM_OK) return SDB_CURLM_ERROR(r);
+			return SDB_OK;
+		}
+		
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == loop->wakefd) {
+				sdb_event_loop_drain(loop);
+				continue;
+			}
+			
+			int mask = 0;
+			if (events[i].events & EPOLLIN) mask |= CURL_CSELECT_IN;
+			if (events[i].events & EPOLLOUT) mask |= CURL_CSELECT_OUT;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) mask |= CURL_CSELECT_ERR;
+			
+			if ((r = curl_multi_socket_action(multi, events[i].data.fd, mask, running)) != CURLM_OK) return SDB_CURLM_ERROR(r);
+		}
+		
+		return SDB_OK;
+	}
+#else
+	(void) loop;
 #endif
-	CURLcode cr = curl_easy_perform(curl);
-	free(post);
 	
+	struct curl_waitfd wake;
+	wake.fd = loop != NULL ? loop->wakefd : -1;
+	wake.events = CURL_WAIT_POLLIN;
+	wake.revents = 0;
 	
-	// Statistics
+	if ((r = curl_multi_wait(multi, &wake, wake.fd >= 0 ? 1 : 0, (int) max_wait, NULL)) != CURLM_OK) return SDB_CURLM_ERROR(r);
+	if (wake.revents != 0) sdb_event_loop_drain(loop);
+	if ((r = curl_multi_perform(multi, running)) != CURLM_OK) return SDB_CURLM_ERROR(r);
 	
-	if (cr == CURLE_OK) {
-		sdb->stat.num_commands++;
-		if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
-		sdb_update_size_stats(sdb, curl, postsize, sdb->rec.size);
+	return SDB_OK;
+}
+
+
+/**
+ * Run all transfers of a Curl multi handle and wait for them to complete.
+ * The event loop waits only for the sockets that Curl asked for and hands
+ * each ready socket to curl_multi_socket_action(), so the cost of an
+ * iteration does not grow with the number of idle connections. Without
+ * epoll (or without an event loop), curl_multi_wait() polls the sockets.
+ * 
+ * @param loop the event loop attached to the multi handle, or NULL
+ * @param multi the Curl multi handle
+ * @return the result
+ */
+int sdb_event_loop_wait(struct sdb_event_loop* loop, CURLM* multi)
+{
+	int running;
+	
+	SDB_SAFE(sdb_event_loop_start(loop, multi, &running));
+	
+	while (running) {
+		SDB_SAFE(sdb_event_loop_step(loop, multi, SDB_EVENT_LOOP_MAX_WAIT, &running));
 	}
 	
+	return SDB_OK;
+}
+
+
+/**
+ * Check whether a command is a read that can be hedged
+ * 
+ * @param cmd the command name (NULL = any read)
+ * @return TRUE if it is
+ */
+static int sdb_hedge_command(const char* cmd)
+{
+	return strcmp(cmd, "GetAttributes") == 0 || strcmp(cmd, "Select") == 0;
+}
+
+
+/**
+ * Compare two latencies
+ */
+static int sdb_hedge_sample_compare(const void* a, const void* b)
+{
+	long x = *((const long*) a);
+	long y = *((const long*) b);
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+/**
+ * Get the delay after which a read is duplicated
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name (NULL = any read)
+ * @return the delay in ms, or 0 if the command should not be hedged
+ */
+long sdb_hedge_delay(struct SDB* sdb, const char* cmd)
+{
+	long samples[SDB_HEDGE_SAMPLES];
+	
+	if (cmd != NULL && !sdb_hedge_command(cmd)) return 0;
+	if (sdb->hedge_percentile <= 0 || sdb->num_hedge_samples < SDB_HEDGE_MIN_SAMPLES) return sdb->hedge_delay;
 	
-	// Handle Curl errors and internal AWS errors
 	
-	if (cr != CURLE_OK) return SDB_CURL_ERROR(cr);
-	if (strncmp(sdb->rec.buffer, "<html", 5) == 0) return SDB_E_AWS_INTERNAL_ERROR_2;
+	// Use the percentile of the recent latencies
 	
-#ifdef _DEBUG_PRINT_RESPONSE
-	sdb->rec.buffer[sdb->rec.size] = '\0';
-	printf("\n%s\n\n", sdb->rec.buffer);
-#endif
+	int n = sdb->num_hedge_samples < SDB_HEDGE_SAMPLES ? sdb->num_hedge_samples : SDB_HEDGE_SAMPLES;
+	memcpy(samples, sdb->hedge_samples, sizeof(long) * n);
+	qsort(samples, n, sizeof(long), sdb_hedge_sample_compare);
 	
+	long d = samples[(n - 1) * sdb->hedge_percentile / 100];
+	return d > 0 ? d : 1;
+}
+
+
+/**
+ * Record the latency of a completed read for the hedging percentile
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param curl the Curl handle of the request
+ */
+void sdb_hedge_sample(struct SDB* sdb, const char* cmd, CURL* curl)
+{
+	double t;
 	
-	// Parse the response and check for errors
+	if (sdb->hedge_percentile <= 0 || !sdb_hedge_command(cmd)) return;
+	if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &t) != CURLE_OK) return;
 	
-	struct sdb_response response; sdb_response_init(&response);
-	response.internal->errout = sdb->errout;
-	int __ret = sdb_response_parse(&response, sdb->rec.buffer, sdb->rec.size);
+	sdb->hedge_samples[sdb->num_hedge_samples % SDB_HEDGE_SAMPLES] = (long) (t * 1000);
+	sdb->num_hedge_samples++;
+	if (sdb->num_hedge_samples >= 2 * SDB_HEDGE_SAMPLES) sdb->num_hedge_samples -= SDB_HEDGE_SAMPLES;
+}
+
+
+/**
+ * Duplicate the deferred reads that have been in flight for the hedging delay
+ * since they started (each attempt of a read is duplicated at most once)
+ * 
+ * @param sdb the SimpleDB handle
+ * @param delay the hedging delay in ms
+ * @return the time until the next read is due in ms, or -1 if there is none
+ */
+static long sdb_multi_hedge(struct SDB* sdb, long delay)
+{
+	struct sdb_multi_data* m;
+	long long now = monotonic_ms();
+	long wait = -1;
 	
-	if (SDB_FAILED(__ret)) {
-		sdb_response_cleanup(&response);
-		return __ret;
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		if (m->done || m->queued || m->waiting || m->hedged || !sdb_hedge_command(m->command)) continue;
+		
+		if (now - m->started < delay) {
+			long w = (long) (m->started + delay - now);
+			if (wait < 0 || w < wait) wait = w;
+			continue;
+		}
+		
+		
+		// Copy the call (the duplicate goes to the head of the chain, so it is not visited again)
+		
+		struct sdb_multi_data* h = sdb_multi_alloc(sdb);
+		if (h->curl == NULL || sdb_buffer_reserve(&h->post, m->post.size) == NULL) {
+			sdb_multi_unlink(sdb, h);
+			sdb_multi_free_one(sdb, h);
+			break;
+		}
+		
+		memcpy(h->post.buffer, m->post.buffer, m->post.size);
+		h->post.size = m->post.size;
+		
+		strcpy(h->command, m->command);
+		h->params = sdb_params_retain(m->params);
+		h->user_data = m->user_data;
+		h->user_data_2 = m->user_data_2;
+		h->callback = m->callback;
+		h->callback_data = m->callback_data;
+		h->group = m->group != NULL ? m->group : m->curl;
+		h->post_size = m->post_size;
+		
+		sdb_target_apply(sdb, h->curl);
+		curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, &h->rec);
+		curl_easy_setopt(h->curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(h->curl, CURLOPT_POSTFIELDS, h->post.buffer);
+		curl_easy_setopt(h->curl, CURLOPT_POSTFIELDSIZE, h->post_size);
+		
+		if (SDB_FAILED(sdb_deadline_apply(sdb, h->curl)) || SDB_FAILED(sdb_multi_start(sdb, h))) {
+			sdb_multi_unlink(sdb, h);
+			sdb_multi_free_one(sdb, h);
+			break;
+		}
+		
+		h->hedge = TRUE;
+		h->hedged = TRUE;
+		h->twin = m;
+		m->hedged = TRUE;
+		m->twin = h;
+		
+		sdb->stat.num_hedges++;
 	}
 	
-	sdb->stat.box_usage += response.box_usage;
+	return wait;
+}
+
+
+/**
+ * Finish a call with a completion callback: parse its response, request the
+ * next page if automatic NEXT handling is enabled, or pass the response to
+ * the callback
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure of the completed transfer
+ * @param cr the result of the transfer
+ */
+static void sdb_multi_complete(struct SDB* sdb, struct sdb_multi_data* m, CURLcode cr)
+{
+	sdb_multi handle = m->group != NULL ? m->group : m->curl;
+	int r;
 	
-	if (response.error != 0) {
-		__ret = response.error;
-		sdb_response_cleanup(&response);
-		return SDB_AWS_ERROR(__ret);
+	
+	// Parse the result, which is appended to the previous pages
+	
+	if (cr == CURLE_OPERATION_TIMEDOUT && m->deadline > 0 && monotonic_ms() >= m->deadline) {
+		r = SDB_E_DEADLINE_EXCEEDED;
+	}
+	else if (cr != CURLE_OK) {
+		r = sdb_transfer_error(sdb, cr);
+	}
+	else {
+		r = sdb_parse_result(sdb, m->curl, m->post_size, &m->rec, &m->response);
+		
+		if (SDB_FAILED(r) && sdb->errout != NULL && sdb->dump_on_error) {
+			fprintf(sdb->errout, "SimpleDB Error %d\n", r);
+			unsigned u;
+			for (u = 0; u < m->params->size; u++) {
+				fprintf(sdb->errout, "%s = %s\n", m->params->params[u].key, m->params->params[u].value);
+			}
+			fprintf(sdb->errout, "\n");
+		}
+	}
+	
+	if (m->response == NULL) {
+		m->response = sdb_multi_error_response(handle, r);
+	}
+	else {
+		m->response->multi_handle = handle;
+		m->response->return_code = r;
+	}
+	
+	
+	// Request the next page
+	
+	struct sdb_response* response = m->response;
+	
+	if (SDB_SUCCESS(r) && response->has_more && sdb->auto_next) {
+		if (sdb_post(sdb, m->command, m->params, (char*) response->internal->next_token, &m->post) != NULL) {
+			curl_multi_remove_handle(sdb->curl_multi, m->curl);
+			m->post_size = m->post.size;
+			m->rec.size = 0;
+			m->done = FALSE;
+			
+			curl_easy_setopt(m->curl, CURLOPT_POSTFIELDS, m->post.buffer);
+			curl_easy_setopt(m->curl, CURLOPT_POSTFIELDSIZE, m->post_size);
+			
+			sdb_multi_enqueue(sdb, NULL, m);
+			
+			sdb->stat.num_commands++;
+			return;
+		}
+		
+		response->return_code = SDB_E_RETRY_FAILED;
+	}
+	
+	
+	// Save the parameters in the case manual NEXT handling is allowed
+	
+	if (response->has_more && !sdb->auto_next && response->internal->params == NULL) {
+		response->internal->params = sdb_params_retain(m->params);
+		response->internal->command = (char*) malloc(strlen(m->command) + 4);
+		strcpy(response->internal->command, m->command);
+	}
+	
+	
+	// Hand the response over to the callback, and release the buffers, which are no longer needed
+	
+	m->response = NULL;
+	m->callback(sdb, handle, response, m->callback_data);
+	
+	sdb_params_free(m->params);
+	m->params = NULL;
+	
+	sdb_buffer_trim(&m->post);
+	m->rec.size = 0;
+	if (m->rec.buffer != NULL) free(m->rec.buffer);
+	m->rec.buffer = NULL;
+	m->rec.capacity = 0;
+}
+
+
+/**
+ * Save the message of a completed transfer for sdb_multi_info_read()
+ * 
+ * @param sdb the SimpleDB handle
+ * @param msg the message
+ */
+static void sdb_multi_save(struct SDB* sdb, const CURLMsg* msg)
+{
+	if (sdb->num_completed >= sdb->completed_capacity) {
+		int c = sdb->completed_capacity == 0 ? 64 : 2 * sdb->completed_capacity;
+		CURLMsg* a = (CURLMsg*) realloc(sdb->completed, sizeof(CURLMsg) * c);
+		if (a == NULL) return;
+		sdb->completed = a;
+		sdb->completed_capacity = c;
+	}
+	
+	sdb->completed[sdb->num_completed++] = *msg;
+}
+
+
+/**
+ * Collect the completed transfers of the multi handle. When either copy of
+ * a hedged read succeeds, the other copy is cancelled and only the winner
+ * is reported; a failed or throttled copy is dropped, and the other copy
+ * keeps running. A throttled call is not reported, but scheduled for a
+ * retry instead. The
+ * receive buffers of the windowed calls shrink to fit their responses. The
+ * calls with completion callbacks are finished right away (the callbacks
+ * may start new calls, which update sdb->multi_running).
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the number of the cancelled transfers
+ */
+static int sdb_multi_collect(struct SDB* sdb)
+{
+	CURLMsg* msg;
+	int remaining, cancelled = 0;
+	
+	while ((msg = curl_multi_info_read(sdb->curl_multi, &remaining)) != NULL) {
+		if (msg->msg != CURLMSG_DONE) continue;
+		
+		struct sdb_multi_data* m = sdb_multi_find(msg->easy_handle);
+		if (m != NULL) {
+			if (m->done) continue;
+			
+			
+			// Retry a throttled call on its own timer (but not a copy of a hedged read while the other one runs)
+			
+			if (m->twin == NULL && msg->data.result == CURLE_OK && sdb_multi_retry(sdb, m)) continue;
+			m->done = TRUE;
+			
+			if (m->twin != NULL) {
+				struct sdb_multi_data* t = m->twin;
+				m->twin = NULL;
+				t->twin = NULL;
+				
+				
+				// A failed or throttled copy leaves the other one running (which is
+				// retried on its own if it is throttled, too), with the pages so far
+				
+				long code = 0;
+				if (msg->data.result == CURLE_OK) curl_easy_getinfo(m->curl, CURLINFO_RESPONSE_CODE, &code);
+				
+				if (msg->data.result != CURLE_OK || code == 503) {
+					if (t->response == NULL) {
+						t->response = m->response;
+						m->response = NULL;
+					}
+					continue;
+				}
+				
+				curl_multi_remove_handle(sdb->curl_multi, t->curl);
+				t->done = TRUE;
+				cancelled++;
+				if (m->hedge) sdb->stat.num_hedges_won++;
+				
+				if (m->response == NULL) {
+					m->response = t->response;
+					t->response = NULL;
+				}
+			}
+			
+			if (msg->data.result == CURLE_OK) sdb_hedge_sample(sdb, m->command, m->curl);
+			
+			if (m->callback != NULL) {
+				sdb_multi_complete(sdb, m, msg->data.result);
+				continue;
+			}
+			
+			
+			// Keep only the response of a windowed call until the run ends
+			
+			if (sdb->multi_window > 0) sdb_buffer_fit(&m->rec);
+		}
+		
+		sdb_multi_save(sdb, msg);
+	}
+	
+	return cancelled;
+}
+
+
+/**
+ * Finish a queued call that could not be started with the given transfer
+ * error, so that it is reported to its completion callback or in the
+ * response of sdb_multi_run() instead of never completing
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure of the call
+ * @param cr the transfer error
+ */
+void sdb_multi_abort(struct SDB* sdb, struct sdb_multi_data* m, CURLcode cr)
+{
+	m->done = TRUE;
+	
+	if (m->callback != NULL) {
+		sdb_multi_complete(sdb, m, cr);
+		return;
+	}
+	
+	CURLMsg msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg = CURLMSG_DONE;
+	msg.easy_handle = m->curl;
+	msg.data.result = cr;
+	
+	sdb_multi_save(sdb, &msg);
+}
+
+
+/**
+ * Run all deferred multi calls and wait for the result. The queued calls
+ * start as soon as the calls in flight complete, and each throttled call is
+ * retried after its own backoff while the other calls keep running. If
+ * hedging is enabled, each read that is still in flight after the hedging
+ * delay since its start (including a retry or the next page) is duplicated.
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the result
+ */
+int sdb_multi_run_and_wait(struct SDB* sdb)
+{
+	// The library's own event loop does not know the sockets registered with the hooks
+	
+	struct sdb_event_loop* loop = sdb->socket_hook != NULL ? NULL : &sdb->loop;
+	long delay = sdb->socket_hook != NULL ? 0 : sdb_hedge_delay(sdb, NULL);
+	int running;
+	
+	SDB_SAFE(sdb_event_loop_start(loop, sdb->curl_multi, &running));
+	
+	
+	// Collect the calls that completed already (with the event loop hooks), and start the queued calls
+	
+	sdb->multi_running = running;
+	sdb_multi_collect(sdb);
+	running = sdb->multi_running;
+	
+	long retry_wait = sdb_multi_retry_due(sdb);
+	sdb_multi_admit(sdb, &running);
+	
+	while (running || retry_wait >= 0) {
+		long max_wait = SDB_EVENT_LOOP_MAX_WAIT;
+		if (retry_wait >= 0 && retry_wait < max_wait) max_wait = retry_wait;
+		
+		
+		// Duplicate the slow reads, each on its own timer (the reads started later are due later)
+		
+		if (delay > 0 && running) {
+			sdb->multi_running = running;
+			long hedge_wait = sdb_multi_hedge(sdb, delay);
+			running = sdb->multi_running;
+			
+			if (hedge_wait >= 0 && hedge_wait < max_wait) max_wait = hedge_wait;
+		}
+		
+		
+		// Wait for the transfers, or only for the next retry if none are running
+		
+		if (running) {
+			SDB_SAFE(sdb_event_loop_step(loop, sdb->curl_multi, max_wait, &running));
+		}
+		else {
+			usleep(max_wait * 1000);
+		}
+		
+		
+		// Cancel the losers of the hedged reads as soon as possible (and then recount the running transfers),
+		// schedule the retries of the throttled calls, release the unused receive buffers of the windowed calls,
+		// and invoke the completion callbacks (counting the calls that they start)
+		
+		sdb->multi_running = running;
+		if (sdb_multi_collect(sdb) > 0) {
+			SDB_SAFE(sdb_event_loop_start(loop, sdb->curl_multi, &running));
+		}
+		else {
+			running = sdb->multi_running;
+		}
+		
+		
+		// Start the due retries and refill the in-flight window
+		
+		retry_wait = sdb_multi_retry_due(sdb);
+		sdb_multi_admit(sdb, &running);
 	}
 	
-	
-	// Cleanup
-	
-	sdb_response_cleanup(&response);
+	sdb->multi_running = 0;
 	return SDB_OK;
 }
 
 
 /**
- * Execute a command
+ * Process the transfers that completed outside of sdb_multi_run_and_wait()
+ * (with the event loop hooks): invoke the completion callbacks and schedule
+ * the retries, and then start the due retries and the queued calls
  * 
  * @param sdb the SimpleDB handle
- * @param cmd the command name
- * @param params the parameters
- * @param response the pointer to the result-set
- * @return the result
+ * @param running the pointer to the number of the calls in flight, which is updated
  */
-int sdb_execute_rs(struct SDB* sdb, const char* cmd, struct sdb_params* _params, struct sdb_response** response)
+void sdb_multi_progress(struct SDB* sdb, int* running)
 {
-	// Prepare the command execution
-	
-	struct sdb_params* params = sdb_params_alloc(_params->size + 8);
-	SDB_SAFE(sdb_params_add(params, "Action", cmd));
-	char timestamp[32]; sdb_timestamp(timestamp);
-	SDB_SAFE(sdb_params_add(params, "Timestamp", timestamp));
+	sdb->multi_running = *running;
+	sdb_multi_collect(sdb);
+	*running = sdb->multi_running;
 	
+	sdb_multi_retry_due(sdb);
+	sdb_multi_admit(sdb, running);
+}
+
+
+/**
+ * Complete a request of the background I/O thread: pass the response to
+ * the completion callback, or fulfill the request for sdb_multi_wait()
+ * 
+ * @param sdb the SimpleDB handle
+ * @param q the request
+ * @param response the response
+ */
+static void sdb_io_finish(struct SDB* sdb, struct sdb_io_request* q, struct sdb_response* response)
+{
+	struct sdb_io_request* g = q->group != NULL ? q->group : q;
+	int fulfill = g->callback == NULL;		/* read now, since the waiting thread frees the request */
+	response->multi_handle = (sdb_multi) g;
 	
-	// Add the command parameters
+	if (q->callback != NULL) {
+		q->callback(sdb, (sdb_multi) g, response, q->callback_data);
+		response = NULL;
+	}
 	
-	SDB_SAFE(sdb_params_add_all(params, _params));
 	
+	// Keep the response of the first failed part of a split batch, or of the last one
 	
-	// Add the next token
+	pthread_mutex_lock(&sdb->io_lock);
 	
-	if (*response != NULL) {
-		if ((*response)->has_more) {
-			assert((*response)->internal->next_token);
-			SDB_SAFE(sdb_params_add(params, "NextToken", (const char*) (*response)->internal->next_token));
+	if (response != NULL) {
+		if (g->response == NULL) {
+			g->response = response;
+		}
+		else if (SDB_FAILED(g->response->return_code)) {
+			sdb_free(&response);
+		}
+		else {
+			sdb_free(&g->response);
+			g->response = response;
 		}
 	}
 	
+	int last = --g->pending == 0;
+	if (last) {
+		g->done = TRUE;
+		if (fulfill) pthread_cond_broadcast(&sdb->io_done);
+	}
 	
-	// Add the required parameters
-	
-	SDB_SAFE(sdb_params_add_required(sdb, params));
-	char* post = sdb_post(sdb, params);
-	long postsize = strlen(post);
-	sdb_params_free(params);
-	
+	pthread_mutex_unlock(&sdb->io_lock);
 	
-	// Configure Curl and execute the command
 	
-	CURL* curl = sdb->curl_handle;
+	// The request is freed by sdb_multi_wait() if it is not reported to a callback
 	
-	sdb->rec.size = 0;
-	curl_easy_setopt(curl, CURLOPT_URL, AWS_URL);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sdb->rec);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
-#ifdef _DEBUG_PRINT_RESPONSE
-	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-#endif
-	CURLcode cr = curl_easy_perform(curl);
-	free(post);
+	if (q != g) free(q);
+	if (last && !fulfill) free(g);
+}
+
+
+/**
+ * The completion callback of the calls started by the background I/O thread
+ */
+static void sdb_io_callback(struct SDB* sdb, sdb_multi handle, struct sdb_response* response, void* data)
+{
+	struct sdb_io_request* q = (struct sdb_io_request*) data;
+	(void) handle;
 	
 	
-	// Statistics
+	// Free the multi data structure after the collection is done with it
 	
-	if (cr == CURLE_OK) {
-		sdb->stat.num_commands++;
-		if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
-		sdb_update_size_stats(sdb, curl, postsize, sdb->rec.size);
-	}
+	q->m->queue_next = sdb->io_finished;
+	sdb->io_finished = q->m;
 	
+	sdb_io_finish(sdb, q, response);
+}
+
+
+/**
+ * Create the POST data of a call submitted to the background I/O thread, from
+ * the template of the prepared statement that its parameters bind (if any)
+ * 
+ * @param sdb the SimpleDB handle
+ * @param q the request
+ * @param out the output buffer (will be grown as needed)
+ * @return the POST data (owned by the buffer), or NULL on error
+ */
+static char* sdb_io_post(struct SDB* sdb, struct sdb_io_request* q, struct sdb_buffer* out)
+{
+	if (q->prepared == NULL) return sdb_post(sdb, q->command, q->params, q->next_token, out);
 	
-	// Handle Curl errors and internal AWS errors
+	const char** values = (const char**) alloca(sizeof(const char*) * (q->prepared->num_values + 1));
+	size_t i;
 	
-	if (cr != CURLE_OK) return SDB_CURL_ERROR(cr);
-	if (strncmp(sdb->rec.buffer, "<html", 5) == 0) return SDB_E_AWS_INTERNAL_ERROR_2;
+	for (i = 0; i < q->prepared->num_values; i++) {
+		values[i] = q->params->params[q->prepared->positions[i]].value;
+	}
 	
-#ifdef _DEBUG_PRINT_RESPONSE
-	sdb->rec.buffer[sdb->rec.size] = '\0';
-	printf("\n%s\n\n", sdb->rec.buffer);
-#endif
+	return sdb_prepared_post(sdb, q->prepared, values, out);
+}
+
+
+/**
+ * Start a call submitted to the background I/O thread
+ * 
+ * @param sdb the SimpleDB handle
+ * @param q the request
+ */
+static void sdb_io_start(struct SDB* sdb, struct sdb_io_request* q)
+{
+	sdb_multi h = SDB_MULTI_ERROR;
+	int r = SDB_E_INTERNAL_ERROR;
 	
+	sdb_endpoint_update(sdb);
 	
-	// Parse the response and check for errors
+	struct sdb_multi_data* m = sdb_multi_alloc(sdb);
+	assert(m);
+	m->deadline = q->deadline;
 	
-	if (*response == NULL) {
-		*response = sdb_response_allocate();
+	if (q->deadline > 0 && monotonic_ms() >= q->deadline) {
+		sdb_multi_unlink(sdb, m);
+		sdb_multi_free_one(sdb, m);
+		r = SDB_E_DEADLINE_EXCEEDED;
 	}
-	else {
-		sdb_response_prepare_append(*response);
+	else if (sdb_io_post(sdb, q, &m->post) == NULL) {
+		sdb_multi_unlink(sdb, m);
+		sdb_multi_free_one(sdb, m);
 	}
-	(*response)->internal->errout = sdb->errout;
-	int __ret = sdb_response_parse(*response, sdb->rec.buffer, sdb->rec.size);
-	
-	if (SDB_FAILED(__ret)) {
-		sdb_free(response);
-		return __ret;
+	else {
+		h = sdb_execute_multi_post(sdb, m, q->command, q->params, NULL, NULL);
 	}
 	
-	sdb->stat.box_usage += (*response)->box_usage;
+	sdb_params_free(q->params);
+	q->params = NULL;
+	if (q->next_token != NULL) free(q->next_token);
+	q->next_token = NULL;
+	sdb_prepared_destroy(q->prepared);
+	q->prepared = NULL;
 	
-	if ((*response)->error != 0) {
-		__ret = (*response)->error;
-		if (SDB_AWS_ERROR(__ret) != SDB_E_AWS_SERVICE_UNAVAILABLE) sdb_free(response);
-		return SDB_AWS_ERROR(__ret);
+	if (h == SDB_MULTI_ERROR) {
+		sdb_io_finish(sdb, q, sdb_multi_error_response(SDB_MULTI_ERROR, r));
+		return;
 	}
 	
+	m->group = (sdb_multi) (q->group != NULL ? q->group : q);
+	m->callback = sdb_io_callback;
+	m->callback_data = q;
+	q->m = m;
+}
+
+
+/**
+ * The main function of the background I/O thread
+ * 
+ * @param arg the SimpleDB handle
+ * @return NULL
+ */
+static void* sdb_io_main(void* arg)
+{
+	struct SDB* sdb = (struct SDB*) arg;
+	struct sdb_io_request* q;
+	struct sdb_io_request* next;
+	struct sdb_multi_data* m;
+	int running = 0;
 	
-	// Save the parameters in the case manual NEXT handling is allowed
-	
-	if (!sdb->auto_next && (*response)->has_more) {
-		if ((*response)->internal->next == NULL) {
-			(*response)->internal->params = sdb_params_deep_copy(_params);
-			(*response)->internal->command = (char*) malloc(strlen(cmd) + 4);
-			strcpy((*response)->internal->command, cmd);
+	while (TRUE) {
+		
+		// Start the submitted calls in the order of their submission
+		
+		struct sdb_io_request* stack = (struct sdb_io_request*) __sync_lock_test_and_set(&sdb->io_queue, NULL);
+		struct sdb_io_request* fifo = NULL;
+		
+		for (q = stack; q != NULL; q = next) {
+			next = q->next;
+			q->next = fifo;
+			fifo = q;
 		}
-		else if ((*response)->internal->params == NULL) {
-			(*response)->internal->params = (*response)->internal->next->params;
-			(*response)->internal->command = (*response)->internal->next->command;
-			(*response)->internal->next->params = NULL;
-			(*response)->internal->next->command = NULL;
-			assert((*response)->internal->params);
-			assert((*response)->internal->command);
+		
+		sdb->multi_running = running;
+		
+		for (q = fifo; q != NULL; q = next) {
+			next = q->next;
+			sdb_io_start(sdb, q);
+		}
+		
+		running = sdb->multi_running;
+		
+		
+		// Start the due retries and refill the in-flight window
+		
+		long retry_wait = sdb_multi_retry_due(sdb);
+		sdb_multi_admit(sdb, &running);
+		
+		
+		// Exit once all calls submitted before the stop are done
+		
+		if (__atomic_load_n(&sdb->io_stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&sdb->io_queue, __ATOMIC_ACQUIRE) == NULL && running == 0 && sdb->queue_head == NULL && sdb->retry_head == NULL) break;
+		
+		
+		// Wait for the transfers, a new submission, or the next retry
+		
+		long max_wait = SDB_EVENT_LOOP_MAX_WAIT;
+		if (retry_wait >= 0 && retry_wait < max_wait) max_wait = retry_wait;
+		
+		int r = sdb_event_loop_step(&sdb->loop, sdb->curl_multi, max_wait, &running);
+		if (SDB_FAILED(r)) {
+			if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Error: The I/O thread cannot wait for the transfers (error %d)\n", r);
+			usleep(max_wait * 1000);
+		}
+		
+		
+		// Report the completed calls, schedule the retries, and free the finished calls
+		
+		sdb->multi_running = running;
+		sdb_multi_collect(sdb);
+		running = sdb->multi_running;
+		
+		while ((m = sdb->io_finished) != NULL) {
+			sdb->io_finished = m->queue_next;
+			m->queue_next = NULL;
+			sdb_multi_unlink(sdb, m);
+			sdb_multi_free_one(sdb, m);
 		}
 	}
 	
+	sdb->multi_running = 0;
+	return NULL;
+}
+
+
+/**
+ * Start the background I/O thread
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred, or SDB_E_IO_THREAD_FAILED otherwise
+ */
+int sdb_io_thread_create(struct SDB* sdb)
+{
+	if (pipe(sdb->io_wake) != 0) return SDB_E_IO_THREAD_FAILED;
+	
+	fcntl(sdb->io_wake[0], F_SETFL, fcntl(sdb->io_wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sdb->io_wake[1], F_SETFL, fcntl(sdb->io_wake[1], F_GETFL) | O_NONBLOCK);
+	sdb_event_loop_wakeup(&sdb->loop, sdb->io_wake[0]);
+	
+	sdb->io_queue = NULL;
+	sdb->io_finished = NULL;
+	sdb->io_stop = FALSE;
+	sdb->io_running = TRUE;
+	
+	if (pthread_create(&sdb->io_thread, NULL, sdb_io_main, sdb) != 0) {
+		sdb->io_running = FALSE;
+		sdb_event_loop_wakeup(&sdb->loop, -1);
+		close(sdb->io_wake[0]);
+		close(sdb->io_wake[1]);
+		sdb->io_wake[0] = -1;
+		sdb->io_wake[1] = -1;
+		return SDB_E_IO_THREAD_FAILED;
+	}
 	
 	return SDB_OK;
 }
 
 
 /**
- * Execute a command using Curl's multi interface
+ * Let the background I/O thread complete the submitted calls, and wait for it to exit
  * 
  * @param sdb the SimpleDB handle
- * @param cmd the command name
- * @param _params the parameters
- * @param next_token the next token (optional)
- * @param user_data the user data (optional)
- * @param user_data_2 the user data (optional)
- * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
  */
-sdb_multi sdb_execute_multi(struct SDB* sdb, const char* cmd, struct sdb_params* _params, char* next_token, void* user_data, void* user_data_2)
+void sdb_io_thread_join(struct SDB* sdb)
 {
-	// Prepare the command execution
+	char c = 0;
 	
-	struct sdb_params* params = sdb_params_alloc(_params->size + 8);
-	if (SDB_FAILED(sdb_params_add(params, "Action", cmd))) return SDB_MULTI_ERROR;
-	char timestamp[32]; sdb_timestamp(timestamp);
-	if (SDB_FAILED(sdb_params_add(params, "Timestamp", timestamp))) return SDB_MULTI_ERROR;
+	__atomic_store_n(&sdb->io_stop, TRUE, __ATOMIC_RELEASE);
 	
+	ssize_t w = write(sdb->io_wake[1], &c, 1);
+	(void) w;
 	
-	// Add the command parameters
+	pthread_join(sdb->io_thread, NULL);
 	
-	if (SDB_FAILED(sdb_params_add_all(params, _params))) return SDB_MULTI_ERROR;
+	sdb->io_running = FALSE;
+	sdb->io_stop = FALSE;
 	
-	
-	// Add the next token
-	
-	if (next_token != NULL) {
-		if (SDB_FAILED(sdb_params_add(params, "NextToken", next_token))) return SDB_MULTI_ERROR;
+	sdb_event_loop_wakeup(&sdb->loop, -1);
+	close(sdb->io_wake[0]);
+	close(sdb->io_wake[1]);
+	sdb->io_wake[0] = -1;
+	sdb->io_wake[1] = -1;
+}
+
+
+/**
+ * Get the next completed transfer of the last sdb_multi_run_and_wait(), in
+ * the same manner as curl_multi_info_read(). Only the winner of a hedged
+ * read is reported, and the calls with completion callbacks are not.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param remaining the pointer to the number of the remaining messages
+ * @return the message, or NULL if there are no more
+ */
+CURLMsg* sdb_multi_info_read(struct SDB* sdb, int* remaining)
+{
+	if (sdb->next_completed >= sdb->num_completed) {
+		*remaining = 0;
+		return NULL;
 	}
 	
-	
-	// Add the required parameters
-	
-	if (SDB_FAILED(sdb_params_add_required(sdb, params))) return SDB_MULTI_ERROR;
-	char* post = sdb_post(sdb, params);
-	long postsize = strlen(post);
-	sdb_params_free(params);
-	
-	
-	// Allocate a multi-data structure
-	
-	struct sdb_multi_data* m = sdb_multi_alloc(sdb);
-	assert(m);
-	
-	m->post = post;
-	strncpy(m->command, cmd, SDB_LEN_COMMAND - 1);
-	m->command[SDB_LEN_COMMAND - 1] = '\0';
-	m->params = sdb_params_deep_copy(_params);
-	m->user_data = user_data;
-	m->user_data_2 = user_data_2;
-	m->post_size = postsize;
-	
-	
-	// Create a Curl handle and defer it
-	
-	sdb->rec.size = 0;
-	curl_easy_setopt(m->curl, CURLOPT_URL, AWS_URL);
-	curl_easy_setopt(m->curl, CURLOPT_WRITEDATA, &m->rec);
-	curl_easy_setopt(m->curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(m->curl, CURLOPT_POSTFIELDS, post);
-	CURLMcode cr = curl_multi_add_handle(sdb->curl_multi, m->curl);
+	CURLMsg* msg = &sdb->completed[sdb->next_completed++];
+	*remaining = sdb->num_completed - sdb->next_completed;
 	
 	
-	// Handle Curl errors
+	// Start over once all messages were read (the message stays valid until the next collection)
 	
-	if (cr != CURLM_OK) {
-		sdb_multi_free_one(sdb, m);
-		return SDB_MULTI_ERROR;
+	if (*remaining == 0) {
+		sdb->num_completed = 0;
+		sdb->next_completed = 0;
 	}
 	
-	
-	// Statistics (the size statistics would be updated when the response is received)
-	
-	sdb->stat.num_commands++;
-	if (strncmp(cmd, "Put", 3) == 0) sdb->stat.num_puts++;
-	
-	
-	return m->curl;
+	return msg;
 }
 
 
 /**
- * Run all deferred multi calls and wait for the result
+ * Perform a read on the sync handle, racing it against a duplicate sent
+ * after the hedging delay. The loser is cancelled. If the duplicate wins,
+ * its response is swapped into sdb->rec.
  * 
  * @param sdb the SimpleDB handle
- * @return the result
+ * @param delay the hedging delay (ms)
+ * @param phedge the pointer to the data structure of the winning duplicate (set to NULL if the original won),
+ *               which the caller frees with sdb_multi_free_one() after reading its statistics
+ * @return the Curl result
  */
-int sdb_multi_run_and_wait(struct SDB* sdb)
+CURLcode sdb_perform_hedged(struct SDB* sdb, long delay, struct sdb_multi_data** phedge)
 {
-	// This code was inspired by the implementation of readdir() in s3fs by Randy Rizun
+	CURL* primary = sdb->curl_handle;
+	struct sdb_multi_data* h = NULL;
+	CURL* winner = NULL;
+	CURLcode result = CURLE_OK;
+	CURLMsg* msg;
+	int running, remaining, pending = 1, hedged = FALSE;
 	
-	int running, r;
+	*phedge = NULL;
 	
-	while (curl_multi_perform(sdb->curl_multi, &running) == CURLM_CALL_MULTI_PERFORM) usleep(5);
 	
-	while (running) {
-		fd_set read_fd_set;
-		fd_set write_fd_set;
-		fd_set exc_fd_set;
-		
-		FD_ZERO(&read_fd_set);
-		FD_ZERO(&write_fd_set);
-		FD_ZERO(&exc_fd_set);
-		
-		long ms;
-		if ((r = curl_multi_timeout(sdb->curl_multi, &ms)) != CURLM_OK) return SDB_CURLM_ERROR(r);
-		
-		if (ms < 0) ms = 50;
-		if (ms > 0) {
-			struct timeval timeout;
-			timeout.tv_sec = 1000 * ms / 1000000;
-			timeout.tv_usec = 1000 * ms % 1000000;
+	// Create the multi handle for the race
+	
+	if (sdb->hedge_multi == NULL) {
+		sdb->hedge_multi = curl_multi_init();
+		if (sdb->hedge_multi == NULL) return curl_easy_perform(primary);
+		sdb_event_loop_init(&sdb->hedge_loop);
+		sdb_event_loop_attach(&sdb->hedge_loop, sdb->hedge_multi);
+	}
+	
+	if (curl_multi_add_handle(sdb->hedge_multi, primary) != CURLM_OK) return curl_easy_perform(primary);
+	
+	
+	// Run the original, and then both copies until one of them succeeds
+	
+	long long due = monotonic_ms() + delay;
+	int r = sdb_event_loop_start(&sdb->hedge_loop, sdb->hedge_multi, &running);
+	
+	while (SDB_SUCCESS(r) && winner == NULL && pending > 0) {
+		long max_wait = SDB_EVENT_LOOP_MAX_WAIT;
+		
+		if (!hedged) {
+			long long now = monotonic_ms();
+			if (now >= due) {
+				hedged = TRUE;
+				
+				h = sdb_multi_alloc(sdb);
+				sdb_multi_unlink(sdb, h);
+				
+				if (h->curl != NULL) {
+					sdb_target_apply(sdb, h->curl);
+					curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, &h->rec);
+					curl_easy_setopt(h->curl, CURLOPT_POST, 1L);
+					curl_easy_setopt(h->curl, CURLOPT_POSTFIELDS, sdb->post.buffer);
+					curl_easy_setopt(h->curl, CURLOPT_POSTFIELDSIZE, (long) sdb->post.size);
+				}
+				
+				if (h->curl == NULL || SDB_FAILED(sdb_deadline_apply(sdb, h->curl)) || sdb_buffer_reserve(&h->rec, SDB_REC_BUFFER_SIZE) == NULL
+						|| curl_multi_add_handle(sdb->hedge_multi, h->curl) != CURLM_OK) {
+					sdb_multi_free_one(sdb, h);
+					h = NULL;
+				}
+				else {
+					sdb->stat.num_hedges++;
+					pending++;
+				}
+				continue;
+			}
+			else if (due - now < max_wait) {
+				max_wait = (long) (due - now);
+			}
+		}
+		
+		r = sdb_event_loop_step(&sdb->hedge_loop, sdb->hedge_multi, max_wait, &running);
+		
+		while ((msg = curl_multi_info_read(sdb->hedge_multi, &remaining)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			pending--;
 			
-			int max_fd;
-			if ((r = curl_multi_fdset(sdb->curl_multi, &read_fd_set, &write_fd_set, &exc_fd_set, &max_fd)) != CURLM_OK) return SDB_CURLM_ERROR(r);
+			if (msg->data.result == CURLE_OK) {
+				winner = msg->easy_handle;
+				break;
+			}
 			
-			if (select(max_fd + 1, &read_fd_set, &write_fd_set, &exc_fd_set, &timeout) == -1) return SDB_E_FD_ERROR;
+			result = msg->data.result;
 		}
+	}
+	
+	
+	// Cancel the loser
+	
+	curl_multi_remove_handle(sdb->hedge_multi, primary);
+	
+	if (h != NULL) {
+		curl_multi_remove_handle(sdb->hedge_multi, h->curl);
 		
-		while (curl_multi_perform(sdb->curl_multi, &running) == CURLM_CALL_MULTI_PERFORM) usleep(5);
+		if (winner != NULL && winner == h->curl) {
+			struct sdb_buffer b = sdb->rec;
+			sdb->rec = h->rec;
+			h->rec = b;
+			
+			sdb->stat.num_hedges_won++;
+			*phedge = h;
+		}
+		else {
+			sdb_multi_free_one(sdb, h);
+		}
 	}
 	
-	return SDB_OK;
+	
+	// Fall back to a plain request if the event loop failed
+	
+	if (SDB_FAILED(r) && winner == NULL) {
+		sdb->rec.size = 0;
+		return curl_easy_perform(primary);
+	}
+	
+	return winner != NULL ? CURLE_OK : result;
 }
 
 
@@ -1087,6 +5223,7 @@ int sdb_parse_result(struct SDB* sdb, CURL* curl, long post_size, struct sdb_buf
 	// Statistics
 	
 	sdb_update_size_stats(sdb, curl, post_size, rec->size);
+	sdb_update_connection_stats(sdb, curl);
 	
 	
 	// Handle internal errors
@@ -1164,7 +5301,7 @@ void sdb_update_size_stats(struct SDB* sdb, CURL* curl, long post_size, long rec
 	sdb->stat.bytes_received += rec_size;
 	sdb->stat.http_overhead_received += sdb_estimate_http_received(sdb, rec_size);
 	
-	if (post_size > TINY_INITIAL_POST_SIZE) {
+	if (post_size > TINY_INITIAL_POST_SIZE && sdb->transport_profile != SDB_TRANSPORT_LOW_LATENCY) {
 		sdb->stat.http_overhead_sent += 22;
 		sdb->stat.http_overhead_received += 25;
 	}
@@ -1189,6 +5326,33 @@ void sdb_update_size_stats(struct SDB* sdb, CURL* curl, long post_size, long rec
 	sdb->stat.bytes_received += rec_size;
 	sdb->stat.http_overhead_received += http_received;
 #endif
+	
+	
+	// The response body as transferred, i.e. before decompression
+	
+	curl_off_t wire_size;
+	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire_size) == CURLE_OK) {
+		sdb->stat.bytes_received_wire += wire_size;
+	}
+	else {
+		sdb->stat.bytes_received_wire += rec_size;
+	}
+}
+
+
+/**
+ * Update the connection statistics after a transfer
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle of the transfer
+ */
+void sdb_update_connection_stats(struct SDB* sdb, CURL* curl)
+{
+	long n;
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &n) != CURLE_OK) return;
+	
+	sdb->stat.num_connections += n;
+	if (n == 0) sdb->stat.num_reused_connections++;
 }
 
 
@@ -1202,11 +5366,16 @@ void sdb_add_statistics(struct sdb_statistics* a, const struct sdb_statistics* b
 {
 	a->bytes_sent				+= b->bytes_sent;
 	a->bytes_received			+= b->bytes_received;
+	a->bytes_received_wire		+= b->bytes_received_wire;
 	a->http_overhead_sent		+= b->http_overhead_sent;
 	a->http_overhead_received	+= b->http_overhead_received;
 	a->num_commands				+= b->num_commands;
 	a->num_puts					+= b->num_puts;
 	a->num_retries				+= b->num_retries;
+	a->num_connections			+= b->num_connections;
+	a->num_reused_connections	+= b->num_reused_connections;
+	a->num_hedges				+= b->num_hedges;
+	a->num_hedges_won			+= b->num_hedges_won;
 	a->box_usage				+= b->box_usage;
 }
 
@@ -35,6 +35,7 @@
 #include "stdafx.h"
 #include "sdb.h"
 #include "sdb_private.h"
+#include "base64.h"
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -46,6 +47,7 @@
 #include <openssl/buffer.h>
 
 #include <unistd.h>
+#include <sys/time.h>
 
 static int sdb_initialized = FALSE;
 
@@ -72,6 +74,13 @@ int sdb_global_init(void)
 	// Initialize Curl
 
 	if (curl_global_init(CURL_GLOBAL_NOTHING) != 0) return SDB_E_CURL_INIT_FAILED;
+	SDB_SAFE(sdb_global_share_init());
+
+
+	// Select the SIMD kernels for this CPU
+
+	sdb_escape_init();
+	base64_init();
 
 
 	// Initialize global statistics
@@ -100,6 +109,7 @@ int sdb_global_cleanup(void)
 
 	// Cleanup Curl
 
+	sdb_global_share_cleanup();
 	curl_global_cleanup();
 
 
@@ -129,6 +139,20 @@ int sdb_init(struct SDB** sdb, const char* key, const char* secret)
 }
 
 
+/**
+ * Destroy a partially initialized handle
+ *
+ * @param sdb a pointer to the SimpleDB handle
+ * @param r the error code
+ * @return the error code
+ */
+static int sdb_init_failed(struct SDB** sdb, int r)
+{
+	sdb_destroy(sdb);
+	return r;
+}
+
+
 /**
  * Initialize the environment
  *
@@ -147,10 +171,23 @@ int sdb_init_ext(struct SDB** sdb, const char* key, const char* secret, const ch
 	assert(key != NULL);
 	assert(secret != NULL);
 
+	size_t l;
+	char* prefix = sdb_sign_prefix(service, &l);
+	if (prefix == NULL) return SDB_E_INVALID_URL;
+	free(prefix);
 
-	// Allocate the SDB handle
+	int r;
+
+
+	// Allocate the SDB handle, clearing it and setting up the resources that
+	// cannot fail first, so that sdb_destroy() can clean up after any error
 
 	*sdb = (struct SDB*) malloc(sizeof(struct SDB));
+	memset(*sdb, 0, sizeof(struct SDB));
+
+	sdb_event_loop_init(&(*sdb)->loop);
+	pthread_mutex_init(&(*sdb)->io_lock, NULL);
+	pthread_cond_init(&(*sdb)->io_done, NULL);
 
 
 	// Copy arguments
@@ -161,26 +198,70 @@ int sdb_init_ext(struct SDB** sdb, const char* key, const char* secret, const ch
 	(*sdb)->sdb_key_len = strlen(key);
 	(*sdb)->sdb_secret_len = strlen(secret);
 	
-	(*sdb)->aws_url = strdup(key);
+	(*sdb)->aws_url = NULL;
+	(*sdb)->sign_prefix = NULL;
+	(*sdb)->multiplexing = FALSE;
+	(*sdb)->http_version = CURL_HTTP_VERSION_NONE;
+	(*sdb)->compression = FALSE;
+
+	(*sdb)->connect_timeout = SDB_DEFAULT_CONNECT_TIMEOUT;
+	(*sdb)->request_timeout = 0;
+	(*sdb)->stall_timeout = SDB_DEFAULT_STALL_TIMEOUT;
+	(*sdb)->call_timeout = 0;
+	(*sdb)->deadline = 0;
+	(*sdb)->deadline_depth = 0;
+	(*sdb)->max_idle_connections = 0;
+
+	(*sdb)->dns_pinning = FALSE;
+	(*sdb)->dns_interval = 0;
+	(*sdb)->dns_next_refresh = 0;
+	(*sdb)->dns_job = NULL;
+	(*sdb)->dns_pins = NULL;
+	(*sdb)->num_dns_pins = 0;
+	(*sdb)->dns_next = 0;
+	(*sdb)->dns_retired = NULL;
+	(*sdb)->num_dns_retired = 0;
+	(*sdb)->dns_unpin = NULL;
+	(*sdb)->dns_unpin_pending = FALSE;
+	if (SDB_FAILED(r = sdb_endpoint_set(*sdb, service))) return sdb_init_failed(sdb, r);
+
+	(*sdb)->endpoints = NULL;
+	(*sdb)->num_endpoints = 0;
+	(*sdb)->endpoint_interval = 0;
+	(*sdb)->endpoint_next_probe = 0;
+	(*sdb)->probe_job = NULL;
 
 
 	// Set the HTTP headers
 
-	(*sdb)->curl_headers = NULL;
-	(*sdb)->curl_headers = curl_slist_append((*sdb)->curl_headers, SDB_HTTP_HEADER_CONTENT_TYPE);
+	(*sdb)->transport_profile = SDB_TRANSPORT_DEFAULT;
+	(*sdb)->curl_headers = sdb_headers_create((*sdb)->transport_profile);
 
 
 	// Initialize Curl
 
+	(*sdb)->share_process_wide = FALSE;
+	(*sdb)->curl_share = sdb_share_create(FALSE);
+	if ((*sdb)->curl_share == NULL) return sdb_init_failed(sdb, SDB_E_CURL_INIT_FAILED);
+
 	(*sdb)->curl_handle = sdb_create_curl(*sdb);
-	if ((*sdb)->curl_handle == NULL) return SDB_E_CURL_INIT_FAILED;
+	if ((*sdb)->curl_handle == NULL) return sdb_init_failed(sdb, SDB_E_CURL_INIT_FAILED);
 
 	(*sdb)->curl_multi = curl_multi_init();
-	if ((*sdb)->curl_multi == NULL) return SDB_E_CURL_INIT_FAILED;
+	if ((*sdb)->curl_multi == NULL) return sdb_init_failed(sdb, SDB_E_CURL_INIT_FAILED);
+
+	(*sdb)->socket_hook = NULL;
+	(*sdb)->timer_hook = NULL;
+	(*sdb)->hook_data = NULL;
+	sdb_multi_attach(*sdb);
 
 
 	// Allocate the buffers
 
+	(*sdb)->post.capacity = SDB_POST_BUFFER_SIZE;
+	(*sdb)->post.size = 0;
+	(*sdb)->post.buffer = (char*) malloc((*sdb)->post.capacity);
+
 	(*sdb)->rec.capacity = 64 * 1024;
 	(*sdb)->rec.size = 0;
 	(*sdb)->rec.buffer = (char*) malloc((*sdb)->rec.capacity);
@@ -192,12 +273,48 @@ int sdb_init_ext(struct SDB** sdb, const char* key, const char* secret, const ch
 	(*sdb)->sdb_signature_ver_str[0] = '0' + (*sdb)->sdb_signature_ver;
 	(*sdb)->sdb_signature_ver_str[1] = '\0';
 
+	(*sdb)->sdb_hmac = NULL;
+	if (SDB_FAILED(sdb_sign_init(*sdb))) return sdb_init_failed(sdb, SDB_E_OPEN_SSL_FAILED);
+
+	(*sdb)->key_fragment.text = NULL;
+	if (SDB_FAILED(r = sdb_template_init(*sdb))) return sdb_init_failed(sdb, r);
+
 	(*sdb)->multi = NULL;
 	(*sdb)->multi_free = NULL;
 	(*sdb)->multi_free_size = 0;
 
+	(*sdb)->multi_window = 0;
+	(*sdb)->multi_running = 0;
+	(*sdb)->queue_head = NULL;
+	(*sdb)->queue_tail = NULL;
+	(*sdb)->num_queued = 0;
+
+	(*sdb)->multi_callback = NULL;
+	(*sdb)->multi_callback_data = NULL;
+
+	(*sdb)->io_running = FALSE;
+	(*sdb)->io_stop = FALSE;
+	(*sdb)->io_queue = NULL;
+	(*sdb)->io_finished = NULL;
+	(*sdb)->io_wake[0] = -1;
+	(*sdb)->io_wake[1] = -1;
+
+	(*sdb)->completed = NULL;
+	(*sdb)->num_completed = 0;
+	(*sdb)->next_completed = 0;
+	(*sdb)->completed_capacity = 0;
+
+	(*sdb)->hedge_delay = 0;
+	(*sdb)->hedge_percentile = 0;
+	(*sdb)->num_hedge_samples = 0;
+	(*sdb)->hedge_multi = NULL;
+
 	(*sdb)->retry_count = 10;
 	(*sdb)->retry_delay = 5000;		/* = 5 ms */
+	(*sdb)->retry_max_delay = SDB_DEFAULT_RETRY_MAX_DELAY;
+	(*sdb)->retry_seed = (unsigned) time(NULL) ^ (unsigned) getpid();
+	(*sdb)->retry_head = NULL;
+	(*sdb)->retry_tail = NULL;
 
 	(*sdb)->errout = NULL;
 	(*sdb)->dump_on_error = 0;
@@ -220,6 +337,11 @@ int sdb_destroy(struct SDB** sdb)
 	if (sdb == NULL || *sdb == NULL) return SDB_OK;
 
 
+	// Finish the calls of the background I/O thread
+
+	sdb_stop_io_thread(*sdb);
+
+
 	// Update the global statistics (note that this is not yet thread safe)
 
 	sdb_add_statistics(&sdb_global_stat, &(*sdb)->stat);
@@ -230,10 +352,16 @@ int sdb_destroy(struct SDB** sdb)
 	SAFE_FREE((*sdb)->sdb_key);
 	SAFE_FREE((*sdb)->sdb_secret);
 	SAFE_FREE((*sdb)->aws_url);
+	SAFE_FREE((*sdb)->sign_prefix);
+	sdb_endpoint_cleanup(*sdb);
+
+	sdb_sign_cleanup(*sdb);
+	sdb_template_cleanup(*sdb);
 
 
 	// Buffer cleanup
 
+	SAFE_FREE((*sdb)->post.buffer);
 	SAFE_FREE((*sdb)->rec.buffer);
 
 
@@ -241,6 +369,22 @@ int sdb_destroy(struct SDB** sdb)
 
 	sdb_multi_destroy(*sdb, (*sdb)->multi);
 	sdb_multi_destroy(*sdb, (*sdb)->multi_free);
+	(*sdb)->multi = NULL;
+
+	sdb_dns_wait(*sdb);
+	sdb_dns_cleanup(*sdb);
+	SAFE_FREE((*sdb)->dns_retired);
+	if ((*sdb)->dns_unpin != NULL) curl_slist_free_all((*sdb)->dns_unpin);
+	SAFE_FREE((*sdb)->completed);
+
+	pthread_mutex_destroy(&(*sdb)->io_lock);
+	pthread_cond_destroy(&(*sdb)->io_done);
+
+	if ((*sdb)->hedge_multi != NULL) {
+		curl_multi_cleanup((*sdb)->hedge_multi);
+		sdb_event_loop_cleanup(&(*sdb)->hedge_loop);
+		(*sdb)->hedge_multi = NULL;
+	}
 
 	if ((*sdb)->curl_headers != NULL) {
 		curl_slist_free_all((*sdb)->curl_headers);
@@ -257,6 +401,13 @@ int sdb_destroy(struct SDB** sdb)
 		(*sdb)->curl_multi = NULL;
 	}
 
+	sdb_event_loop_cleanup(&(*sdb)->loop);
+
+	if ((*sdb)->curl_share != NULL) {
+		curl_share_cleanup((*sdb)->curl_share);
+		(*sdb)->curl_share = NULL;
+	}
+
 
 	// Handle cleanup
 
@@ -357,6 +508,33 @@ int sdb_multi_count_errors(struct sdb_multi_response* response)
 }
 
 
+/**
+ * Decode a binary attribute value (stored using sdb_put_binary or sdb_replace_binary)
+ *
+ * @param value the base64-encoded value from the response
+ * @param data a pointer to the place to store the decoded data (must be freed by the caller)
+ * @param length a pointer to the place to store the length of the data
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_decode_binary(const char* value, void** data, size_t* length)
+{
+	size_t l = strlen(value);
+
+	*data = malloc(BASE64_DECODED_LENGTH(l) + 1);
+	*length = 0;
+
+	int r = decode64(value, (char*) *data, (int) l);
+	if (r < 0) {
+		free(*data);
+		*data = NULL;
+		return SDB_E_INVALID_BINARY_VALUE;
+	}
+
+	*length = r;
+	return SDB_OK;
+}
+
+
 /**
  * Return the collected statistics
  *
@@ -381,6 +559,7 @@ void sdb_fprint_statistics(struct SDB* sdb, FILE* f)
 
 	fprintf(f, "Data Sent (bytes)                      : %lld (%0.2lf MB)\n", s->bytes_sent, (double) s->bytes_sent / 1048576.0);
 	fprintf(f, "Data Received (bytes)                  : %lld (%0.2lf MB)\n", s->bytes_received, (double) s->bytes_received / 1048576.0);
+	fprintf(f, "Data Received on the wire (bytes)      : %lld (%0.2lf MB)\n", s->bytes_received_wire, (double) s->bytes_received_wire / 1048576.0);
 	fprintf(f, "HTTP Overhead Sent (bytes)             : %lld (%0.2lf MB)\n", s->http_overhead_sent, (double) s->http_overhead_sent / 1048576.0);
 	fprintf(f, "HTTP Overhead Received (bytes)         : %lld (%0.2lf MB)\n", s->http_overhead_received, (double) s->http_overhead_received / 1048576.0);
 	fprintf(f, "Total bytes sent                       : %lld (%0.2lf MB)\n", s->http_overhead_sent + s->bytes_sent, (double) (s->http_overhead_sent + s->bytes_sent) / 1048576.0);
@@ -388,6 +567,10 @@ void sdb_fprint_statistics(struct SDB* sdb, FILE* f)
 	fprintf(f, "Total number of PutAttributes commands : %lld\n", s->num_puts);
 	fprintf(f, "Total number of commands sent          : %lld\n", s->num_commands);
 	fprintf(f, "Total number of retries                : %lld\n", s->num_retries);
+	fprintf(f, "Total number of new connections        : %lld\n", s->num_connections);
+	fprintf(f, "Requests over reused connections       : %lld\n", s->num_reused_connections);
+	fprintf(f, "Hedged reads sent                      : %lld\n", s->num_hedges);
+	fprintf(f, "Hedged reads won                       : %lld\n", s->num_hedges_won);
 	fprintf(f, "Total box usage                        : %lf\n" , (double) s->box_usage);
 }
 
@@ -430,7 +613,10 @@ void sdb_set_error_file(struct SDB* sdb, FILE* f)
 
 
 /**
- * Set the retry configuration
+ * Set the retry configuration. A multi call is retried on its own, while
+ * the other calls keep running, after a delay that starts at the given
+ * delay and doubles with every retry (with random jitter), up to the
+ * maximum set by sdb_set_retry_max_delay().
  *
  * @param sdb the SimpleDB handle
  * @param count the maximum number of retries
@@ -446,6 +632,127 @@ void sdb_set_retry(struct SDB* sdb, int count, int delay)
 }
 
 
+/**
+ * Set the maximum delay of the exponential backoff between the retries of
+ * a multi call
+ *
+ * @param sdb the SimpleDB handle
+ * @param max_delay the maximum delay in milliseconds
+ */
+void sdb_set_retry_max_delay(struct SDB* sdb, long max_delay)
+{
+	sdb->retry_max_delay = max_delay < 0 ? 0 : max_delay;
+}
+
+
+/**
+ * Set the timeouts of every request: connecting, the whole transfer, and
+ * a stalled transfer (no data for the given time). A request that times
+ * out fails with SDB_CURL_ERROR(CURLE_OPERATION_TIMEDOUT).
+ *
+ * @param sdb the SimpleDB handle
+ * @param connect_timeout the connect timeout in milliseconds (0 = none)
+ * @param request_timeout the transfer timeout in milliseconds (0 = none)
+ * @param stall_timeout how long a transfer may receive less than a byte per second, in milliseconds (0 = none)
+ */
+void sdb_set_timeouts(struct SDB* sdb, long connect_timeout, long request_timeout, long stall_timeout)
+{
+	struct sdb_multi_data* m;
+
+	sdb->connect_timeout = connect_timeout < 0 ? 0 : connect_timeout;
+	sdb->request_timeout = request_timeout < 0 ? 0 : request_timeout;
+	sdb->stall_timeout = stall_timeout < 0 ? 0 : stall_timeout;
+
+
+	// Apply them to the existing handles (new handles pick them up in sdb_create_curl)
+
+	sdb_timeouts_apply(sdb, sdb->curl_handle);
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		sdb_timeouts_apply(sdb, m->curl);
+	}
+	for (m = sdb->multi_free; m != NULL; m = m->next) {
+		sdb_timeouts_apply(sdb, m->curl);
+	}
+}
+
+
+/**
+ * Set the deadline of each call, which covers all of its requests including
+ * the retries and the automatic NEXT requests. For the multi interface, the
+ * deadline starts in sdb_multi_run(), or when the call is made if the
+ * background I/O thread runs. A call that misses its deadline fails
+ * with SDB_E_DEADLINE_EXCEEDED.
+ *
+ * @param sdb the SimpleDB handle
+ * @param timeout the deadline in milliseconds after the start of a call (0 = none)
+ */
+void sdb_set_call_timeout(struct SDB* sdb, long timeout)
+{
+	sdb->call_timeout = timeout < 0 ? 0 : timeout;
+}
+
+
+/**
+ * Enable hedged reads: a GetAttributes or Select request (sync or multi)
+ * that has not completed within the hedging delay is sent once more, the
+ * first successful response wins and the other request is cancelled. The
+ * delay is either fixed, or the given percentile of the recently observed
+ * read latencies (the fixed delay is used until enough of them are known).
+ * Hedging does not apply to multi calls driven by the event loop hooks.
+ *
+ * @param sdb the SimpleDB handle
+ * @param delay the hedging delay in milliseconds (0 = none)
+ * @param percentile the latency percentile to use as the delay, such as 95 (0 = use the fixed delay only)
+ */
+void sdb_set_hedging(struct SDB* sdb, long delay, int percentile)
+{
+	sdb->hedge_delay = delay < 0 ? 0 : delay;
+	sdb->hedge_percentile = percentile < 0 ? 0 : (percentile > 100 ? 100 : percentile);
+}
+
+
+/**
+ * Limit the number of multi calls in flight. The calls over the limit wait
+ * in a queue and start, in the order in which they were made, as soon as
+ * the calls in flight complete, so that a very large batch of multi calls
+ * keeps a steady number of transfers and does not allocate the receive
+ * buffers of all calls at once. With the event loop hooks, the number of
+ * the running calls reported by sdb_multi_socket_action() includes the
+ * queued calls.
+ *
+ * @param sdb the SimpleDB handle
+ * @param window the maximum number of the multi calls in flight (0 = no limit)
+ */
+void sdb_set_multi_window(struct SDB* sdb, int window)
+{
+	sdb->multi_window = window < 0 ? 0 : window;
+}
+
+
+/**
+ * Set the completion callback of the multi calls made from now on, so that
+ * their responses can be processed while the other calls are still in
+ * flight. The callback runs inside sdb_multi_run(), or inside
+ * sdb_multi_socket_action() with the event loop hooks, or in the background
+ * I/O thread, once the call and all its retries and automatic NEXT requests
+ * are done. Such calls are not
+ * included in the response of sdb_multi_run(). A batch split into several
+ * requests reports each of them with the same handle (the requests of the
+ * batches split by synchronous calls are not reported). The callback may make
+ * new multi calls, but it must not call sdb_multi_run() or
+ * sdb_multi_socket_action().
+ *
+ * @param sdb the SimpleDB handle
+ * @param callback the completion callback (NULL = report the calls in the response of sdb_multi_run())
+ * @param data the user data passed to the callback
+ */
+void sdb_set_multi_callback(struct SDB* sdb, sdb_multi_callback callback, void* data)
+{
+	sdb->multi_callback = callback;
+	sdb->multi_callback_data = callback == NULL ? NULL : data;
+}
+
+
 /**
  * Set automatic handling of the NEXT tokens
  *
@@ -459,16 +766,67 @@ void sdb_set_auto_next(struct SDB* sdb, int value)
 
 
 /**
- * Enable gzip Content-Encoding for all service requests.
+ * Enable gzip Content-Encoding for all service requests, both synchronous
+ * and multi. The statistics then show the response bytes before
+ * (bytes_received_wire) and after (bytes_received) decompression.
  *
  * @param sdb the SimpleDB handle
- * @param value zero disabled gzip encoding, a non-zero value enables it
+ * @param value zero disables gzip encoding, a non-zero value enables it
  */
 void sdb_set_compression(struct SDB* sdb, int value)
 {
-	if (value > 0) {
-		curl_easy_setopt(sdb->curl_handle, CURLOPT_ENCODING, "gzip");
+	struct sdb_multi_data* m;
+
+	sdb->compression = value == 0 ? FALSE : TRUE;
+
+
+	// Apply it to the existing handles (new handles pick it up in sdb_create_curl)
+
+	const char* encoding = sdb->compression ? SDB_HTTP_ENCODING : NULL;
+
+	curl_easy_setopt(sdb->curl_handle, CURLOPT_ENCODING, encoding);
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		curl_easy_setopt(m->curl, CURLOPT_ENCODING, encoding);
+	}
+	for (m = sdb->multi_free; m != NULL; m = m->next) {
+		curl_easy_setopt(m->curl, CURLOPT_ENCODING, encoding);
+	}
+}
+
+/**
+ * Set the transport profile of all service requests. The low-latency profile
+ * saves round trips: it sends the request bodies larger than what Curl sends
+ * without asking (1 KB or 1 MB, depending on the Curl version) right away
+ * instead of waiting for "100 Continue", disables Nagle's algorithm, keeps
+ * the idle connections alive with TCP keepalive probes, and uses TCP Fast
+ * Open where the platform supports it.
+ *
+ * @param sdb the SimpleDB handle
+ * @param profile SDB_TRANSPORT_DEFAULT or SDB_TRANSPORT_LOW_LATENCY
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_transport_profile(struct SDB* sdb, int profile)
+{
+	struct sdb_multi_data* m;
+
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+
+	sdb->transport_profile = profile == SDB_TRANSPORT_LOW_LATENCY ? SDB_TRANSPORT_LOW_LATENCY : SDB_TRANSPORT_DEFAULT;
+
+
+	// Replace the headers and apply the profile to the existing handles
+
+	struct curl_slist* old_headers = sdb->curl_headers;
+	sdb->curl_headers = sdb_headers_create(sdb->transport_profile);
+
+	sdb_transport_apply(sdb, sdb->curl_handle);
+	for (m = sdb->multi_free; m != NULL; m = m->next) {
+		sdb_transport_apply(sdb, m->curl);
 	}
+
+	curl_slist_free_all(old_headers);
+
+	return SDB_OK;
 }
 
 /**
@@ -490,9 +848,360 @@ void sdb_set_useragent(struct SDB* sdb, const char* ua)
 }
 
 
+/**
+ * Set the service endpoint (this also discards the endpoint set, if any).
+ * The host and the path used in the request signatures are derived from the URL.
+ *
+ * @param sdb the SimpleDB handle
+ * @param url the service URL, such as "https://sdb.eu-west-1.amazonaws.com"
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_set_endpoint(struct SDB* sdb, const char* url)
+{
+	SDB_SAFE(sdb_endpoint_set(sdb, url));
+	sdb_endpoint_cleanup(sdb);
+
+	return SDB_OK;
+}
+
+
+/**
+ * Set the endpoints to choose from. The round-trip time to each of them is
+ * measured right away and then every interval seconds, and the requests are
+ * sent to the closest one. The periodic measurements run in a background
+ * thread, so the requests keep going to the current endpoint until they
+ * complete. The endpoints must serve the same data (e.g. local proxies of
+ * a single region), since a handle can switch between them.
+ *
+ * @param sdb the SimpleDB handle
+ * @param num the number of endpoints
+ * @param urls the service URLs
+ * @param interval the number of seconds between re-evaluations (0 = never re-evaluate)
+ * @return SDB_OK if no errors occurred, SDB_E_NO_ENDPOINT if none of the endpoints can be reached
+ */
+int sdb_set_endpoints(struct SDB* sdb, size_t num, const char** urls, int interval)
+{
+	size_t i, l;
+
+
+	// Validate the URLs
+
+	for (i = 0; i < num; i++) {
+		char* prefix = sdb_sign_prefix(urls[i], &l);
+		if (prefix == NULL) return SDB_E_INVALID_URL;
+		free(prefix);
+	}
+
+
+	// Replace the endpoint set
+
+	sdb_endpoint_cleanup(sdb);
+	if (num == 0) return SDB_OK;
+
+	sdb->endpoints = (struct sdb_endpoint*) malloc(sizeof(struct sdb_endpoint) * num);
+	for (i = 0; i < num; i++) {
+		sdb->endpoints[i].url = strdup(urls[i]);
+		sdb->endpoints[i].rtt = -1;
+	}
+
+	sdb->num_endpoints = num;
+	sdb->endpoint_interval = interval < 0 ? 0 : interval;
+
+	return sdb_endpoint_probe(sdb);
+}
+
+
+/**
+ * Resolve the service host once and pin its addresses for all requests
+ * (CURLOPT_RESOLVE), so that new connections do not wait for DNS lookups
+ * and a resolver outage does not fail requests. The requests rotate through
+ * the addresses, so the connections spread across them. The addresses are
+ * refreshed every interval seconds in a background thread, started by the
+ * first call after the interval passes; the requests keep using the old
+ * addresses until the lookup completes, and if it fails.
+ *
+ * @param sdb the SimpleDB handle
+ * @param enable zero disables pinning, a non-zero value enables it
+ * @param interval the number of seconds between refreshes (0 = never refresh)
+ * @return SDB_OK if no errors occurred, SDB_E_RESOLVE_FAILED if the host cannot be resolved
+ */
+int sdb_set_dns_pinning(struct SDB* sdb, int enable, int interval)
+{
+	sdb->dns_interval = interval < 0 ? 0 : interval;
+
+	if (!enable) {
+		if (sdb->dns_pinning) sdb_dns_unpin(sdb);
+		sdb->dns_pinning = FALSE;
+		return SDB_OK;
+	}
+
+	sdb->dns_pinning = TRUE;
+	sdb->dns_unpin_pending = FALSE;
+
+	return sdb_dns_refresh(sdb);
+}
+
+
+/**
+ * Choose the scope of the connection, DNS and TLS session cache. By default,
+ * the synchronous and the multi calls of a handle share one cache; making
+ * it process-wide lets all handles (in any thread) reuse each other's
+ * connections and TLS sessions.
+ *
+ * @param sdb the SimpleDB handle
+ * @param process_wide zero for a per-handle cache, a non-zero value for the process-wide one
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_shared_cache(struct SDB* sdb, int process_wide)
+{
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+
+	sdb->share_process_wide = process_wide == 0 ? FALSE : TRUE;
+
+
+	// Switch the sync handle and all idle multi handles
+
+	struct sdb_multi_data* m;
+	CURLSH* share = sdb_share_get(sdb);
+
+	curl_easy_setopt(sdb->curl_handle, CURLOPT_SHARE, share);
+	for (m = sdb->multi_free; m != NULL; m = m->next) {
+		curl_easy_setopt(m->curl, CURLOPT_SHARE, share);
+	}
+
+	return SDB_OK;
+}
+
+
+/**
+ * Enable HTTP/2 multiplexing of the multi calls, so that many concurrent
+ * requests share a few connections. Over TLS, HTTP/2 is negotiated for each
+ * connection; over cleartext (e.g. with a local proxy), the endpoint is probed
+ * for HTTP/2 right away. Either way, the requests fall back to HTTP/1.1 if
+ * the server does not speak HTTP/2.
+ *
+ * @param sdb the SimpleDB handle
+ * @param enable zero disables multiplexing, a non-zero value enables it
+ * @param max_connections the maximum number of HTTP/2 connections to the endpoint (0 = no limit)
+ * @param max_streams the maximum number of concurrent requests per connection (0 = the Curl default)
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet
+ */
+int sdb_set_multiplexing(struct SDB* sdb, int enable, long max_connections, long max_streams)
+{
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+
+	sdb->multiplexing = enable == 0 ? FALSE : TRUE;
+
+
+	// Configure the multi handle
+
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_PIPELINING, sdb->multiplexing ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_MAX_HOST_CONNECTIONS, sdb->multiplexing && max_connections > 0 ? max_connections : 0L);
+#if LIBCURL_VERSION_NUM >= 0x074300
+	curl_multi_setopt(sdb->curl_multi, CURLMOPT_MAX_CONCURRENT_STREAMS, sdb->multiplexing && max_streams > 0 ? max_streams : 100L);
+#endif
+
+
+	// Choose the HTTP version (the easy handles pick it up with the URL of the next request)
+
+	sdb->http_version = sdb->multiplexing ? sdb_http_version_probe(sdb->aws_url, sdb_share_get(sdb)) : CURL_HTTP_VERSION_NONE;
+
+	return SDB_OK;
+}
+
+
+/**
+ * Open connections to the service endpoint ahead of the first requests, so
+ * that they do not pay for the DNS lookup and the TCP and TLS handshakes.
+ * The sync handle and n - 1 pooled multi handles each send a HEAD request in
+ * parallel; the connections are then kept alive in the connection cache.
+ *
+ * @param sdb the SimpleDB handle
+ * @param n the number of connections to open
+ * @param pelapsed the pointer to the warm-up time in seconds (can be NULL)
+ * @return SDB_OK if no errors occurred, or the first error otherwise
+ */
+int sdb_warmup(struct SDB* sdb, int n, double* pelapsed)
+{
+	struct timeval start, end;
+	struct sdb_multi_data* m;
+	int i;
+
+	if (pelapsed != NULL) *pelapsed = 0;
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+	if (n <= 0) return SDB_OK;
+
+	gettimeofday(&start, NULL);
+	sdb_endpoint_update(sdb);
+
+
+	// Keep at least n idle connections in the cache
+
+	if (n > sdb->max_idle_connections) {
+		sdb->max_idle_connections = n;
+		curl_easy_setopt(sdb->curl_handle, CURLOPT_MAXCONNECTS, (long) n);
+		curl_multi_setopt(sdb->curl_multi, CURLMOPT_MAXCONNECTS, (long) n);
+	}
+
+
+	// Send a HEAD request from the sync handle and from n - 1 multi handles
+
+	for (i = 1; i < n; i++) {
+		m = sdb_multi_alloc(sdb);
+		if (m->curl == NULL) {
+			sdb_multi_free_chain(sdb, sdb->multi);
+			sdb->multi = NULL;
+			return SDB_E_CURL_INIT_FAILED;
+		}
+	}
+
+	sdb_target_apply(sdb, sdb->curl_handle);
+	curl_easy_setopt(sdb->curl_handle, CURLOPT_NOBODY, 1L);
+	curl_multi_add_handle(sdb->curl_multi, sdb->curl_handle);
+
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		sdb_target_apply(sdb, m->curl);
+		curl_easy_setopt(m->curl, CURLOPT_NOBODY, 1L);
+		curl_multi_add_handle(sdb->curl_multi, m->curl);
+	}
+
+	int r = sdb_multi_run_and_wait(sdb);
+
+
+	// Collect the results (the HTTP status does not matter)
+
+	CURLMsg* msg;
+	int remaining;
+
+	while ((msg = sdb_multi_info_read(sdb, &remaining)) != NULL) {
+		if (msg->msg != CURLMSG_DONE) continue;
+
+		if (msg->data.result == CURLE_OK) {
+			sdb_update_connection_stats(sdb, msg->easy_handle);
+		}
+		else if (r == SDB_OK) {
+			r = SDB_CURL_ERROR(msg->data.result);
+		}
+	}
+
+
+	// Return the handles to their idle state
+
+	curl_multi_remove_handle(sdb->curl_multi, sdb->curl_handle);
+	curl_easy_setopt(sdb->curl_handle, CURLOPT_NOBODY, 0L);
+
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		curl_easy_setopt(m->curl, CURLOPT_NOBODY, 0L);
+	}
+
+	sdb_multi_free_chain(sdb, sdb->multi);
+	sdb->multi = NULL;
+
+	gettimeofday(&end, NULL);
+	if (pelapsed != NULL) {
+		*pelapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	}
+
+	return r;
+}
+
+
+/**
+ * Drive the multi calls from an existing event loop (such as libevent, libuv
+ * or epoll) instead of blocking in sdb_multi_run(). The hooks tell the loop
+ * which sockets to watch and when to fire the timer; the loop then reports
+ * the ready sockets and the expired timer to sdb_multi_socket_action().
+ * Both hooks must be set to enable this; NULL hooks restore the built-in
+ * event loop.
+ *
+ * @param sdb the SimpleDB handle
+ * @param socket_hook the socket interest hook
+ * @param timer_hook the timer hook
+ * @param data the user data passed to the hooks
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet,
+ *         or SDB_E_IO_THREAD_RUNNING if the background I/O thread runs
+ */
+int sdb_set_event_hooks(struct SDB* sdb, sdb_socket_hook socket_hook, sdb_timer_hook timer_hook, void* data)
+{
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+
+	if (socket_hook == NULL || timer_hook == NULL) {
+		socket_hook = NULL;
+		timer_hook = NULL;
+		data = NULL;
+	}
+
+	sdb->socket_hook = socket_hook;
+	sdb->timer_hook = timer_hook;
+	sdb->hook_data = data;
+
+	return SDB_OK;
+}
+
+
+/**
+ * Start a background I/O thread that drives the multi calls of the handle.
+ * While it runs, any thread can make multi calls using the sdb_multi_*
+ * functions, which only pass the request to the I/O thread through a
+ * lock-free queue and return right away. The calls made while a completion
+ * callback is set are reported to the callback, which runs in the I/O
+ * thread, so set it before starting the thread; the other calls must be
+ * collected using sdb_multi_wait(). No other functions may be used with the
+ * handle until sdb_stop_io_thread(); the synchronous calls fail with
+ * SDB_E_IO_THREAD_RUNNING. The I/O thread does not hedge reads.
+ *
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred, SDB_E_PENDING_MULTI_CALLS if there are multi calls that were not run yet,
+ *         SDB_E_IO_THREAD_RUNNING if the thread runs already, or SDB_E_IO_THREAD_FAILED if it cannot be started
+ *         (such as with the event loop hooks)
+ */
+int sdb_start_io_thread(struct SDB* sdb)
+{
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+	if (sdb->multi != NULL) return SDB_E_PENDING_MULTI_CALLS;
+	if (sdb->socket_hook != NULL) return SDB_E_IO_THREAD_FAILED;
+
+	return sdb_io_thread_create(sdb);
+}
+
+
+/**
+ * Stop the background I/O thread after it completes all multi calls made so
+ * far. No thread may make new multi calls while it stops.
+ *
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_stop_io_thread(struct SDB* sdb)
+{
+	if (!sdb->io_running) return SDB_OK;
+
+	sdb_io_thread_join(sdb);
+	return SDB_OK;
+}
+
+
+/**
+ * Get the service endpoint the requests are currently sent to
+ *
+ * @param sdb the SimpleDB handle
+ * @return the service URL
+ */
+const char* sdb_get_endpoint(struct SDB* sdb)
+{
+	return sdb->aws_url;
+}
+
+
 #define SDB_COMMAND_PREPARE(argc)									\
 	struct sdb_params* __params = sdb_params_alloc(argc);
 
+#define SDB_COMMAND_ORDER(order, n)									\
+	unsigned* order = (unsigned*) alloca(sizeof(unsigned) * ((n) + 1));	\
+	decimal_order(order, (unsigned) (n));
+
 #define SDB_COMMAND_PARAM(key, value)								\
 	SDB_SAFE(sdb_params_add(__params, key, value));
 
@@ -501,13 +1210,15 @@ void sdb_set_useragent(struct SDB* sdb, const char* ua)
 		return SDB_MULTI_ERROR;
 
 #define SDB_COMMAND_EXECUTE(name)									\
+	sdb_deadline_begin(sdb);										\
 	int __r = sdb_execute(sdb, name, __params);						\
 	int __retries = sdb->retry_count;								\
 	while (__r == SDB_E_AWS_SERVICE_UNAVAILABLE && __retries --> 0){\
-		usleep(sdb->retry_delay);									\
+		sdb_retry_wait(sdb);										\
 		sdb->stat.num_retries++;									\
 		__r = sdb_execute(sdb, name, __params);						\
 	}																\
+	sdb_deadline_end(sdb);											\
 	sdb_params_free(__params);										\
 	return __r;
 
@@ -515,6 +1226,7 @@ void sdb_set_useragent(struct SDB* sdb, const char* ua)
 	int __r = SDB_OK;												\
 	int __retries = sdb->retry_count;								\
 	*response = NULL;												\
+	sdb_deadline_begin(sdb);										\
 	while (*response == NULL ? TRUE : ((*response)->has_more		\
 										&& sdb->auto_next)) {		\
 		if (SDB_FAILED(__r = sdb_execute_rs(sdb, name,				\
@@ -523,12 +1235,13 @@ void sdb_set_useragent(struct SDB* sdb, const char* ua)
 				if (__retries-- <= 0) {								\
 					sdb_free(response); break;						\
 				}													\
-				usleep(sdb->retry_delay);							\
+				sdb_retry_wait(sdb);								\
 				sdb->stat.num_retries++;							\
 			}														\
 			else break;												\
 		}															\
 	}																\
+	sdb_deadline_end(sdb);											\
 	sdb_params_free(__params);										\
 	return __r;
 
@@ -538,6 +1251,31 @@ void sdb_set_useragent(struct SDB* sdb, const char* ua)
 	sdb_params_free(__params);										\
 	return __r;
 
+#define SDB_PREPARE(argc)											\
+	SDB_COMMAND_PREPARE(argc);										\
+	int* __sources = (int*) alloca(sizeof(int) * (argc));
+
+#define SDB_PREPARE_PARAM(key, value)								\
+	__sources[__params->size] = SDB_PREPARED_CONST;					\
+	SDB_COMMAND_PARAM(key, value);
+
+#define SDB_PREPARE_VALUE(key, index)								\
+	__sources[__params->size] = (int) (index);						\
+	SDB_COMMAND_PARAM(key, "");
+
+#define SDB_PREPARE_CREATE(name, num_values)						\
+	int __r = sdb_prepared_create(sdb, name, __params, __sources,	\
+								  num_values, prepared);			\
+	sdb_params_free(__params);										\
+	return __r;
+
+#define SDB_PREPARED_BIND(v)										\
+	const char** v = (const char**) alloca(sizeof(const char*)		\
+								* (prepared->num_values + 1));		\
+	memcpy(v, values, sizeof(const char*)							\
+								* (prepared->num_values - 1));		\
+	v[prepared->num_values - 1] = item;
+
 /**
  * Get more data (if the automatic handling of NEXT tokens is disabled)
  *
@@ -578,7 +1316,7 @@ int sdb_next(struct SDB* sdb, struct sdb_response** response, int append)
 
 		// Copy the parameters
 
-		struct sdb_params* params = sdb_params_deep_copy((*response)->internal->params);
+		struct sdb_params* params = sdb_params_retain((*response)->internal->params);
 
 
 		// Recreate the response
@@ -604,13 +1342,15 @@ int sdb_next(struct SDB* sdb, struct sdb_response** response, int append)
 	assert(params);
 	assert(command);
 
+	sdb_deadline_begin(sdb);
+
 	do {
 		if (SDB_FAILED(__r = sdb_execute_rs(sdb, command, params, response))) {
 			if (__r == SDB_E_AWS_SERVICE_UNAVAILABLE) {
 				if (__retries-- <= 0) {
 					sdb_free(response); break;
 				}
-				usleep(sdb->retry_delay);
+				sdb_retry_wait(sdb);
 				sdb->stat.num_retries++;
 			}
 			else break;
@@ -618,6 +1358,7 @@ int sdb_next(struct SDB* sdb, struct sdb_response** response, int append)
 	}
 	while ((*response)->has_more && sdb->auto_next);
 
+	sdb_deadline_end(sdb);
 	return __r;
 }
 
@@ -723,6 +1464,50 @@ int sdb_replace(struct SDB* sdb, const char* domain, const char* item, const cha
 }
 
 
+/**
+ * Put a binary attribute to the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_put_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length)
+{
+	char* encoded = (char*) malloc(BASE64_ENCODED_LENGTH(length) + 1);
+	encode64((const char*) value, encoded, (int) length);
+
+	int r = sdb_put(sdb, domain, item, key, encoded);
+	free(encoded);
+	return r;
+}
+
+
+/**
+ * Replace a binary attribute in the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_replace_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length)
+{
+	char* encoded = (char*) malloc(BASE64_ENCODED_LENGTH(length) + 1);
+	encode64((const char*) value, encoded, (int) length);
+
+	int r = sdb_replace(sdb, domain, item, key, encoded);
+	free(encoded);
+	return r;
+}
+
+
 /**
  * Put several attributes to the database
  *
@@ -736,120 +1521,295 @@ int sdb_replace(struct SDB* sdb, const char* domain, const char* item, const cha
  */
 int sdb_put_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num * 2);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM("ItemName", item);
 	SDB_COMMAND_PARAM("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
 		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM(buf, values[i]);
 	}
 
-	SDB_COMMAND_EXECUTE("PutAttributes");
+	SDB_COMMAND_EXECUTE("PutAttributes");
+}
+
+
+/**
+ * Replace several attributes in the database
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param num the number of attributes
+ * @param keys the attribute keys
+ * @param values the attribute values
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_replace_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
+{
+	size_t i, k;
+	char buf[64];
+
+	SDB_COMMAND_PREPARE(8 + num * 3);
+	SDB_COMMAND_ORDER(order, num);
+	SDB_COMMAND_PARAM("ItemName", item);
+	SDB_COMMAND_PARAM("DomainName", domain);
+
+	for (k = 0; k < num; k++) {
+		i = order[k];
+		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
+		sprintf(buf, "Attribute.%u.Replace", (unsigned) i); SDB_COMMAND_PARAM(buf, "true");
+		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM(buf, values[i]);
+	}
+
+	SDB_COMMAND_EXECUTE("PutAttributes");
+}
+
+
+// The deferred versions of the single-request batch commands, used to send the parts of a split batch in parallel
+
+static sdb_multi sdb_multi_put_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
+static sdb_multi sdb_multi_replace_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
+
+
+/**
+ * Put attributes of several items to the database in a single request
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_put_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	size_t i, k, attrs;
+	int j, l, max_size;
+	char buf[64];
+
+	attrs = 0;
+	max_size = 0;
+	for (i = 0; i < num; i++) {
+		attrs += items[i].size;
+		if (items[i].size > max_size) max_size = items[i].size;
+	}
+
+	SDB_COMMAND_PREPARE(8 + num + attrs * 2);
+	SDB_COMMAND_ORDER(item_order, num);
+	SDB_COMMAND_ORDER(attr_order, max_size);
+	SDB_COMMAND_PARAM("DomainName", domain);
+
+
+	// Generate the keys in their sorted order, so that sdb_params_sort() does not have to
+
+	for (k = 0; k < num; k++) {
+		i = item_order[k];
+		for (l = 0; l < max_size; l++) {
+			j = attr_order[l];
+			if (j >= items[i].size) continue;
+			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].name);
+			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].value);
+		}
+		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM(buf, items[i].name);
+	}
+
+	SDB_COMMAND_EXECUTE("BatchPutAttributes");
+}
+
+
+/**
+ * Put attributes of several items to the database, splitting them into several
+ * requests if they do not fit the SimpleDB limits on a batch
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return SDB_OK if no errors occurred, or SDB_E_PARTIAL_BATCH if only
+ *         some of the requests of a split batch failed
+ */
+int sdb_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	sdb_deadline_begin(sdb);
+	int r = sdb_batch_execute(sdb, domain, num, items, FALSE, sdb_put_batch_chunk, sdb_multi_put_batch_chunk);
+	sdb_deadline_end(sdb);
+
+	return r;
+}
+
+
+/**
+ * Replace attributes of several items in the database in a single request
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return SDB_OK if no errors occurred
+ */
+static int sdb_replace_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	size_t i, k, attrs;
+	int j, l, max_size;
+	char buf[64];
+
+	attrs = 0;
+	max_size = 0;
+	for (i = 0; i < num; i++) {
+		attrs += items[i].size;
+		if (items[i].size > max_size) max_size = items[i].size;
+	}
+
+	SDB_COMMAND_PREPARE(8 + num + attrs * 3);
+	SDB_COMMAND_ORDER(item_order, num);
+	SDB_COMMAND_ORDER(attr_order, max_size);
+	SDB_COMMAND_PARAM("DomainName", domain);
+
+
+	// Generate the keys in their sorted order, so that sdb_params_sort() does not have to
+
+	for (k = 0; k < num; k++) {
+		i = item_order[k];
+		for (l = 0; l < max_size; l++) {
+			j = attr_order[l];
+			if (j >= items[i].size) continue;
+			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].name);
+			sprintf(buf, "Item.%u.Attribute.%u.Replace", (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, "true");
+			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].value);
+		}
+		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM(buf, items[i].name);
+	}
+
+	SDB_COMMAND_EXECUTE("BatchPutAttributes");
+}
+
+
+/**
+ * Replace attributes of several items in the database, splitting them into several
+ * requests if they do not fit the SimpleDB limits on a batch
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return SDB_OK if no errors occurred, or SDB_E_PARTIAL_BATCH if only
+ *         some of the requests of a split batch failed
+ */
+int sdb_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	sdb_deadline_begin(sdb);
+	int r = sdb_batch_execute(sdb, domain, num, items, TRUE, sdb_replace_batch_chunk, sdb_multi_replace_batch_chunk);
+	sdb_deadline_end(sdb);
+
+	return r;
 }
 
 
 /**
- * Replace several attributes in the database
+ * Prepare putting the same attributes to many items
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
- * @param item the item name
  * @param num the number of attributes
  * @param keys the attribute keys
- * @param values the attribute values
+ * @param prepared a pointer to the place to store the prepared statement
  * @return SDB_OK if no errors occurred
  */
-int sdb_replace_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
+int sdb_prepare_put(struct SDB* sdb, const char* domain, size_t num, const char** keys, struct sdb_prepared** prepared)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
-	SDB_COMMAND_PREPARE(8 + num * 3);
-	SDB_COMMAND_PARAM("ItemName", item);
-	SDB_COMMAND_PARAM("DomainName", domain);
+	SDB_PREPARE(8 + num * 2);
+	SDB_COMMAND_ORDER(order, num);
 
-	for (i = 0; i < num; i++) {
-		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
-		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM(buf, values[i]);
-		sprintf(buf, "Attribute.%u.Replace", (unsigned) i); SDB_COMMAND_PARAM(buf, "true");
+	for (k = 0; k < num; k++) {
+		i = order[k];
+		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_PREPARE_PARAM(buf, keys[i]);
+		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_PREPARE_VALUE(buf, i);
 	}
 
-	SDB_COMMAND_EXECUTE("PutAttributes");
+	SDB_PREPARE_PARAM("DomainName", domain);
+	SDB_PREPARE_VALUE("ItemName", num);
+	SDB_PREPARE_CREATE("PutAttributes", num + 1);
 }
 
 
 /**
- * Put attributes of several items to the database
+ * Prepare replacing the same attributes in many items
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
- * @param num the number of items
- * @param items the array of items and their attributes
+ * @param num the number of attributes
+ * @param keys the attribute keys
+ * @param prepared a pointer to the place to store the prepared statement
  * @return SDB_OK if no errors occurred
  */
-int sdb_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+int sdb_prepare_replace(struct SDB* sdb, const char* domain, size_t num, const char** keys, struct sdb_prepared** prepared)
 {
-	size_t i, attrs;
-	int j;
+	size_t i, k;
 	char buf[64];
 
-	attrs = 0;
-	for (i = 0; i < num; i++) {
-		attrs += items[i].size;
+	SDB_PREPARE(8 + num * 3);
+	SDB_COMMAND_ORDER(order, num);
+
+	for (k = 0; k < num; k++) {
+		i = order[k];
+		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_PREPARE_PARAM(buf, keys[i]);
+		sprintf(buf, "Attribute.%u.Replace", (unsigned) i); SDB_PREPARE_PARAM(buf, "true");
+		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_PREPARE_VALUE(buf, i);
 	}
 
-	SDB_COMMAND_PREPARE(8 + num + attrs * 2);
-	SDB_COMMAND_PARAM("DomainName", domain);
+	SDB_PREPARE_PARAM("DomainName", domain);
+	SDB_PREPARE_VALUE("ItemName", num);
+	SDB_PREPARE_CREATE("PutAttributes", num + 1);
+}
 
-	for (i = 0; i < num; i++) {
-		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM(buf, items[i].name);
-		for (j = 0; j < items[i].size; j++) {
-			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].name);
-			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].value);
-		}
-	}
 
-	SDB_COMMAND_EXECUTE("BatchPutAttributes");
+/**
+ * Free a prepared statement
+ *
+ * @param prepared the prepared statement
+ */
+void sdb_free_prepared(struct sdb_prepared** prepared)
+{
+	if (prepared == NULL || *prepared == NULL) return;
+
+	sdb_prepared_destroy(*prepared);
+	*prepared = NULL;
 }
 
 
 /**
- * Replace attributes of several items in the database
+ * Put (or replace) the attributes of an item using a prepared statement
  *
  * @param sdb the SimpleDB handle
- * @param domain the domain name
- * @param num the number of items
- * @param items the array of items and their attributes
+ * @param prepared the prepared statement
+ * @param item the item name
+ * @param values the attribute values (in the order of the prepared keys)
  * @return SDB_OK if no errors occurred
  */
-int sdb_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+int sdb_put_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char* item, const char** values)
 {
-	size_t i, attrs;
-	int j;
-	char buf[64];
-
-	attrs = 0;
-	for (i = 0; i < num; i++) {
-		attrs += items[i].size;
-	}
+	SDB_PREPARED_BIND(v);
 
-	SDB_COMMAND_PREPARE(8 + num + attrs * 3);
-	SDB_COMMAND_PARAM("DomainName", domain);
+	sdb_deadline_begin(sdb);
 
-	for (i = 0; i < num; i++) {
-		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM(buf, items[i].name);
-		for (j = 0; j < items[i].size; j++) {
-			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].name);
-			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, items[i].attributes[j].value);
-			sprintf(buf, "Item.%u.Attribute.%u.Replace", (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM(buf, "true");
-		}
+	int __r = sdb_execute_prepared(sdb, prepared, v);
+	int __retries = sdb->retry_count;
+	while (__r == SDB_E_AWS_SERVICE_UNAVAILABLE && __retries --> 0) {
+		sdb_retry_wait(sdb);
+		sdb->stat.num_retries++;
+		__r = sdb_execute_prepared(sdb, prepared, v);
 	}
 
-	SDB_COMMAND_EXECUTE("BatchPutAttributes");
+	sdb_deadline_end(sdb);
+	return __r;
 }
 
 
@@ -901,14 +1861,16 @@ int sdb_delete_attr(struct SDB* sdb, const char* domain, const char* item, const
  */
 int sdb_delete_attr_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM("ItemName", item);
 	SDB_COMMAND_PARAM("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name", (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
 	}
 
@@ -950,14 +1912,16 @@ int sdb_delete_attr_ext(struct SDB* sdb, const char* domain, const char* item, c
  */
 int sdb_delete_attr_ext_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num * 2);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM("ItemName", item);
 	SDB_COMMAND_PARAM("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
 		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM(buf, values[i]);
 	}
@@ -986,6 +1950,41 @@ int sdb_get(struct SDB* sdb, const char* domain, const char* item, const char* k
 }
 
 
+/**
+ * Get a binary attribute (stored using sdb_put_binary or sdb_replace_binary)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value a pointer to the place to store the decoded value (NULL if the attribute does not exist, otherwise must be freed by the caller)
+ * @param length a pointer to the place to store the length of the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_get_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, void** value, size_t* length)
+{
+	struct sdb_response* response = NULL;
+	int i, r = SDB_OK;
+
+	*value = NULL;
+	*length = 0;
+
+	SDB_SAFE(sdb_get(sdb, domain, item, key, &response));
+
+	if (response->type == SDB_R_ATTRIBUTE_LIST) {
+		for (i = 0; i < response->size; i++) {
+			if (strcmp(response->attributes[i].name, key) == 0) {
+				r = sdb_decode_binary(response->attributes[i].value, value, length);
+				break;
+			}
+		}
+	}
+
+	sdb_free(&response);
+	return r;
+}
+
+
 /**
  * Get several attributes
  *
@@ -999,14 +1998,16 @@ int sdb_get(struct SDB* sdb, const char* domain, const char* item, const char* k
  */
 int sdb_get_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, struct sdb_response** response)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM("ItemName", item);
 	SDB_COMMAND_PARAM("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "AttributeName.%u", (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
 	}
 
@@ -1083,14 +2084,16 @@ int sdb_query_attr(struct SDB* sdb, const char* domain, const char* query, const
 int sdb_query_attr_many(struct SDB* sdb, const char* domain, const char* query,
 						size_t num, const char** keys, struct sdb_response** response)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM("DomainName", domain);
 	SDB_COMMAND_PARAM("QueryExpression", query);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "AttributeName.%u", (unsigned) i); SDB_COMMAND_PARAM(buf, keys[i]);
 	}
 
@@ -1133,13 +2136,14 @@ int sdb_select(struct SDB* sdb, const char* expr, struct sdb_response** response
 
 
 /**
- * Perform all pending operations specified using sdb_multi_* functions
+ * Perform all pending operations specified using sdb_multi_* functions,
+ * followed by their retries and automatic NEXT requests
  *
  * @param sdb the SimpleDB handle
  * @param response a pointer to the place to store the response
  * @return SDB_OK if no errors occurred
  */
-int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
+static int sdb_multi_run_rounds(struct SDB* sdb, struct sdb_multi_response** response)
 {
 	*response = NULL;
 	if (sdb->multi == NULL) return SDB_OK;
@@ -1155,13 +2159,21 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 	}
 
 
+	// Nothing to report if all calls had completion callbacks
+
+	if (sdb->num_completed == 0) {
+		sdb_multi_free_chain(sdb, sdb->multi);
+		sdb->multi = NULL;
+		return SDB_OK;
+	}
+
+
 	// Get the results
 
 	int i;
 	int remaining = 1;
 	int index = -1;
 
-	int has_more = FALSE;
 	struct sdb_retry_data* retry_list = NULL;
 
 	while (remaining) {
@@ -1171,7 +2183,7 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 
 		// Get the message
 
-		CURLMsg* msg = curl_multi_info_read(sdb->curl_multi, &remaining);
+		CURLMsg* msg = sdb_multi_info_read(sdb, &remaining);
 		if (msg == NULL) {
 			sdb_multi_free_chain(sdb, sdb->multi);
 			sdb_retry_destroy_chain(retry_list);
@@ -1195,12 +2207,17 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 		// Deal with the error code
 
 		CURLcode cr = msg->data.result;
-		if (cr != CURLE_OK) continue;
+		if (cr != CURLE_OK) {
+			struct sdb_multi_data* f = sdb_multi_find(msg->easy_handle);
+			sdb_multi h = f != NULL && f->group != NULL ? f->group : msg->easy_handle;
+			(*response)->responses[index] = sdb_multi_error_response(h, sdb_transfer_error(sdb, cr));
+			continue;
+		}
 
 
 		// Find the result structure
 
-		struct sdb_multi_data* m = sdb_multi_find(sdb->multi, msg->easy_handle);
+		struct sdb_multi_data* m = sdb_multi_find(msg->easy_handle);
 		if (m == NULL) {
 			if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Internal Error: Cannot find multi handle %p\n", msg->easy_handle);
 			sdb_multi_free_chain(sdb, sdb->multi);
@@ -1213,6 +2230,7 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 		// Parse the result
 
 		int retry = FALSE;
+		sdb_multi handle = m->group != NULL ? m->group : msg->easy_handle;
 
 		r = sdb_parse_result(sdb, msg->easy_handle, m->post_size, &m->rec, &(*response)->responses[index]);
 		if ((*response)->responses[index] == NULL && r != SDB_E_AWS_SERVICE_UNAVAILABLE) {
@@ -1231,12 +2249,11 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 		}
 
 		if ((*response)->responses[index] != NULL) {
-			(*response)->responses[index]->multi_handle = msg->easy_handle;
+			(*response)->responses[index]->multi_handle = handle;
 			(*response)->responses[index]->return_code = r;
 
 			if ((*response)->responses[index]->has_more && sdb->auto_next) {
 				retry = TRUE;
-				has_more = TRUE;
 			}
 
 
@@ -1245,7 +2262,7 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 			if ((*response)->responses[index]->has_more) {
 				if (!sdb->auto_next && (*response)->responses[index]->internal->params == NULL) {
 					if ((*response)->responses[index]->internal->next == NULL) {
-						(*response)->responses[index]->internal->params = sdb_params_deep_copy(m->params);
+						(*response)->responses[index]->internal->params = sdb_params_retain(m->params);
 						(*response)->responses[index]->internal->command = (char*) malloc(strlen(m->command) + 4);
 						strcpy((*response)->responses[index]->internal->command, m->command);
 					}
@@ -1261,13 +2278,8 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 			}
 		}
 
-		if (r == SDB_E_AWS_SERVICE_UNAVAILABLE) {
-			retry = TRUE;
-			if (sdb->retry_count > 0) sdb->stat.num_retries++;
-		}
-
 
-		// Schedule a retry if we have to
+		// Request the next page if we have to (the throttled calls were already retried by sdb_multi_run_and_wait())
 
 		if (retry) {
 
@@ -1280,7 +2292,7 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 			x->command[SDB_LEN_COMMAND - 1] = '\0';
 
 			x->user_data = &(*response)->responses[index];
-			x->user_data_2 = msg->easy_handle;
+			x->user_data_2 = handle;
 
 			x->params = m->params;
 			m->params = NULL;
@@ -1294,16 +2306,28 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 	sdb->multi = NULL;
 
 
-	// Retry
+	// Request the next pages
 
-	int ri;
 	struct sdb_retry_data* R;
 
-	if (!sdb->auto_next) has_more = FALSE;
+	while (retry_list != NULL) {
+
 
-	for (ri = 0; has_more || ri < sdb->retry_count; has_more ? ri : ri++) {
-		if (retry_list == NULL) break;
-		if (!has_more) usleep(sdb->retry_delay);
+		// Give up if the deadline has passed
+
+		if (SDB_FAILED(sdb_deadline_check(sdb))) {
+			for (R = retry_list; R != NULL; R = R->next) {
+				struct sdb_response** pres = (struct sdb_response**) R->user_data;
+				if (*pres == NULL) {
+					*pres = sdb_multi_error_response(R->user_data_2, SDB_E_DEADLINE_EXCEEDED);
+				}
+				else {
+					(*pres)->return_code = SDB_E_DEADLINE_EXCEEDED;
+				}
+			}
+			sdb_retry_destroy_chain(retry_list);
+			return SDB_E_DEADLINE_EXCEEDED;
+		}
 
 
 		// Rebuild the commands
@@ -1323,7 +2347,6 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 
 		sdb_retry_destroy_chain(retry_list);
 		retry_list = NULL;
-		has_more = FALSE;
 
 
 		// Perform the database calls
@@ -1339,14 +2362,13 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 		// Parse the results
 
 		remaining = 1;
-		int num_retries = 0;
 
 		while (remaining) {
 
 
 			// Get the message
 
-			CURLMsg* msg = curl_multi_info_read(sdb->curl_multi, &remaining);
+			CURLMsg* msg = sdb_multi_info_read(sdb, &remaining);
 			if (msg == NULL) {
 				sdb_multi_free_chain(sdb, sdb->multi);
 				sdb_retry_destroy_chain(retry_list);
@@ -1358,12 +2380,24 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 			// Deal with the error code
 
 			CURLcode cr = msg->data.result;
-			if (cr != CURLE_OK) continue;
+			if (cr != CURLE_OK) {
+				struct sdb_multi_data* f = sdb_multi_find(msg->easy_handle);
+				if (f != NULL) {
+					struct sdb_response** pres = (struct sdb_response**) f->user_data;
+					if (*pres == NULL) {
+						*pres = sdb_multi_error_response(f->user_data_2, sdb_transfer_error(sdb, cr));
+					}
+					else {
+						(*pres)->return_code = sdb_transfer_error(sdb, cr);
+					}
+				}
+				continue;
+			}
 
 
 			// Find the result structure
 
-			struct sdb_multi_data* m = sdb_multi_find(sdb->multi, msg->easy_handle);
+			struct sdb_multi_data* m = sdb_multi_find(msg->easy_handle);
 			if (m == NULL) {
 				if (sdb->errout != NULL) fprintf(sdb->errout, "SimpleDB Internal Error: Cannot find multi handle %p\n", msg->easy_handle);
 				sdb_multi_free_chain(sdb, sdb->multi);
@@ -1401,7 +2435,6 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 
 				if ((*pres)->has_more && sdb->auto_next) {
 					retry = TRUE;
-					has_more = TRUE;
 				}
 
 
@@ -1409,7 +2442,7 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 
 				if ((*pres)->has_more && !sdb->auto_next && (*pres)->internal->params == NULL) {
 					if ((*pres)->internal->next == NULL) {
-						(*pres)->internal->params = sdb_params_deep_copy(m->params);
+						(*pres)->internal->params = sdb_params_retain(m->params);
 						(*pres)->internal->command = (char*) malloc(strlen(m->command) + 4);
 						strcpy((*pres)->internal->command, m->command);
 					}
@@ -1424,13 +2457,8 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 				}
 			}
 
-			if (r == SDB_E_AWS_SERVICE_UNAVAILABLE) {
-				retry = TRUE;
-				num_retries++;
-			}
-
 
-			// Schedule a retry if we have to
+			// Request the next page if we have to
 
 			if (retry) {
 
@@ -1450,9 +2478,6 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 			}
 		}
 
-		if (has_more || (ri + 1) < sdb->retry_count) sdb->stat.num_retries += num_retries;
-
-
 		// Cleanup
 
 		sdb_multi_free_chain(sdb, sdb->multi);
@@ -1470,6 +2495,117 @@ int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
 }
 
 
+/**
+ * Perform all pending operations specified using sdb_multi_* functions
+ *
+ * @param sdb the SimpleDB handle
+ * @param response a pointer to the place to store the response (NULL if all calls had completion callbacks)
+ * @return SDB_OK if no errors occurred, or SDB_E_IO_THREAD_RUNNING if the background I/O thread runs
+ */
+int sdb_multi_run(struct SDB* sdb, struct sdb_multi_response** response)
+{
+	struct sdb_multi_data* m;
+	int r = SDB_OK;
+
+	*response = NULL;
+	if (sdb->io_running) return SDB_E_IO_THREAD_RUNNING;
+
+
+	// Start the deadline, which also bounds the calls that are already deferred
+
+	sdb_deadline_begin(sdb);
+
+	for (m = sdb->multi; m != NULL; m = m->next) {
+		if (SDB_FAILED(r = sdb_deadline_apply(sdb, m->curl))) break;
+	}
+
+	if (SDB_FAILED(r)) {
+		*response = NULL;
+		sdb_multi_free_chain(sdb, sdb->multi);
+		sdb->multi = NULL;
+	}
+	else {
+		r = sdb_multi_run_rounds(sdb, response);
+	}
+
+	sdb->multi_running = 0;
+	sdb->num_completed = 0;
+	sdb->next_completed = 0;
+	sdb_deadline_end(sdb);
+	return r;
+}
+
+
+/**
+ * Make progress on the pending multi calls after a socket became ready or
+ * the timer expired (only with the event loop hooks). Do not call this from
+ * inside a hook. The completion callbacks of the finished calls run from
+ * here. Once no calls are running, sdb_multi_run() collects the other
+ * responses without blocking, except for retries and automatic NEXT
+ * requests, which it performs itself.
+ *
+ * @param sdb the SimpleDB handle
+ * @param fd the ready socket, or SDB_SOCKET_TIMEOUT if the timer expired
+ * @param events the socket events (SDB_POLL_IN, SDB_POLL_OUT and SDB_POLL_ERR)
+ * @param running the pointer to the number of calls that are still running (can be NULL)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_multi_socket_action(struct SDB* sdb, int fd, int events, int* running)
+{
+	int mask = 0, n;
+
+	if (events & SDB_POLL_IN) mask |= CURL_CSELECT_IN;
+	if (events & SDB_POLL_OUT) mask |= CURL_CSELECT_OUT;
+	if (events & SDB_POLL_ERR) mask |= CURL_CSELECT_ERR;
+
+	curl_socket_t s = fd == SDB_SOCKET_TIMEOUT ? CURL_SOCKET_TIMEOUT : (curl_socket_t) fd;
+
+	CURLMcode r = curl_multi_socket_action(sdb->curl_multi, s, fd == SDB_SOCKET_TIMEOUT ? 0 : mask, &n);
+
+
+	// Report the calls with completion callbacks, and refill the in-flight window (Curl asks for a timeout to start the new calls)
+
+	if (r == CURLM_OK) sdb_multi_progress(sdb, &n);
+	if (running != NULL) *running = n + sdb->num_queued;
+
+	return r == CURLM_OK ? SDB_OK : SDB_CURLM_ERROR(r);
+}
+
+
+/**
+ * Wait for a multi call made while the background I/O thread runs, and get
+ * its response. Do this exactly once for each such call made without a
+ * completion callback, from any thread (even after the I/O thread stopped).
+ * A batch split into several requests completes when all of them do, with
+ * the response of the first failed request, or of the last one if none
+ * failed.
+ *
+ * @param sdb the SimpleDB handle
+ * @param handle the handle of the multi call
+ * @param response a pointer to the place to store the response (free it using sdb_free())
+ * @return the return code of the call
+ */
+int sdb_multi_wait(struct SDB* sdb, sdb_multi handle, struct sdb_response** response)
+{
+	struct sdb_io_request* q = (struct sdb_io_request*) handle;
+
+	*response = NULL;
+	if (q == SDB_MULTI_ERROR) return SDB_E_INTERNAL_ERROR;
+
+
+	// Wait for the I/O thread to fulfill the request
+
+	pthread_mutex_lock(&sdb->io_lock);
+	while (!q->done) pthread_cond_wait(&sdb->io_done, &sdb->io_lock);
+	pthread_mutex_unlock(&sdb->io_lock);
+
+	*response = q->response;
+	free(q);
+
+	return (*response)->return_code;
+}
+
+
 /**
  * Create a domain
  *
@@ -1571,6 +2707,50 @@ sdb_multi sdb_multi_replace(struct SDB* sdb, const char* domain, const char* ite
 }
 
 
+/**
+ * Put a binary attribute to the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_put_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length)
+{
+	char* encoded = (char*) malloc(BASE64_ENCODED_LENGTH(length) + 1);
+	encode64((const char*) value, encoded, (int) length);
+
+	sdb_multi r = sdb_multi_put(sdb, domain, item, key, encoded);
+	free(encoded);
+	return r;
+}
+
+
+/**
+ * Replace a binary attribute in the database (base64-encoded)
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param item the item name
+ * @param key the attribute key
+ * @param value the attribute value
+ * @param length the length of the value
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_replace_binary(struct SDB* sdb, const char* domain, const char* item, const char* key, const void* value, size_t length)
+{
+	char* encoded = (char*) malloc(BASE64_ENCODED_LENGTH(length) + 1);
+	encode64((const char*) value, encoded, (int) length);
+
+	sdb_multi r = sdb_multi_replace(sdb, domain, item, key, encoded);
+	free(encoded);
+	return r;
+}
+
+
 /**
  * Put several attributes to the database
  *
@@ -1584,14 +2764,16 @@ sdb_multi sdb_multi_replace(struct SDB* sdb, const char* domain, const char* ite
  */
 sdb_multi sdb_multi_put_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num * 2);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("ItemName", item);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
 		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, values[i]);
 	}
@@ -1613,17 +2795,19 @@ sdb_multi sdb_multi_put_many(struct SDB* sdb, const char* domain, const char* it
  */
 sdb_multi sdb_multi_replace_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num * 3);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("ItemName", item);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
-		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, values[i]);
 		sprintf(buf, "Attribute.%u.Replace", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, "true");
+		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, values[i]);
 	}
 
 	SDB_COMMAND_EXECUTE_MULTI("PutAttributes");
@@ -1631,7 +2815,7 @@ sdb_multi sdb_multi_replace_many(struct SDB* sdb, const char* domain, const char
 
 
 /**
- * Put attributes of several items to the database
+ * Put attributes of several items to the database in a single request
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
@@ -1639,26 +2823,36 @@ sdb_multi sdb_multi_replace_many(struct SDB* sdb, const char* domain, const char
  * @param items the array of items and their attributes
  * @return the command execution handle, or SDB_MULTI_ERROR on error
  */
-sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+static sdb_multi sdb_multi_put_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
 {
-	size_t i, attrs;
-	int j;
+	size_t i, k, attrs;
+	int j, l, max_size;
 	char buf[64];
 
 	attrs = 0;
+	max_size = 0;
 	for (i = 0; i < num; i++) {
 		attrs += items[i].size;
+		if (items[i].size > max_size) max_size = items[i].size;
 	}
 
 	SDB_COMMAND_PREPARE(8 + num + attrs * 2);
+	SDB_COMMAND_ORDER(item_order, num);
+	SDB_COMMAND_ORDER(attr_order, max_size);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
-		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, items[i].name);
-		for (j = 0; j < items[i].size; j++) {
+
+	// Generate the keys in their sorted order, so that sdb_params_sort() does not have to
+
+	for (k = 0; k < num; k++) {
+		i = item_order[k];
+		for (l = 0; l < max_size; l++) {
+			j = attr_order[l];
+			if (j >= items[i].size) continue;
 			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, items[i].attributes[j].name);
 			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, items[i].attributes[j].value);
 		}
+		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, items[i].name);
 	}
 
 	SDB_COMMAND_EXECUTE_MULTI("BatchPutAttributes");
@@ -1666,7 +2860,8 @@ sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, c
 
 
 /**
- * Replace attributes of several items in the database
+ * Put attributes of several items to the database, splitting them into several
+ * requests if they do not fit the SimpleDB limits on a batch
  *
  * @param sdb the SimpleDB handle
  * @param domain the domain name
@@ -1674,33 +2869,91 @@ sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, c
  * @param items the array of items and their attributes
  * @return the command execution handle, or SDB_MULTI_ERROR on error
  */
-sdb_multi sdb_multi_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+sdb_multi sdb_multi_put_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	return sdb_multi_batch_execute(sdb, domain, num, items, FALSE, sdb_multi_put_batch_chunk);
+}
+
+
+/**
+ * Replace attributes of several items in the database in a single request
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+static sdb_multi sdb_multi_replace_batch_chunk(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
 {
-	size_t i, attrs;
-	int j;
+	size_t i, k, attrs;
+	int j, l, max_size;
 	char buf[64];
 
 	attrs = 0;
+	max_size = 0;
 	for (i = 0; i < num; i++) {
 		attrs += items[i].size;
+		if (items[i].size > max_size) max_size = items[i].size;
 	}
 
 	SDB_COMMAND_PREPARE(8 + num + attrs * 3);
+	SDB_COMMAND_ORDER(item_order, num);
+	SDB_COMMAND_ORDER(attr_order, max_size);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
-		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, items[i].name);
-		for (j = 0; j < items[i].size; j++) {
+
+	// Generate the keys in their sorted order, so that sdb_params_sort() does not have to
+
+	for (k = 0; k < num; k++) {
+		i = item_order[k];
+		for (l = 0; l < max_size; l++) {
+			j = attr_order[l];
+			if (j >= items[i].size) continue;
 			sprintf(buf, "Item.%u.Attribute.%u.Name"   , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, items[i].attributes[j].name);
-			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, items[i].attributes[j].value);
 			sprintf(buf, "Item.%u.Attribute.%u.Replace", (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, "true");
+			sprintf(buf, "Item.%u.Attribute.%u.Value"  , (unsigned) i, (unsigned) j); SDB_COMMAND_PARAM_MULTI(buf, items[i].attributes[j].value);
 		}
+		sprintf(buf, "Item.%u.ItemName", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, items[i].name);
 	}
 
 	SDB_COMMAND_EXECUTE_MULTI("BatchPutAttributes");
 }
 
 
+/**
+ * Replace attributes of several items in the database, splitting them into several
+ * requests if they do not fit the SimpleDB limits on a batch
+ *
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_replace_batch(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items)
+{
+	return sdb_multi_batch_execute(sdb, domain, num, items, TRUE, sdb_multi_replace_batch_chunk);
+}
+
+
+/**
+ * Put (or replace) the attributes of an item using a prepared statement
+ *
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param item the item name
+ * @param values the attribute values (in the order of the prepared keys)
+ * @return the command execution handle, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_put_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char* item, const char** values)
+{
+	SDB_PREPARED_BIND(v);
+
+	return sdb_execute_multi_prepared(sdb, prepared, v);
+}
+
+
 /**
  * Delete an item
  *
@@ -1749,14 +3002,16 @@ sdb_multi sdb_multi_delete_attr(struct SDB* sdb, const char* domain, const char*
  */
 sdb_multi sdb_multi_delete_attr_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("ItemName", item);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
 	}
 
@@ -1798,14 +3053,16 @@ sdb_multi sdb_multi_delete_attr_ext(struct SDB* sdb, const char* domain, const c
  */
 sdb_multi sdb_multi_delete_attr_ext_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys, const char** values)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num * 2);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("ItemName", item);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "Attribute.%u.Name"   , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
 		sprintf(buf, "Attribute.%u.Value"  , (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, values[i]);
 	}
@@ -1845,14 +3102,16 @@ sdb_multi sdb_multi_get(struct SDB* sdb, const char* domain, const char* item, c
  */
 sdb_multi sdb_multi_get_many(struct SDB* sdb, const char* domain, const char* item, size_t num, const char** keys)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("ItemName", item);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "AttributeName.%u", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
 	}
 
@@ -1926,14 +3185,16 @@ sdb_multi sdb_multi_query_attr(struct SDB* sdb, const char* domain, const char*
 sdb_multi sdb_multi_query_attr_many(struct SDB* sdb, const char* domain, const char* query,
 									size_t num, const char** keys)
 {
-	size_t i;
+	size_t i, k;
 	char buf[64];
 
 	SDB_COMMAND_PREPARE(8 + num);
+	SDB_COMMAND_ORDER(order, num);
 	SDB_COMMAND_PARAM_MULTI("DomainName", domain);
 	SDB_COMMAND_PARAM_MULTI("QueryExpression", query);
 
-	for (i = 0; i < num; i++) {
+	for (k = 0; k < num; k++) {
+		i = order[k];
 		sprintf(buf, "AttributeName.%u", (unsigned) i); SDB_COMMAND_PARAM_MULTI(buf, keys[i]);
 	}
 
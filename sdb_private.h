@@ -41,6 +41,12 @@
 #include <curl/curl.h>
 #include <curl/easy.h>
 
+#include <pthread.h>
+
+#include <openssl/opensslv.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,9 +56,45 @@ extern "C" {
 #define AWS_EU_URL						"https://sdb.eu-west-1.amazonaws.com"
 
 #define SDB_HTTP_HEADER_CONTENT_TYPE	"Content-Type: application/x-www-form-urlencoded; charset=utf-8"
+#define SDB_HTTP_ENCODING				"gzip"
+#define SDB_HTTP_HEADER_NO_EXPECT		"Expect:"
 
 #define SDB_MAX_MULTI_FREE				256
 #define SDB_LEN_COMMAND					32
+#define SDB_MAX_PARAMS_MERGE			16
+#define SDB_PARAMS_KEY_SPACE			32
+#define SDB_MAX_ACTIONS					16
+
+#define SDB_MAX_BATCH_ITEMS				25
+#define SDB_MAX_BATCH_ATTRIBUTES		256
+#define SDB_MAX_BATCH_SIZE				(1024 * 1024 - 4096)	/* Leave room for the required parameters */
+#define SDB_BATCH_KEY_SIZE				32
+
+#define SDB_SIGNATURE_SPACE				(16 + EVP_MAX_MD_SIZE * 2 * 3)
+
+#define SDB_POST_BUFFER_SIZE			(4 * 1024)
+#define SDB_POST_BUFFER_HIGH_WATER		(256 * 1024)
+#define SDB_REC_BUFFER_SIZE				(64 * 1024)
+#define SDB_MULTI_UPLOAD_BUFFER_SIZE	(16 * 1024)	/* the minimum allowed by Curl */
+
+#define SDB_ENDPOINT_PROBE_TIMEOUT		2000	/* ms */
+#define SDB_DNS_MAX_ADDRESSES			16
+
+#define SDB_DEFAULT_CONNECT_TIMEOUT		10000	/* ms */
+#define SDB_DEFAULT_STALL_TIMEOUT		30000	/* ms */
+#define SDB_DEFAULT_RETRY_MAX_DELAY		2000	/* ms */
+
+#define SDB_TCP_KEEPIDLE				30		/* s, for the low-latency transport profile */
+#define SDB_TCP_KEEPINTVL				10		/* s */
+
+#define SDB_EVENT_LOOP_MAX_EVENTS		64
+#define SDB_EVENT_LOOP_MAX_WAIT			1000	/* ms */
+
+#define SDB_HEDGE_SAMPLES				128		/* the recent read latencies kept for the percentile */
+#define SDB_HEDGE_MIN_SAMPLES			16
+
+#define SDB_PREPARED_CONST				-1
+#define SDB_PREPARED_TIMESTAMP			-2
 
 
 // Curl's cutoff for using 100-continue for POST
@@ -63,14 +105,35 @@ extern "C" {
 struct sdb_params;
 
 
+/**
+ * A keyed HMAC context
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX sdb_hmac_ctx;
+#else
+typedef HMAC_CTX sdb_hmac_ctx;
+#endif
+
+
 /**
  * A key-value pair
  */
 struct sdb_pair
 {
-	char* key;
-	char* value;
-	struct sdb_params* parent;
+	const char* key;
+	const char* value;
+};
+
+
+/**
+ * A chunk of memory for the strings owned by a parameter array
+ */
+struct sdb_params_chunk
+{
+	struct sdb_params_chunk* next;
+	size_t size;
+	size_t capacity;
+	char data[];
 };
 
 
@@ -82,6 +145,72 @@ struct sdb_params
 	struct sdb_pair* params;
 	size_t size;
 	size_t capacity;
+	
+	struct sdb_params_chunk* strings;	// The arena for the keys (NULL if immutable)
+	int ref_count;						// Zero if mutable, otherwise the number of references
+	
+	struct sdb_params* base;			// The immutable array whose strings a binding shares (NULL if none)
+};
+
+
+/**
+ * A pre-encoded "key=value" fragment of the request body
+ */
+struct sdb_fragment
+{
+	const char* key;
+	const char* text;
+	size_t length;
+};
+
+
+/**
+ * The pre-encoded parameters that depend only on the action
+ */
+struct sdb_action
+{
+	char name[SDB_LEN_COMMAND];
+	char text[SDB_LEN_COMMAND + 8];
+	
+	struct sdb_fragment action;
+	struct sdb_fragment version;
+};
+
+
+/**
+ * A place in the pre-encoded text of a prepared statement where a value is spliced in
+ */
+struct sdb_prepared_slot
+{
+	size_t offset;						// The offset in the text
+	int source;							// The index of the value, or SDB_PREPARED_TIMESTAMP
+};
+
+
+/**
+ * A prepared statement
+ */
+struct sdb_prepared
+{
+	char command[SDB_LEN_COMMAND];
+	
+	
+	// The pre-encoded body with the slots for the varying values
+	
+	char* text;
+	size_t length;
+	
+	struct sdb_prepared_slot* slots;
+	size_t num_slots;
+	
+	
+	// The equivalent parameters (kept by the multi interface for retries)
+	
+	struct sdb_params* params;
+	size_t* positions;					// The index of each value in params
+	size_t num_values;
+	
+	int ref_count;						// One, plus the calls waiting for the background I/O thread
 };
 
 
@@ -104,7 +233,7 @@ struct sdb_multi_data
 	// Execution data
 	
 	CURL* curl;
-	char* post;
+	struct sdb_buffer post;
 	struct sdb_buffer rec;
 	
 	
@@ -114,9 +243,10 @@ struct sdb_multi_data
 	struct sdb_params* params;
 	
 	
-	// Linked list
+	// Linked list (doubly linked in the chain of deferred calls, singly linked in the free list)
 	
 	struct sdb_multi_data* next;
+	struct sdb_multi_data* prev;
 	
 	
 	// User data
@@ -125,6 +255,46 @@ struct sdb_multi_data
 	void* user_data_2;
 	
 	
+	// The handle reported to the user, if the call is a part of a larger command (NULL otherwise)
+	
+	sdb_multi group;
+	
+	
+	// The completion callback, and the response accumulated over the pages of a call that has one
+	
+	sdb_multi_callback callback;
+	void* callback_data;
+	struct sdb_response* response;
+	
+	
+	// The list of the calls waiting for room in the in-flight window, or for their retry
+	
+	struct sdb_multi_data* queue_next;
+	struct sdb_multi_data* queue_prev;
+	int queued;
+	int waiting;
+	
+	
+	// Retries of a throttled call
+	
+	int retries;
+	long long retry_due;				/* monotonic ms */
+	
+	
+	// Hedging (the original of a slow read and its duplicate race each other)
+	
+	struct sdb_multi_data* twin;		/* the other copy while both are in flight, or NULL */
+	int hedge;							/* whether this is the duplicate */
+	int hedged;							/* whether this attempt was duplicated already */
+	int done;
+	long long started;					/* monotonic ms */
+	
+	
+	// The deadline of a call started by the background I/O thread (0 = the one of sdb_multi_run())
+	
+	long long deadline;					/* monotonic ms */
+	
+	
 	// Statistics
 	
 	long post_size;
@@ -146,6 +316,106 @@ struct sdb_retry_data
 };
 
 
+/**
+ * A candidate service endpoint
+ */
+struct sdb_endpoint
+{
+	char* url;
+	double rtt;			/* seconds, or a negative number if the endpoint is unreachable */
+};
+
+
+/**
+ * An event loop that drives the transfers of a Curl multi handle
+ */
+struct sdb_event_loop
+{
+	int epfd;			/* the epoll descriptor, or -1 if not available */
+	long timeout;		/* ms, as requested by Curl (-1 = no timeout) */
+	int wakefd;			/* the read end of a pipe that interrupts the wait, or -1 */
+};
+
+
+/**
+ * A multi call made while the background I/O thread runs
+ */
+struct sdb_io_request
+{
+	struct sdb_io_request* next;		/* in the submission queue */
+	
+	
+	// The request
+	
+	char command[SDB_LEN_COMMAND];
+	struct sdb_params* params;			/* a private copy, until the I/O thread starts the call */
+	char* next_token;					/* likewise (NULL if none) */
+	struct sdb_prepared* prepared;		/* the template that the params bind (NULL if none), likewise */
+	long long deadline;					/* from the submission (0 = none) */
+	struct sdb_multi_data* m;
+	
+	
+	// Completion
+	
+	sdb_multi_callback callback;		/* NULL = fulfill the request for sdb_multi_wait() */
+	void* callback_data;
+	
+	struct sdb_io_request* group;		/* the first request of a split batch (NULL for the first one itself) */
+	int pending;						/* the requests of the group that did not complete yet */
+	int done;
+	struct sdb_response* response;
+};
+
+
+/**
+ * A function that puts or replaces the attributes of a batch of items in a single request
+ */
+typedef int (*sdb_batch_function)(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
+
+/**
+ * A function that defers putting or replacing the attributes of a batch of items in a single request
+ */
+typedef sdb_multi (*sdb_multi_batch_function)(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items);
+
+
+/**
+ * A DNS lookup of the host of an endpoint, which can run in a background thread
+ */
+struct sdb_dns_job
+{
+	pthread_t thread;
+	int done;							/* set by the thread once the result is ready */
+	int result;
+	
+	char* url;							/* the endpoint */
+	char host[256];
+	char port[8];
+	
+	char* addrs[SDB_DNS_MAX_ADDRESSES];
+	int num_addrs;
+};
+
+
+/**
+ * A measurement of the endpoint set that runs in a background thread
+ */
+struct sdb_probe_job
+{
+	pthread_t thread;
+	int done;							/* set by the thread once the results are ready */
+	int result;
+	
+	struct sdb_endpoint* endpoints;		/* a copy of the endpoint set */
+	size_t num_endpoints;
+	
+	int pinning;						/* whether to resolve the closest endpoint */
+	struct sdb_dns_job dns;				/* the lookup of the closest endpoint */
+	
+	int multiplexing;					/* whether to choose the HTTP version of the closest endpoint */
+	long http_version;					/* the chosen version (CURL_HTTP_VERSION_NONE = not chosen) */
+};
+
+
 /**
  * A SimpleDB handle
  */
@@ -157,10 +427,70 @@ struct SDB
 	CURLM* curl_multi;
 	
 	struct curl_slist *curl_headers;
+	
+	CURLSH* curl_share;
+	int share_process_wide;
+	
+	int multiplexing;
+	long http_version;
+	int compression;
+	int transport_profile;
+	
+	int max_idle_connections;
+	
+	
+	// Event loop
+	
+	struct sdb_event_loop loop;
+	
+	sdb_socket_hook socket_hook;
+	sdb_timer_hook timer_hook;
+	void* hook_data;
+	
+	
+	// Background I/O thread
+	
+	int io_running;
+	int io_stop;
+	pthread_t io_thread;
+	int io_wake[2];								/* the pipe that wakes the thread up */
+	
+	struct sdb_io_request* io_queue;			/* the lock-free submission stack (newest first) */
+	struct sdb_multi_data* io_finished;			/* the calls to free after their completion */
+	
+	pthread_mutex_t io_lock;					/* guards the completion of the requests */
+	pthread_cond_t io_done;
 
 	char* aws_url;
 	
 	
+	// Endpoint selection (the set is optional)
+	
+	struct sdb_endpoint* endpoints;
+	size_t num_endpoints;
+	int endpoint_interval;
+	time_t endpoint_next_probe;
+	struct sdb_probe_job* probe_job;		/* the background measurement in progress (if any) */
+	
+	
+	// Pinned addresses of the endpoint host (CURLOPT_RESOLVE lists, one per rotation)
+	
+	int dns_pinning;
+	int dns_interval;
+	time_t dns_next_refresh;
+	struct sdb_dns_job* dns_job;			/* the background lookup in progress (if any) */
+	
+	struct curl_slist** dns_pins;
+	int num_dns_pins;
+	unsigned dns_next;
+	
+	struct curl_slist** dns_retired;		/* the replaced lists, which the deferred calls may still use */
+	int num_dns_retired;
+	
+	struct curl_slist* dns_unpin;			/* removes the pinned entry from the DNS cache */
+	int dns_unpin_pending;
+	
+	
 	// SimpleDB Authentication
 	
 	char* sdb_key;
@@ -172,9 +502,30 @@ struct SDB
 	int sdb_signature_ver;
 	char sdb_signature_ver_str[2];
 	
+	sdb_hmac_ctx* sdb_hmac;
+	
+	char* sign_prefix;
+	size_t sign_prefix_len;
+	
 	
-	// Buffer for receiving data
+	// Request template (the pre-encoded constant parameters)
 	
+	struct sdb_fragment key_fragment;
+	struct sdb_fragment signature_method_fragment;
+	struct sdb_fragment signature_version_fragment;
+	char signature_version_text[32];
+	
+	struct sdb_action actions[SDB_MAX_ACTIONS];
+	int num_actions;
+	
+	struct sdb_fragment timestamp_fragment;
+	char timestamp_text[48];
+	time_t timestamp_time;
+	
+	
+	// Buffers for sending and receiving data
+	
+	struct sdb_buffer post;
 	struct sdb_buffer rec;
 	
 	
@@ -184,11 +535,53 @@ struct SDB
 	struct sdb_multi_data* multi_free;
 	int multi_free_size;
 	
+	int multi_window;		/* the maximum number of the calls in flight (0 = no limit) */
+	int multi_running;		/* the calls added to the multi handle that have not completed yet */
+	struct sdb_multi_data* queue_head;
+	struct sdb_multi_data* queue_tail;
+	int num_queued;
+	
+	sdb_multi_callback multi_callback;	/* for the calls made from now on */
+	void* multi_callback_data;
+	
+	CURLMsg* completed;		/* the completed transfers of the last run, in the order of completion */
+	int num_completed;
+	int next_completed;
+	int completed_capacity;
+	
+	
+	// Hedged reads (delay in ms, 0 = disabled)
+	
+	long hedge_delay;
+	int hedge_percentile;
+	
+	long hedge_samples[SDB_HEDGE_SAMPLES];
+	int num_hedge_samples;
+	
+	CURLM* hedge_multi;		/* races the sync handle against its duplicate, created on demand */
+	struct sdb_event_loop hedge_loop;
+	
 	
 	// Retry configuration
 	
 	int retry_count;
 	long retry_delay;
+	long retry_max_delay;		/* ms, the cap of the exponential backoff of the multi calls */
+	unsigned retry_seed;
+	
+	struct sdb_multi_data* retry_head;		/* the multi calls waiting for their retry, sorted by time */
+	struct sdb_multi_data* retry_tail;
+	
+	
+	// Timeouts (ms, 0 = none)
+	
+	long connect_timeout;
+	long request_timeout;
+	long stall_timeout;
+	long call_timeout;
+	
+	long long deadline;		/* the monotonic time by which the current call must finish, or 0 */
+	int deadline_depth;
 	
 	
 	// Other configuration
@@ -213,178 +606,673 @@ struct SDB
 CURL* sdb_create_curl(struct SDB* sdb);
 
 /**
- * Allocate a multi data structure
+ * Create the prefix of the string to sign for a service URL: the method,
+ * the host (as in the Host header) and the path
  * 
- * @param sdb the SimpleDB handle
- * @return the allocated data structure, or NULL on error
+ * @param url the service URL
+ * @param plen the pointer to the place to store the length of the prefix
+ * @return the prefix (must be freed by the caller), or NULL if the URL is not valid
+ *         or the memory could not be allocated
  */
-struct sdb_multi_data* sdb_multi_alloc(struct SDB* sdb);
+char* sdb_sign_prefix(const char* url, size_t* plen);
 
 /**
- * Free a multi data structure, reusing it if possible
+ * Create a Curl share object for connections, DNS and TLS sessions
  * 
- * @param sdb the SimpleDB handle
- * @param m the data structure to free
+ * @param locked whether to protect the object by locks, so that it can be used from several threads
+ * @return the share object, or NULL on error
  */
-void sdb_multi_free_one(struct SDB* sdb, struct sdb_multi_data* m); 
+CURLSH* sdb_share_create(int locked);
 
 /**
- * Free a chain of multi data structure, reusing it if possible
+ * Create the process-wide Curl share object
  * 
- * @param sdb the SimpleDB handle
- * @param m the first data structure of the chain
+ * @return SDB_OK if no errors occurred
  */
-void sdb_multi_free_chain(struct SDB* sdb, struct sdb_multi_data* m); 
+int sdb_global_share_init(void);
 
 /**
- * Destroy a chain of multi data structures
+ * Destroy the process-wide Curl share object
+ */
+void sdb_global_share_cleanup(void);
+
+/**
+ * Get the Curl share object used by the handle
  * 
  * @param sdb the SimpleDB handle
- * @param m the first data structure in the chain
+ * @return the share object
  */
-void sdb_multi_destroy(struct SDB* sdb, struct sdb_multi_data* m);
+CURLSH* sdb_share_get(struct SDB* sdb);
 
 /**
- * Find the multi data structure based on the Curl handle
+ * Choose the HTTP version for an endpoint when multiplexing: HTTP/2 is
+ * negotiated over TLS, while over cleartext the endpoint is probed for
+ * HTTP/2 with prior knowledge. This does not use the SimpleDB handle, so
+ * it can run in a background thread.
+ * 
+ * @param url the service URL
+ * @param share the share object to leave the connection in (NULL = none)
+ * @return the Curl HTTP version
+ */
+long sdb_http_version_probe(const char* url, CURLSH* share);
+
+/**
+ * Apply the HTTP version of the current endpoint and the multiplexing options
+ * to a Curl handle (this goes together with the URL, see sdb_target_apply)
  * 
- * @param chain the beginning of the chain
+ * @param sdb the SimpleDB handle
  * @param curl the Curl handle
- * @return the data structure, or NULL if not found
  */
-struct sdb_multi_data* sdb_multi_find(struct sdb_multi_data* chain, CURL* curl);
+void sdb_http_options_apply(struct SDB* sdb, CURL* curl);
 
 /**
- * Create a formatted UTC timestamp
+ * Point the handle to a service endpoint, deriving the signed host and path from the URL,
+ * and choose its HTTP version when multiplexing
  * 
- * @param buffer the buffer to which to write the timestamp (must be at least 32 bytes long)
+ * @param sdb the SimpleDB handle
+ * @param url the service URL
  * @return SDB_OK if no errors occurred
  */
-int sdb_timestamp(char* buffer);
+int sdb_endpoint_set(struct SDB* sdb, const char* url);
 
 /**
- * Sign a string
+ * Measure the round-trip time to each endpoint of the set in parallel and
+ * switch to the closest one
  * 
  * @param sdb the SimpleDB handle
- * @param str the string to sign
- * @param buffer the buffer to write the signature to (must be at least EVP_MAX_MD_SIZE * 2 bytes)
- * @param plen the pointer to the place to store the length of the signature (can be NULL)
  * @return SDB_OK if no errors occurred
  */
-int sdb_sign(struct SDB* sdb, const char* str, char* buffer, size_t* plen);
+int sdb_endpoint_probe(struct SDB* sdb);
 
 /**
- * Allocate an array for storing SimpleDB parameters
+ * Re-evaluate the endpoint set in the background if it is time to do so, and
+ * switch to the closest endpoint once a measurement completes
  * 
- * @param capacity the estimated capacity
- * @return the array
- */ 
-struct sdb_params* sdb_params_alloc(size_t capacity);
+ * @param sdb the SimpleDB handle
+ */
+void sdb_endpoint_update(struct SDB* sdb);
 
 /**
- * Free a parameters array
+ * Resolve the host of the current endpoint and pin its addresses, keeping
+ * the previously pinned addresses if the lookup fails
  * 
- * @param params the arrays to free
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred
  */
-void sdb_params_free(struct sdb_params* params);
+int sdb_dns_refresh(struct SDB* sdb);
 
 /**
- * Add a parameter (this routine will make a copy of its inputs)
+ * Resolve the host of a service URL. This does not use the SimpleDB handle,
+ * so it can run in a background thread.
  * 
- * @param params the parameter array
- * @param key the key
- * @param value the value
+ * @param job the lookup, with the URL set (the addresses are added to it)
  * @return SDB_OK if no errors occurred
  */
-int sdb_params_add(struct sdb_params* params, const char* key, const char* value);
+int sdb_dns_resolve(struct sdb_dns_job* job);
 
 /**
- * Add elements from another parameter array without making a copy of the inputs
+ * Pin the addresses found by a lookup, replacing the pinned ones
  * 
- * @param params the parameter array
- * @param other the other parameter array
- * @return SDB_OK if no errors occurred
+ * @param sdb the SimpleDB handle
+ * @param job the completed lookup
  */
-int sdb_params_add_all(struct sdb_params* params, struct sdb_params* other);
+void sdb_dns_pin(struct SDB* sdb, struct sdb_dns_job* job);
 
 /**
- * Sort the parameters by the keys
+ * Free the URL and the addresses of a lookup
  * 
- * @param params the parameter array
- * @return SDB_OK if no errors occurred
+ * @param job the lookup
  */
-int sdb_params_sort(struct sdb_params* params);
+void sdb_dns_job_clear(struct sdb_dns_job* job);
 
 /**
- * Create the URL-encoded parameters string
+ * Refresh the pinned addresses in the background if it is time to do so, and
+ * pin the new addresses once a lookup completes
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @param pbuffer the variable for the output buffer (will be allocated by the routine, but has to be freed by caller)
- * @return SDB_OK if no errors occurred
  */
-int sdb_params_export(struct SDB* sdb, struct sdb_params* params, char** pbuffer);
+void sdb_dns_update(struct SDB* sdb);
 
 /**
- * Add required SimpleDB parameters to the array
+ * Wait for the background lookup (if any) and discard its result
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @return SDB_OK if no errors occurred
  */
-int sdb_params_add_required(struct SDB* sdb, struct sdb_params* params);
+void sdb_dns_wait(struct SDB* sdb);
 
 /**
- * Deep copy the parameters
+ * Release the pinned addresses (the lists are freed once there are no deferred multi calls)
  * 
- * @param params the parameter array
- * @return the deep copy
+ * @param sdb the SimpleDB handle
  */
-struct sdb_params* sdb_params_deep_copy(struct sdb_params* params);
+void sdb_dns_cleanup(struct SDB* sdb);
 
 /**
- * Create the command URL
+ * Stop pinning the addresses, and remove the pinned entry from the shared
+ * DNS cache with the next request
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @return the URL, or NULL on error
  */
-char* sdb_url(struct SDB* sdb, struct sdb_params* params);
+void sdb_dns_unpin(struct SDB* sdb);
 
 /**
- * Create the command POST data
+ * Point a Curl handle to the current endpoint before a request, together
+ * with its HTTP version and the next rotation of the pinned addresses (if any)
  * 
  * @param sdb the SimpleDB handle
- * @param params the parameter array
- * @return the URL, or NULL on error
+ * @param curl the Curl handle
  */
-char* sdb_post(struct SDB* sdb, struct sdb_params* params);
+void sdb_target_apply(struct SDB* sdb, CURL* curl);
 
 /**
- * The Curl write callback function
+ * Free the endpoint set, discarding the background measurement (if any)
  * 
- * @param buffer the received buffer
- * @param size the size of an item
- * @param num the number of items
- * @param data the user data
- * @return the number of processed bytes
+ * @param sdb the SimpleDB handle
  */
-size_t sdb_write_callback(void* buffer, size_t size, size_t num, void* data);
+void sdb_endpoint_cleanup(struct SDB* sdb);
 
 /**
- * Execute a command and ignore the result-set
+ * Set the connect and stall timeouts of a Curl handle
  * 
  * @param sdb the SimpleDB handle
- * @param cmd the command name
- * @param params the parameters
- * @return the result
+ * @param curl the Curl handle
  */
-int sdb_execute(struct SDB* sdb, const char* cmd, struct sdb_params* params);
+void sdb_timeouts_apply(struct SDB* sdb, CURL* curl);
 
 /**
- * Execute a command
+ * Create the list of the HTTP headers for a transport profile
  * 
- * @param sdb the SimpleDB handle
- * @param cmd the command name
+ * @param profile the transport profile
+ * @return the list of headers
+ */
+struct curl_slist* sdb_headers_create(int profile);
+
+/**
+ * Set the HTTP headers and the TCP options of the transport profile on a Curl handle
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle
+ */
+void sdb_transport_apply(struct SDB* sdb, CURL* curl);
+
+/**
+ * Start a call, which sets its deadline unless it is nested in another call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_deadline_begin(struct SDB* sdb);
+
+/**
+ * Finish a call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_deadline_end(struct SDB* sdb);
+
+/**
+ * Check whether the deadline of the current call has passed
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if there is still time, or SDB_E_DEADLINE_EXCEEDED
+ */
+int sdb_deadline_check(struct SDB* sdb);
+
+/**
+ * Set the transfer timeout of a request, so that it ends by the deadline of the current call
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle of the request
+ * @return SDB_OK if there is still time, or SDB_E_DEADLINE_EXCEEDED
+ */
+int sdb_deadline_apply(struct SDB* sdb, CURL* curl);
+
+/**
+ * Wait before retrying a request, but not past the deadline of the current call
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_retry_wait(struct SDB* sdb);
+
+/**
+ * Translate a Curl error, distinguishing a missed deadline from other timeouts
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cr the Curl error
+ * @return the corresponding error code
+ */
+int sdb_transfer_error(struct SDB* sdb, CURLcode cr);
+
+/**
+ * Make sure that a buffer has at least the given capacity, growing it geometrically
+ * 
+ * @param buffer the buffer
+ * @param capacity the required capacity
+ * @return the buffer contents, or NULL if the memory could not be allocated
+ */
+char* sdb_buffer_reserve(struct sdb_buffer* buffer, size_t capacity);
+
+/**
+ * Empty a post buffer for reuse, releasing its memory if it grew past the high-water mark
+ * 
+ * @param buffer the buffer
+ */
+void sdb_buffer_trim(struct sdb_buffer* buffer);
+
+/**
+ * Release the unused capacity of a buffer, keeping its contents
+ * 
+ * @param buffer the buffer
+ */
+void sdb_buffer_fit(struct sdb_buffer* buffer);
+
+/**
+ * Allocate a multi data structure
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the allocated data structure, or NULL on error
+ */
+struct sdb_multi_data* sdb_multi_alloc(struct SDB* sdb);
+
+/**
+ * Free a multi data structure, reusing it if possible
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the data structure to free
+ */
+void sdb_multi_free_one(struct SDB* sdb, struct sdb_multi_data* m); 
+
+/**
+ * Free a chain of multi data structure, reusing it if possible
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the first data structure of the chain
+ */
+void sdb_multi_free_chain(struct SDB* sdb, struct sdb_multi_data* m); 
+
+/**
+ * Destroy a chain of multi data structures
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the first data structure in the chain
+ */
+void sdb_multi_destroy(struct SDB* sdb, struct sdb_multi_data* m);
+
+/**
+ * Start the queued calls while there is room in the in-flight window
+ * 
+ * @param sdb the SimpleDB handle
+ * @param running the pointer to the number of the calls in flight, which is updated
+ * @return the number of the started calls
+ */
+int sdb_multi_admit(struct SDB* sdb, int* running);
+
+/**
+ * Finish a queued call that could not be started with the given transfer
+ * error, so that it is reported instead of never completing
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure of the call
+ * @param cr the transfer error
+ */
+void sdb_multi_abort(struct SDB* sdb, struct sdb_multi_data* m, CURLcode cr);
+
+/**
+ * Remove a multi data structure from the chain of deferred calls
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the data structure to remove
+ */
+void sdb_multi_unlink(struct SDB* sdb, struct sdb_multi_data* m);
+
+/**
+ * Find the multi data structure based on the Curl handle
+ * 
+ * @param curl the Curl handle
+ * @return the data structure, or NULL if the handle does not belong to a deferred call
+ */
+struct sdb_multi_data* sdb_multi_find(CURL* curl);
+
+/**
+ * Create the response of a deferred call that failed before it got a response
+ * 
+ * @param handle the handle of the deferred call
+ * @param r the error code
+ * @return the response
+ */
+struct sdb_response* sdb_multi_error_response(sdb_multi handle, int r);
+
+/**
+ * Process the transfers that completed outside of sdb_multi_run_and_wait()
+ * (with the event loop hooks): invoke the completion callbacks and schedule
+ * the retries, and then start the due retries and the queued calls
+ * 
+ * @param sdb the SimpleDB handle
+ * @param running the pointer to the number of the calls in flight, which is updated
+ */
+void sdb_multi_progress(struct SDB* sdb, int* running);
+
+/**
+ * Pass a multi call to the background I/O thread. The parts of a split
+ * batch are held back until sdb_io_batch_end().
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters (a copy of which is made)
+ * @param next_token the next token (optional, a copy of which is made)
+ * @param prepared the prepared statement that the parameters bind (optional, it is kept until the call starts)
+ * @return the handle of the call, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_io_submit(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_prepared* prepared);
+
+/**
+ * Start the background I/O thread
+ * 
+ * @param sdb the SimpleDB handle
+ * @return SDB_OK if no errors occurred, or SDB_E_IO_THREAD_FAILED otherwise
+ */
+int sdb_io_thread_create(struct SDB* sdb);
+
+/**
+ * Let the background I/O thread complete the submitted calls, and wait for it to exit
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_io_thread_join(struct SDB* sdb);
+
+/**
+ * Split a batch into chunks that comply with the SimpleDB limits (at most
+ * SDB_MAX_BATCH_ITEMS items and SDB_MAX_BATCH_SIZE bytes per request). An item
+ * with more than SDB_MAX_BATCH_ATTRIBUTES attributes gets a chunk of its own.
+ * 
+ * @param num the number of items
+ * @param items the items
+ * @param replace whether the attributes would be replaced
+ * @param starts the output array of the indices of the first items of the chunks (must have room for num + 1 elements)
+ * @return the number of chunks (starts[number of chunks] will be set to num)
+ */
+size_t sdb_batch_split(size_t num, const struct sdb_item* items, int replace, size_t* starts);
+
+/**
+ * Put or replace the attributes of a batch of items, splitting it into several
+ * requests if it does not fit the SimpleDB limits
+ * 
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @param replace whether the attributes are replaced
+ * @param f the function that executes a single request
+ * @param mf the function that defers a single request
+ * @return SDB_OK if no errors occurred, SDB_E_PARTIAL_BATCH if only some
+ *         of the requests failed, or the error of the first failed request
+ */
+int sdb_batch_execute(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items, int replace,
+					  sdb_batch_function f, sdb_multi_batch_function mf);
+
+/**
+ * Defer putting or replacing the attributes of a batch of items, splitting it into
+ * several requests if it does not fit the SimpleDB limits
+ * 
+ * @param sdb the SimpleDB handle
+ * @param domain the domain name
+ * @param num the number of items
+ * @param items the array of items and their attributes
+ * @param replace whether the attributes are replaced
+ * @param mf the function that defers a single request
+ * @return the handle shared by the responses of all requests, or SDB_MULTI_ERROR on error
+ */
+sdb_multi sdb_multi_batch_execute(struct SDB* sdb, const char* domain, size_t num, const struct sdb_item* items, int replace,
+								  sdb_multi_batch_function mf);
+
+/**
+ * Create a formatted UTC timestamp
+ * 
+ * @param buffer the buffer to which to write the timestamp (must be at least 32 bytes long)
+ * @param t the time
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_timestamp(char* buffer, time_t t);
+
+/**
+ * Get the pre-encoded Timestamp parameter (formatted at most once per second)
+ * 
+ * @param sdb the SimpleDB handle
+ * @return the fragment
+ */
+const struct sdb_fragment* sdb_timestamp_fragment(struct SDB* sdb);
+
+/**
+ * Pre-encode the constant parameters of the handle
+ * 
+ * @param sdb the SimpleDB handle (with the key and the signature version already set)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_template_init(struct SDB* sdb);
+
+/**
+ * Free the pre-encoded parameters of the handle
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_template_cleanup(struct SDB* sdb);
+
+/**
+ * Get the pre-encoded parameters of an action, encoding them on the first use
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @return the action
+ */
+const struct sdb_action* sdb_action_get(struct SDB* sdb, const char* cmd);
+
+/**
+ * Create the keyed HMAC context for signing requests
+ * 
+ * @param sdb the SimpleDB handle (with the secret key already set)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_sign_init(struct SDB* sdb);
+
+/**
+ * Destroy the keyed HMAC context
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_sign_cleanup(struct SDB* sdb);
+
+/**
+ * Sign the URL-encoded parameters string (prefixed by the method, host and path)
+ * 
+ * @param sdb the SimpleDB handle
+ * @param str the string to sign
+ * @param length the length of the string
+ * @param buffer the buffer to write the signature to (must be at least EVP_MAX_MD_SIZE * 2 bytes)
+ * @param plen the pointer to the place to store the length of the signature (can be NULL)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_sign(struct SDB* sdb, const char* str, size_t length, char* buffer, size_t* plen);
+
+/**
+ * Allocate an array for storing SimpleDB parameters
+ * 
+ * @param capacity the estimated capacity
+ * @return the array
+ */ 
+struct sdb_params* sdb_params_alloc(size_t capacity);
+
+/**
+ * Free a parameters array (or release a reference to a shared array)
+ * 
+ * @param params the arrays to free
+ */
+void sdb_params_free(struct sdb_params* params);
+
+/**
+ * Add a parameter. The key is copied to the arena of the array, but the value
+ * is borrowed, so it must stay valid for as long as the array is used.
+ * 
+ * @param params the parameter array
+ * @param key the key
+ * @param value the value
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_add(struct sdb_params* params, const char* key, const char* value);
+
+/**
+ * Add elements from another parameter array without making a copy of the inputs
+ * 
+ * @param params the parameter array
+ * @param other the other parameter array
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_add_all(struct sdb_params* params, struct sdb_params* other);
+
+/**
+ * Sort the parameters by the keys. If all but a few parameters (at most
+ * SDB_MAX_PARAMS_MERGE) already form a sorted run, such as the keys generated
+ * by the batch commands, the remaining ones are merged in linear time.
+ * 
+ * @param params the parameter array
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_sort(struct sdb_params* params);
+
+/**
+ * Create the signed URL-encoded parameters string. The pre-encoded required
+ * parameters (Action, Timestamp, Version, etc.) are merged with the sorted
+ * command parameters.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters (will be sorted)
+ * @param next_token the next token (optional)
+ * @param out the output buffer (will be grown as needed)
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_params_export(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_buffer* out);
+
+/**
+ * Get an immutable copy of the parameters that can be kept after the call
+ * returns (e.g. for retries or NEXT handling). The copy is stored in a single
+ * memory block, and retaining an already immutable array just increments its
+ * reference count.
+ * 
+ * @param params the parameter array
+ * @return the immutable copy (release it using sdb_params_free)
+ */
+struct sdb_params* sdb_params_retain(struct sdb_params* params);
+
+/**
+ * Get an immutable copy of a parameter array with some of its values replaced,
+ * which shares the keys and the other values with the array instead of copying
+ * them (only the pairs and the bound values are stored)
+ * 
+ * @param base the immutable parameter array (e.g. of a prepared statement)
+ * @param positions the index of each bound value in the array
+ * @param values the bound values
+ * @param num the number of the bound values
+ * @return the immutable copy (release it using sdb_params_free), or NULL on error
+ */
+struct sdb_params* sdb_params_bind(struct sdb_params* base, const size_t* positions, const char** values, size_t num);
+
+/**
+ * Create the command URL
+ * 
+ * @param sdb the SimpleDB handle
+ * @param params the parameter array
+ * @return the URL, or NULL on error
+ */
+char* sdb_url(struct SDB* sdb, struct sdb_params* params);
+
+/**
+ * Create the command POST data
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters
+ * @param next_token the next token (optional)
+ * @param out the output buffer (will be grown as needed)
+ * @return the POST data (owned by the buffer), or NULL on error
+ */
+char* sdb_post(struct SDB* sdb, const char* cmd, struct sdb_params* params, const char* next_token, struct sdb_buffer* out);
+
+/**
+ * Create a prepared statement, pre-encoding all but the varying values
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the command parameters (the values of the varying ones are ignored)
+ * @param sources for each parameter, the index of its value, or SDB_PREPARED_CONST
+ * @param num_values the number of the varying values
+ * @param pprepared the variable for the prepared statement
+ * @return SDB_OK if no errors occurred
+ */
+int sdb_prepared_create(struct SDB* sdb, const char* cmd, struct sdb_params* params, const int* sources, size_t num_values, struct sdb_prepared** pprepared);
+
+/**
+ * Destroy a prepared statement (or release a reference of a call that still uses it)
+ * 
+ * @param prepared the prepared statement
+ */
+void sdb_prepared_destroy(struct sdb_prepared* prepared);
+
+/**
+ * Create the POST data of a prepared statement
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @param out the output buffer (will be grown as needed)
+ * @return the POST data (owned by the buffer), or NULL on error
+ */
+char* sdb_prepared_post(struct SDB* sdb, struct sdb_prepared* prepared, const char** values, struct sdb_buffer* out);
+
+/**
+ * The Curl write callback function
+ * 
+ * @param buffer the received buffer
+ * @param size the size of an item
+ * @param num the number of items
+ * @param data the user data
+ * @return the number of processed bytes
+ */
+size_t sdb_write_callback(void* buffer, size_t size, size_t num, void* data);
+
+/**
+ * Execute a command and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param params the parameters
+ * @return the result
+ */
+int sdb_execute(struct SDB* sdb, const char* cmd, struct sdb_params* params);
+
+/**
+ * Execute a command with the POST data already created in the post buffer
+ * of the handle and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @return the result
+ */
+int sdb_execute_post(struct SDB* sdb, const char* cmd);
+
+/**
+ * Execute a prepared statement and ignore the result-set
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @return the result
+ */
+int sdb_execute_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char** values);
+
+/**
+ * Execute a command
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
  * @param params the parameters
  * @param result the pointer to the result-set
  * @return the result
@@ -404,6 +1292,30 @@ int sdb_execute_rs(struct SDB* sdb, const char* cmd, struct sdb_params* params,
  */
 sdb_multi sdb_execute_multi(struct SDB* sdb, const char* cmd, struct sdb_params* params, char* next_token, void* user_data, void* user_data_2);
 
+/**
+ * Execute a command using Curl's multi interface, with the POST data already
+ * created in the post buffer of the given multi data structure
+ * 
+ * @param sdb the SimpleDB handle
+ * @param m the multi data structure (at the head of the chain of deferred calls)
+ * @param cmd the command name
+ * @param params the parameters (a copy of which is kept for retries)
+ * @param user_data the user data (optional)
+ * @param user_data_2 the user data (optional)
+ * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
+ */
+sdb_multi sdb_execute_multi_post(struct SDB* sdb, struct sdb_multi_data* m, const char* cmd, struct sdb_params* params, void* user_data, void* user_data_2);
+
+/**
+ * Execute a prepared statement using Curl's multi interface
+ * 
+ * @param sdb the SimpleDB handle
+ * @param prepared the prepared statement
+ * @param values the varying values
+ * @return the handle to the deferred call, or SDB_MULTI_ERROR on error 
+ */
+sdb_multi sdb_execute_multi_prepared(struct SDB* sdb, struct sdb_prepared* prepared, const char** values);
+
 /**
  * Run all deferred multi calls and wait for the result
  * 
@@ -412,6 +1324,104 @@ sdb_multi sdb_execute_multi(struct SDB* sdb, const char* cmd, struct sdb_params*
  */
 int sdb_multi_run_and_wait(struct SDB* sdb);
 
+/**
+ * Get the next completed transfer of the last sdb_multi_run_and_wait(), in
+ * the same manner as curl_multi_info_read(). Only the winner of a hedged
+ * read is reported, and the calls with completion callbacks are not.
+ * 
+ * @param sdb the SimpleDB handle
+ * @param remaining the pointer to the number of the remaining messages
+ * @return the message, or NULL if there are no more
+ */
+CURLMsg* sdb_multi_info_read(struct SDB* sdb, int* remaining);
+
+/**
+ * Get the delay after which a read is duplicated
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name (NULL = any read)
+ * @return the delay in ms, or 0 if the command should not be hedged
+ */
+long sdb_hedge_delay(struct SDB* sdb, const char* cmd);
+
+/**
+ * Record the latency of a completed read for the hedging percentile
+ * 
+ * @param sdb the SimpleDB handle
+ * @param cmd the command name
+ * @param curl the Curl handle of the request
+ */
+void sdb_hedge_sample(struct SDB* sdb, const char* cmd, CURL* curl);
+
+/**
+ * Perform a read on the sync handle, racing it against a duplicate sent
+ * after the hedging delay
+ * 
+ * @param sdb the SimpleDB handle
+ * @param delay the hedging delay (ms)
+ * @param phedge the pointer to the data structure of the winning duplicate (set to NULL if the original won),
+ *               which the caller frees with sdb_multi_free_one() after reading its statistics
+ * @return the Curl result
+ */
+CURLcode sdb_perform_hedged(struct SDB* sdb, long delay, struct sdb_multi_data** phedge);
+
+/**
+ * Initialize an event loop. Without epoll, the loop falls back to polling
+ * the sockets with curl_multi_wait()
+ * 
+ * @param loop the event loop
+ */
+void sdb_event_loop_init(struct sdb_event_loop* loop);
+
+/**
+ * Destroy an event loop
+ * 
+ * @param loop the event loop
+ */
+void sdb_event_loop_cleanup(struct sdb_event_loop* loop);
+
+/**
+ * Update the interest of the event loop in a socket
+ * 
+ * @param loop the event loop
+ * @param s the socket
+ * @param what the Curl socket interest (CURL_POLL_*)
+ */
+void sdb_event_loop_socket(struct sdb_event_loop* loop, curl_socket_t s, int what);
+
+/**
+ * Set the descriptor that interrupts the wait of an event loop when it
+ * becomes readable (the loop drains it)
+ * 
+ * @param loop the event loop
+ * @param fd the non-blocking read end of a pipe, or -1 to remove it
+ */
+void sdb_event_loop_wakeup(struct sdb_event_loop* loop, int fd);
+
+/**
+ * Let an event loop drive the transfers of a Curl multi handle
+ * 
+ * @param loop the event loop
+ * @param multi the Curl multi handle
+ */
+void sdb_event_loop_attach(struct sdb_event_loop* loop, CURLM* multi);
+
+/**
+ * Let the event loop of a SimpleDB handle (or its hooks) drive its multi handle
+ * 
+ * @param sdb the SimpleDB handle
+ */
+void sdb_multi_attach(struct SDB* sdb);
+
+/**
+ * Run all transfers of a Curl multi handle and wait for them to complete
+ * 
+ * @param loop the event loop attached to the multi handle, or NULL
+ * @param multi the Curl multi handle
+ * @return the result
+ */
+int sdb_event_loop_wait(struct sdb_event_loop* loop, CURLM* multi);
+
 /**
  * Parse the response
  * 
@@ -441,6 +1451,14 @@ void sdb_retry_destroy_chain(struct sdb_retry_data* retry);
  */ 
 void sdb_update_size_stats(struct SDB* sdb, CURL* curl, long post_size, long rec_size);
 
+/**
+ * Update the connection statistics after a transfer
+ * 
+ * @param sdb the SimpleDB handle
+ * @param curl the Curl handle of the transfer
+ */
+void sdb_update_connection_stats(struct SDB* sdb, CURL* curl);
+
 /**
  * Add two statistics objects
  * 
@@ -467,6 +1485,40 @@ long sdb_estimate_http_sent(struct SDB* sdb, long post_size);
  */ 
 long sdb_estimate_http_received(struct SDB* sdb, long response_size);
 
+/**
+ * Select the URL-encoding kernels. Other than for SIMD_BEST, this is meant
+ * only for testing the individual kernels. This is not thread-safe, so no
+ * other thread may use the library meanwhile.
+ * 
+ * @param level the kernel level (SIMD_SCALAR, SIMD_128 or SIMD_256), or SIMD_BEST
+ * @return the selected level, or -1 if the CPU does not support it
+ */
+int sdb_escape_select(int level);
+
+/**
+ * Select the best URL-encoding kernels for this CPU, unless it was already done
+ */
+void sdb_escape_init(void);
+
+/**
+ * Compute the length of a string after URL-encoding
+ * 
+ * @param string the string to escape
+ * @param length the length of the string
+ * @return the length of the escaped string (without the terminating '\0')
+ */
+size_t sdb_escape_length(const char* string, size_t length);
+
+/**
+ * URL-encode a string into a buffer
+ * 
+ * @param buffer the output buffer (must have room for sdb_escape_length() + 1 bytes)
+ * @param string the string to escape
+ * @param length the length of the string
+ * @return the number of bytes written (without the terminating '\0')
+ */
+size_t sdb_escape_to(char* buffer, const char* string, size_t length);
+
 /**
  * Slight modification to curl_easy_escape, since it escapes a few characters
  * that the SimpleDB API does not want escaped.
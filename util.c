@@ -92,6 +92,19 @@ size_t base64(const unsigned char *input, size_t length, char* output, size_t ol
 }
 
 
+/**
+ * Get the time of a monotonic clock
+ * 
+ * @return the time in milliseconds
+ */
+long long monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
 /**
  * Compute the number of digits of a number
  * 
@@ -106,3 +119,31 @@ int digits(int num, int base)
 	for (n = num; n >= base; n /= base) d++;
 	return d;
 }
+
+
+/**
+ * Compute the order in which the decimal representations of 0 ... n-1
+ * sort as strings (e.g. 0, 1, 10, 11, 2, 3, ... for n = 12)
+ * 
+ * @param order the output array (must have room for n elements)
+ * @param n the number of elements
+ */
+void decimal_order(unsigned* order, unsigned n)
+{
+	unsigned i, cur = 1;
+	
+	if (n == 0) return;
+	order[0] = 0;
+	
+	for (i = 1; i < n; i++) {
+		order[i] = cur;
+		
+		if (cur * 10 < n) {
+			cur *= 10;
+		}
+		else {
+			while (cur % 10 == 9 || cur + 1 >= n) cur /= 10;
+			cur++;
+		}
+	}
+}
@@ -33,6 +33,15 @@
  */
 
 
+/**
+ * The levels of the vectorized kernels, selected at run time
+ */
+#define SIMD_BEST		-1		/* the best level supported by the CPU */
+#define SIMD_SCALAR		0		/* the portable reference implementation */
+#define SIMD_128		1		/* 128-bit vectors (SSE2 or SSSE3) */
+#define SIMD_256		2		/* 256-bit vectors (AVX2) */
+
+
 /**
  * Perform a Base64 encoding
  * 
@@ -44,6 +53,13 @@
  */
 size_t base64(const unsigned char *input, size_t length, char* output, size_t olength);
 
+/**
+ * Get the time of a monotonic clock
+ * 
+ * @return the time in milliseconds
+ */
+long long monotonic_ms(void);
+
 /**
  * Compute the number of digits of a number
  * 
@@ -52,3 +68,12 @@ size_t base64(const unsigned char *input, size_t length, char* output, size_t ol
  * @return the number of digits
  */
 int digits(int num, int base);
+
+/**
+ * Compute the order in which the decimal representations of 0 ... n-1
+ * sort as strings (e.g. 0, 1, 10, 11, 2, 3, ... for n = 12)
+ * 
+ * @param order the output array (must have room for n elements)
+ * @param n the number of elements
+ */
+void decimal_order(unsigned* order, unsigned n);